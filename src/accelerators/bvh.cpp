@@ -4,6 +4,22 @@
 #include "stats.h"
 #include "clock.h"
 #include "parallel.h"
+#include "shape/triangle.h"
+
+#include <filesystem>
+#include <queue>
+#include <mutex>
+#include <random>
+#include <typeinfo>
+#include <unordered_set>
+#if defined(PBRT_HAVE_MMAP)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 
 
 namespace pbrt {
@@ -11,24 +27,99 @@ namespace pbrt {
 STAT_COUNTER("BVH/BVHBuildNode/LeafNode", LeafNodes);
 STAT_COUNTER("BVH/BVHBuildNode/Interior", InteriorNodes);
 STAT_COUNTER("BVH/HITTIMES", HitTimes);
+STAT_COUNTER("BVH/SBVH/DuplicatedReferences", DuplicatedReferences);
+STAT_COUNTER("BVH/PreSplit/SplitReferences", PreSplitReferenceCount);
+STAT_COUNTER("BVH/Lazy/BuiltSubtrees", LazySubtreesBuilt);
+STAT_COUNTER("BVH/Lazy/Subtrees", LazySubtreesTotal);
+STAT_COUNTER("BVH/RayPackets", RayPackets);
+STAT_COUNTER("BVH/StreamRays", StreamRays);
+STAT_COUNTER("BVH/DistanceOrdered/BoundTests", OrderedBoundTests);
+STAT_COUNTER("BVH/DistanceOrdered/CulledEntries", OrderedCulledEntries);
 STAT_MEMORY_COUNTER("BVH/LinearBVHNode", LinearTreeBytes);
+STAT_MEMORY_COUNTER("BVH/PackedTriangle", PackedTriangleBytes);
+STAT_MEMORY_COUNTER("BVH/ParentLinks", ParentLinkBytes);
+STAT_COUNTER("BVH/ShortStack/Backtracks", ParentLinkBacktracks);
+STAT_FLOAT_DISTRIBUTION("BVH/Quality/SAH cost", SAHCost);
+STAT_FLOAT_DISTRIBUTION("BVH/Quality/End-point overlap", EndPointOverlap);
+STAT_FLOAT_DISTRIBUTION("BVH/Quality/Sibling overlap ratio", SiblingOverlap);
+STAT_INT_DISTRIBUTION("BVH/Quality/Leaf depth", LeafDepth);
+STAT_INT_DISTRIBUTION("BVH/Quality/Primitives per leaf", PrimitivesPerLeaf);
+
 /**
- * A linear BVH node, use it, we can avoid recursive traversal BVH tree, it will prompt performance
+ * A compressed interior node, the bounds of its two children are quantized to 8 bits on a grid over the node bound.
+ * A leaf child is not stored as a node, its primitive range is kept in the parent, so there are only interior nodes.
 */
-struct LinearBVHNode {
-    Bounds3f bound; // The bound of the node
-    union
-    {
-        int primitiveOffset; // Only for leaf node, it represents the staring index in the `primitives`
-        int secondChildOffset; // Only for interior node, it represents the second node index in the `primitives`. becase we will use DFS(deep first search) travelsal for the BVH tree, the first child will be recorded with current interior node index + 1, it is knew for us. So we only need to record the second child index in interior node
-    };
-    uint16_t nPrimitives; // Only for leaf node, it represents how many primitives in the leaf node. If we have primitiveOffset and nPrimitives, we can travelsal all primitives in the node. What's more we use this to distinguish if the node is leaf or interior. If this nPrimitives equal zero, we will see it as leaf node, otherwise interior node.
-    uint8_t axis; // Only for interior, it represents which axies the node had been splited.
-    uint8_t pad[1]; // make sure 32 bytes for whole struct, it will more effective for CPU
+struct CompressedBVHNode {
+    float origin[3]; // The minimum corner of the grid, it is the node bound rounded down
+    int8_t exponent[3]; // The cell size of the grid is 2^exponent in each axis, 255 cells cover the node bound
+    uint8_t axis; // Same with LinearBVHNode, it decides which child is visited first
+    uint8_t childMin[2][3]; // The quantized bounds of the two children, they are rounded outward, so they always contain the actual bounds
+    uint8_t childMax[2][3];
+    uint16_t nPrimitives[2]; // How many primitives a leaf child has, 0 means the child is an interior node
+    int32_t childOffset[2]; // For interior children, it is the index in compressedNodes, for leaf children, it is the starting index in the `primitives`
+};
+static_assert(sizeof(CompressedBVHNode) == 40, "CompressedBVHNode should be 40 bytes");
+
+/**
+ * The vertices of a triangle copied in the order of BVH leaves, a NaN in p[0].x marks a primitive which is not a triangle.
+*/
+struct PackedTriangle {
+    Point3f p[3];
+};
+
+/**
+ * The node and primitive arrays a traversal reads, they are the whole tree or a lazy subtree with its own arrays.
+*/
+struct BVHTreeView {
+    const LinearBVHNode *nodes;
+    const std::shared_ptr<Primitive> *primitives; // The primitives indexed by leaves
+    const PackedTriangle *packedTriangles; // Null if the triangles are not packed
+    bool siblingPairs; // See BVHAccel::ChildIndex
+    int depth; // The maximum depth of leaves, a deeper tree than STACK_SIZE allocates the stack on the heap
+
+    int ChildIndex(int index, int child) const {
+        if(siblingPairs) return nodes[index].secondChildOffset + child;
+        return child == 0 ? index + 1 : nodes[index].secondChildOffset;
+    }
+};
+
+/**
+ * A subtree of the lazy BVH, it is built by the first ray reaching it. Its leaves index its own primitives.
+*/
+struct LazySubtree {
+    ~LazySubtree() {
+        FreeAligned(nodes);
+        FreeAligned(packedTriangles);
+    }
+    std::once_flag built;
+    std::vector<BVHPrimitiveInfo> infos; // The references of the subtree, they are released after building
+    std::vector<std::shared_ptr<Primitive>> primitives; // The primitives in the order of leaves
+    LinearBVHNode *nodes = nullptr; // The linear nodes in the depth first order
+    PackedTriangle *packedTriangles = nullptr; // The packed triangles of primitives, see BVHAccel::PackTriangles
+    int depth = 0; // The maximum depth of leaves
+
+    BVHTreeView View() const { return {nodes, primitives.data(), packedTriangles, false, depth}; }
+};
+
+/**
+ * A subtree watched by Refit, it is rebuilt when its SAH cost degrades too much.
+*/
+struct RefitSubtree {
+    int nodeIndex; // The index of the subtree root in nodes
+    Float baselineCost; // The SAH cost of the subtree after it was built
+};
+
+/**
+ * A child waiting on the traversal stack of the compressed tree, it is a leaf if nPrimitives is greater than 0.
+*/
+struct BVHStackItem {
+    int32_t offset;
+    int32_t nPrimitives;
 };
 
 /**
- * A intermediate node for recursive build bvh node, then they will be transformed as LinearBVHNodes
+ * A intermediate node for recursive build bvh node, then they will be transformed as LinearBVHNodes.
+ * They are allocated in a MemoryArena and released together after flattening, so the destructor is never called.
 */
 struct BVHBuildNode {
     void InitLeaf(int first, int n, const Bounds3f &b){
@@ -38,7 +129,7 @@ struct BVHBuildNode {
         ++LeafNodes;
         children[0] = children[1] = nullptr;
     }
-    void InitInterior(int axis, std::shared_ptr<BVHBuildNode> c0, std::shared_ptr<BVHBuildNode> c1) {
+    void InitInterior(int axis, BVHBuildNode *c0, BVHBuildNode *c1) {
         splitAxis = axis;
         children[0] = c0;
         children[1] = c1;
@@ -47,10 +138,11 @@ struct BVHBuildNode {
         ++InteriorNodes;
     }
     Bounds3f bound;
-    std::shared_ptr<BVHBuildNode> children[2]; // Only for interior node
+    BVHBuildNode *children[2]; // Only for interior node, the children are allocated in the same arena
     int splitAxis; // Only for interior node
     int primitiveOffset; // Only for leaf node
     int nPrimitives; // Only for leaf node
+    Float cost; // The SAH cost of the subtree multiplied by its surface area, only used by the treelet optimization
 };
 
 /**
@@ -78,61 +170,766 @@ struct BucketInfo {
     Bounds3f bound; // The bound of these primitives
 };
 
-BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> ps, SplitMethod sm, int maxPrimsInNode): primitives(std::move(ps)), method(sm), maxPrimitivesInNode(maxPrimsInNode), nodes(nullptr) {
+/**
+ * A bin for spatial splits, a reference is clipped by every bin it overlaps.
+ * The reference enters the tree from its first bin and exits from its last bin.
+*/
+struct SpatialBin {
+    Bounds3f bound; // The bound of clipped references in the bin
+    int entries = 0; // How many references start in the bin
+    int exits = 0; // How many references end in the bin
+};
+
+inline bool IsEmpty(const Bounds3f &b) {
+    return b.pMin.x > b.pMax.x || b.pMin.y > b.pMax.y || b.pMin.z > b.pMax.z;
+}
+
+/**
+ * A subtree which is deferred by the upper levels building, all tasks will be built in parallel.
+*/
+struct BVHBuildTask {
+    BVHBuildNode *node; // A placeholder node in the upper tree, it will be overwritten by the root of the subtree
+    int begin, end; // The range of the subtree in the primitiveInfos
+    int totalNodes = 0; // How many nodes the subtree has
+};
+
+/**
+ * Compute the bound and centroid bound of primitiveInfos[begin, end).
+ * If parallel is true, the range will be divided into chunks and each thread computes some chunks.
+ * Union of bounds doesn't depend on the order, so the result is same with serial computing.
+*/
+static void ComputeBounds(const std::vector<BVHPrimitiveInfo> &primitiveInfos, int begin, int end, bool parallel, int chunkSize, Bounds3f &bounds, Bounds3f &centroidBounds) {
+    if(!parallel) {
+        for(int i = begin; i < end; ++i) {
+            bounds = Union(bounds, primitiveInfos[i].bound);
+            centroidBounds = Union(centroidBounds, primitiveInfos[i].centroid);
+        }
+        return;
+    }
+    int nChunks = (end - begin + chunkSize - 1) / chunkSize;
+    std::vector<Bounds3f> chunkBounds(nChunks), chunkCentroidBounds(nChunks);
+    ParallelForLoopExecutor::ParallelFor1D([&](int64_t chunk){
+        int chunkBegin = begin + chunk * chunkSize;
+        int chunkEnd = std::min(chunkBegin + chunkSize, end);
+        for(int i = chunkBegin; i < chunkEnd; ++i) {
+            chunkBounds[chunk] = Union(chunkBounds[chunk], primitiveInfos[i].bound);
+            chunkCentroidBounds[chunk] = Union(chunkCentroidBounds[chunk], primitiveInfos[i].centroid);
+        }
+    }, nChunks, 1);
+    for(int i = 0; i < nChunks; ++i) {
+        bounds = Union(bounds, chunkBounds[i]);
+        centroidBounds = Union(centroidBounds, chunkCentroidBounds[i]);
+    }
+}
+
+/**
+ * Put primitiveInfos[begin, end) into nBuckets buckets by its centroid offset in the dim axis.
+ * The parallel version counts each chunk separately then merges them, the result is same with serial computing.
+*/
+static void ComputeBuckets(const std::vector<BVHPrimitiveInfo> &primitiveInfos, int begin, int end, const Bounds3f &centroidBounds, int dim, bool parallel, int chunkSize, BucketInfo *buckets, int nBuckets) {
+    auto fillBuckets = [&](int first, int last, BucketInfo *bs) {
+        for(int i = first; i < last; ++i) { // partition primitves into buckets by each in centroid bound ratio
+            int b = centroidBounds.Offset(primitiveInfos[i].centroid)[dim] * nBuckets;
+            if(b == nBuckets) --b;
+            DCHECK_GE(b, 0);
+            DCHECK_LT(b, nBuckets);
+            ++bs[b].count;
+            bs[b].bound = Union(bs[b].bound, primitiveInfos[i].bound);
+        }
+    };
+    if(!parallel) {
+        fillBuckets(begin, end, buckets);
+        return;
+    }
+    int nChunks = (end - begin + chunkSize - 1) / chunkSize;
+    std::vector<BucketInfo> chunkBuckets(nChunks * nBuckets);
+    ParallelForLoopExecutor::ParallelFor1D([&](int64_t chunk){
+        int chunkBegin = begin + chunk * chunkSize;
+        int chunkEnd = std::min(chunkBegin + chunkSize, end);
+        fillBuckets(chunkBegin, chunkEnd, &chunkBuckets[chunk * nBuckets]);
+    }, nChunks, 1);
+    for(int i = 0; i < nChunks; ++i) {
+        for(int b = 0; b < nBuckets; ++b) {
+            buckets[b].count += chunkBuckets[i * nBuckets + b].count;
+            buckets[b].bound = Union(buckets[b].bound, chunkBuckets[i * nBuckets + b].bound);
+        }
+    }
+}
+
+/**
+ * A primitive with its Morton code, HLBVH sorts primitives by Morton code, so the primitives near in space are near in the array.
+*/
+struct MortonPrimitive {
+    int primitiveIndex; // The index in the primitiveInfos
+    uint32_t mortonCode;
+};
+
+/**
+ * Execute func from 0 to count with ParallelForLoopExecutor if parallel is true, otherwise execute it in current thread.
+*/
+static void ParallelFor(bool parallel, const std::function<void(int64_t)> &func, int64_t count, int chunkSize) {
+    if(parallel) {
+        ParallelForLoopExecutor::ParallelFor1D(func, count, chunkSize);
+    } else {
+        for(int64_t i = 0; i < count; ++i) 
+            func(i);
+    }
+}
+
+/**
+ * Spread the low 10 bits of x, there are two zero bits between each two bits. 
+ * Then the three axes can be interleaved into a 30-bit Morton code.
+*/
+inline uint32_t LeftShift3(uint32_t x) {
+    DCHECK_LE(x, (1 << 10));
+    if(x == (1 << 10)) --x;
+    x = (x | (x << 16)) & 0b00000011000000000000000011111111;
+    x = (x | (x << 8)) & 0b00000011000000001111000000001111;
+    x = (x | (x << 4)) & 0b00000011000011000011000011000011;
+    x = (x | (x << 2)) & 0b00001001001001001001001001001001;
+    return x;
+}
+
+/**
+ * Encode a point whose coordinates are in [0, 1024] into a 30-bit Morton code.
+*/
+inline uint32_t EncodeMorton3(const Vector3f &v) {
+    DCHECK_GE(v.x, 0);
+    DCHECK_GE(v.y, 0);
+    DCHECK_GE(v.z, 0);
+    return (LeftShift3(v.z) << 2) | (LeftShift3(v.y) << 1) | LeftShift3(v.x);
+}
+
+/**
+ * Sort Morton primitives by their code with least significant digit radix sort.
+ * Each pass counts the digits of each chunk in parallel, then scatters every chunk into its own range.
+ * The sort is stable, so the result doesn't depend on the amount of threads.
+*/
+static void RadixSort(std::vector<MortonPrimitive> &v, bool parallel, int chunkSize) {
+    std::vector<MortonPrimitive> tempVector(v.size());
+    PBRT_CONSTEXPR int bitsPerPass = 6;
+    PBRT_CONSTEXPR int nBits = 30;
+    static_assert((nBits % bitsPerPass) == 0, "Radix sort bitsPerPass must evenly divide nBits");
+    PBRT_CONSTEXPR int nPasses = nBits / bitsPerPass;
+    PBRT_CONSTEXPR int nBuckets = 1 << bitsPerPass;
+    PBRT_CONSTEXPR int bitMask = (1 << bitsPerPass) - 1;
+    int nChunks = (v.size() + chunkSize - 1) / chunkSize;
+    std::vector<int> chunkOffsets(nChunks * nBuckets);
+    for(int pass = 0; pass < nPasses; ++pass) {
+        int lowBit = pass * bitsPerPass;
+        std::vector<MortonPrimitive> &in = (pass & 1) ? tempVector : v;
+        std::vector<MortonPrimitive> &out = (pass & 1) ? v : tempVector;
+        
+        // Count the digits of each chunk
+        std::fill(chunkOffsets.begin(), chunkOffsets.end(), 0);
+        ParallelFor(parallel, [&](int64_t chunk){
+            int *counts = &chunkOffsets[chunk * nBuckets];
+            int end = std::min<int>((chunk + 1) * chunkSize, in.size());
+            for(int i = chunk * chunkSize; i < end; ++i) 
+                ++counts[(in[i].mortonCode >> lowBit) & bitMask];
+        }, nChunks, 1);
+
+        // Turn the counts into the starting index of each chunk in each bucket
+        int offset = 0;
+        for(int b = 0; b < nBuckets; ++b) {
+            for(int chunk = 0; chunk < nChunks; ++chunk) {
+                int count = chunkOffsets[chunk * nBuckets + b];
+                chunkOffsets[chunk * nBuckets + b] = offset;
+                offset += count;
+            }
+        }
+        
+        // Scatter primitives of each chunk into the output
+        ParallelFor(parallel, [&](int64_t chunk){
+            int *offsets = &chunkOffsets[chunk * nBuckets];
+            int end = std::min<int>((chunk + 1) * chunkSize, in.size());
+            for(int i = chunk * chunkSize; i < end; ++i) 
+                out[offsets[(in[i].mortonCode >> lowBit) & bitMask]++] = in[i];
+        }, nChunks, 1);
+    }
+    if(nPasses & 1) std::swap(v, tempVector);
+}
+
+/**
+ * The header of a BVH cache file, the nodes follow it, then the ordering of references as int32_t.
+*/
+struct BVHCacheHeader {
+    char magic[8]; // Always BVH_CACHE_MAGIC
+    uint32_t version; // Files with other versions are ignored
+    uint32_t nodeSize; // sizeof(LinearBVHNode), it differs if Float is double
+    uint64_t hash; // The hash of the primitives and build options, see HashBuildInput
+    int64_t totalNodes;
+    int64_t nReferences; // The size of primitives after building, SBVH may reference a primitive more than once
+    int64_t nInputs; // The amount of primitives passed to the constructor
+    int64_t nodesOffset; // The offset of nodes in the file, it is aligned for LinearBVHNode
+    int64_t orderingOffset; // The offset of the ordering in the file
+};
+static_assert(sizeof(BVHCacheHeader) == 64, "BVHCacheHeader should be 64 bytes, so the nodes after it are aligned");
+static const char BVH_CACHE_MAGIC[8] = "PBRTBVH";
+static PBRT_CONSTEXPR uint32_t BVH_CACHE_VERSION = 1;
+
+/**
+ * FNV-1a hash of the bytes, h is the hash of previous bytes.
+*/
+inline uint64_t HashBytes(const void *data, size_t size, uint64_t h) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for(size_t i = 0; i < size; ++i) {
+        h ^= bytes[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/**
+ * Hash everything which decides the tree: the primitives in input order and the build parameters. Each primitive contributes
+ * its type and its bound, a triangle also its vertices, so a changed mesh or a reordered input gets another hash even if the bounds are same.
+ * The other options only change the traversal, not the cached tree.
+*/
+static uint64_t HashBuildInput(const std::vector<std::shared_ptr<Primitive>> &primitives, const std::vector<BVHPrimitiveInfo> &primitiveInfos, BVHAccel::SplitMethod method, int maxPrimitivesInNode, const BVHBuildOptions &options) {
+    uint64_t h = 14695981039346656037ull;
+    size_t nPrimitives = primitives.size();
+    h = HashBytes(&nPrimitives, sizeof(nPrimitives), h);
+    for(size_t i = 0; i < nPrimitives; ++i) {
+        const Primitive &primitive = *primitives[i];
+        const char *type = typeid(primitive).name();
+        h = HashBytes(type, strlen(type), h);
+        h = HashBytes(&primitiveInfos[i].bound, sizeof(primitiveInfos[i].bound), h);
+        Point3f p[3];
+        if(primitive.TriangleVertices(p)) h = HashBytes(p, sizeof(p), h);
+    }
+    h = HashBytes(&method, sizeof(method), h);
+    h = HashBytes(&maxPrimitivesInNode, sizeof(maxPrimitivesInNode), h);
+    h = HashBytes(&options.sbvhSplitBudget, sizeof(options.sbvhSplitBudget), h);
+    h = HashBytes(&options.sbvhOverlapThreshold, sizeof(options.sbvhOverlapThreshold), h);
+    h = HashBytes(&options.plocRadius, sizeof(options.plocRadius), h);
+    h = HashBytes(&options.preSplitBudget, sizeof(options.preSplitBudget), h);
+    h = HashBytes(&options.preSplitThreshold, sizeof(options.preSplitThreshold), h);
+    h = HashBytes(&options.treeletPasses, sizeof(options.treeletPasses), h);
+    h = HashBytes(&options.layout, sizeof(options.layout), h);
+    h = HashBytes(&options.sahBuckets, sizeof(options.sahBuckets), h);
+    h = HashBytes(&options.sahThreshold, sizeof(options.sahThreshold), h);
+    h = HashBytes(&options.traversalCost, sizeof(options.traversalCost), h); // the prepared costs, calibrated ones differ between runs and make another cache
+    h = HashBytes(&options.intersectionCost, sizeof(options.intersectionCost), h);
+    return h;
+}
+
+void BVHAccel::CalibrateCostModel(Float &traversalCost, Float &intersectionCost) {
+    PBRT_CONSTEXPR int nShapes = 256, nRays = 256, nRepeats = 8;
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<Float> dist(-1.0, 1.0);
+    // Small boxes and triangles scattered around the origin, rays from the origin hit some of them like the nodes near a leaf
+    std::vector<int> indices(nShapes * 3);
+    std::vector<Point3f> points(nShapes * 3);
+    std::vector<Bounds3f> bounds(nShapes);
+    for(int i = 0; i < nShapes; ++i) {
+        Point3f center(dist(rng), dist(rng), dist(rng));
+        for(int j = 0; j < 3; ++j) {
+            indices[i * 3 + j] = i * 3 + j;
+            points[i * 3 + j] = center + Vector3f(dist(rng), dist(rng), dist(rng)) * 0.2;
+        }
+        bounds[i] = Union(Bounds3f(points[i * 3], points[i * 3 + 1]), points[i * 3 + 2]);
+    }
+    std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>(nShapes, nShapes * 3, indices, points, std::vector<Normal3f>(nShapes * 3));
+    std::vector<Triangle> triangles;
+    triangles.reserve(nShapes);
+    for(int i = 0; i < nShapes; ++i) 
+        triangles.emplace_back(mesh, i);
+    std::vector<Ray> rays;
+    for(int i = 0; i < nRays; ++i) 
+        rays.push_back(Ray(Point3f(0, 0, 0), Normalize(Vector3f(dist(rng), dist(rng), dist(rng)))));
+
+    // The hit counts are used, so the tests are not optimized away
+    int64_t nHits = 0;
+    auto begin = std::chrono::high_resolution_clock::now();
+    for(int k = 0; k < nRepeats; ++k) {
+        for(const Ray &ray: rays) {
+            Vector3f invD(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+            int dirIsNeg[3] = {invD.x < 0, invD.y < 0, invD.z < 0};
+            for(const Bounds3f &b: bounds) 
+                nHits += b.IntersectP(ray, invD, dirIsNeg);
+        }
+    }
+    auto middle = std::chrono::high_resolution_clock::now();
+    for(int k = 0; k < nRepeats; ++k) {
+        for(const Ray &ray: rays) {
+            for(const Triangle &triangle: triangles) {
+                Float tHit;
+                SurfaceInteraction isect;
+                nHits += triangle.Intersection(ray, tHit, isect);
+            }
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double boxTime = std::chrono::duration<double>(middle - begin).count();
+    double triangleTime = std::chrono::duration<double>(end - middle).count();
+    intersectionCost = 1;
+    traversalCost = triangleTime > 0 ? Clamp(boxTime / triangleTime, 0.01, 100) : 1;
+    LOG(INFO) << "Calibrate BVH cost model, traversal cost: " << traversalCost << ", intersection cost: " << intersectionCost << " (" << nHits << " hits)";
+}
+
+/**
+ * Clamp the options into valid ranges and measure the cost model if it is required.
+ * The cost model is measured only once, all BVHs in the process use the same one.
+*/
+static BVHBuildOptions PrepareBuildOptions(const BVHBuildOptions &options) {
+    BVHBuildOptions prepared = options;
+    prepared.sahBuckets = Clamp(options.sahBuckets, 2, BVHAccel::MAX_SAH_BUCKETS);
+    if(options.calibrateCostModel) {
+        static Float traversalCost, intersectionCost;
+        static std::once_flag calibrated;
+        std::call_once(calibrated, [](){ BVHAccel::CalibrateCostModel(traversalCost, intersectionCost); });
+        prepared.traversalCost = traversalCost;
+        prepared.intersectionCost = intersectionCost;
+    }
+    return prepared;
+}
+
+BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> ps, SplitMethod sm, int maxPrimsInNode, const BVHBuildOptions &options): primitives(std::move(ps)), method(sm), maxPrimitivesInNode(std::min(maxPrimsInNode, MAX_LEAF_PRIMITIVES)), options(PrepareBuildOptions(options)), nodes(nullptr), totalNodes(0), siblingPairs(false), mappedFile(nullptr), mappedSize(0), compressedNodes(nullptr), treeDepth(0), packedTriangles(nullptr) {
     if(primitives.size() == 0) return;
     std::vector<BVHPrimitiveInfo> infos(primitives.size());
     for(int i = 0; i < primitives.size(); ++i) 
         infos[i] = BVHPrimitiveInfo(i, primitives[i]->WorldBound());
-    std::vector<std::shared_ptr<Primitive>> orderedPrimitives;
-    orderedPrimitives.reserve(primitives.size());
-    int totalNodes = 0;
-    std::shared_ptr<BVHBuildNode> root = RecursiveBuild(infos, 0, infos.size(), totalNodes, orderedPrimitives);
-    primitives.swap(orderedPrimitives);
+    
+    bool lazy = options.lazyBuild && (method == SplitMethod::SAH || method == SplitMethod::Middle || method == SplitMethod::EqualCounts);
+    if(options.lazyBuild && !lazy) 
+        LOG(WARNING) << "Lazy build only supports SAH, Middle and EqualCounts, the BVH is built eagerly";
+    if(lazy && (!options.cacheDirectory.empty() || options.compressNodes || options.treeletPasses > 0 || options.layout != BVHLayout::DepthFirst)) 
+        LOG(WARNING) << "The cache, compressed nodes, treelet optimization and layouts are ignored by lazy build";
+    bool useCache = !options.cacheDirectory.empty() && !options.compressNodes && !lazy;
+    uint64_t cacheHash = 0;
+    std::string cachePath;
+    if(useCache) {
+        cacheHash = HashBuildInput(primitives, infos, method, maxPrimitivesInNode, this->options);
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)cacheHash);
+        cachePath = (std::filesystem::path(options.cacheDirectory) / name).string();
+        if(LoadCache(cachePath, cacheHash, primitives)) {
+            LinearTreeBytes += (totalNodes * sizeof(LinearBVHNode) + primitives.size() * sizeof(primitives[0]));
+            LinkParents();
+            PackTriangles();
+            LOG(INFO) << "Load BVH from " << cachePath << " with " << totalNodes << " nodes";
+            return;
+        }
+    }
+
+    int nInputs = infos.size();
+    if(options.preSplitBudget > 0 && (method == SplitMethod::SAH || method == SplitMethod::Middle || method == SplitMethod::EqualCounts || method == SplitMethod::SweepSAH)) 
+        PreSplitReferences(infos);
+    std::vector<std::shared_ptr<Primitive>> orderedPrimitives(lazy ? 0 : infos.size());
+    std::vector<MemoryArena> arenas(std::max(1, ParallelForLoopExecutor::NumThreads())); // The temporary tree is released when the arenas are destroyed
+    BVHBuildNode *root;
+    if(lazy)
+        root = LazyBuild(arenas[0], infos, totalNodes);
+    else if(method == SplitMethod::HLBVH)
+        root = HLBVHBuild(arenas, infos, totalNodes, orderedPrimitives);
+    else if(method == SplitMethod::SBVH)
+        root = SBVHBuild(arenas[0], infos, totalNodes, orderedPrimitives);
+    else if(method == SplitMethod::PLOC)
+        root = PLOCBuild(arenas, infos, totalNodes, orderedPrimitives);
+    else if(method == SplitMethod::SweepSAH)
+        root = SweepSAHBuild(arenas[0], infos, totalNodes, orderedPrimitives);
+    else if(ParallelForLoopExecutor::NumThreads() > 1 && infos.size() >= PARALLEL_BUILD_THRESHOLD)
+        root = ParallelBuild(arenas, infos, totalNodes, orderedPrimitives);
+    else
+        root = RecursiveBuild(arenas[0], infos, 0, infos.size(), totalNodes, orderedPrimitives);
+    if(options.treeletPasses > 0 && !lazy) 
+        OptimizeTreelets(root);
+    std::vector<int> ordering; // The index of each reference in the input primitives, it is saved into the cache
+    if(useCache) {
+        std::unordered_map<const Primitive *, int> inputIndices;
+        for(int i = 0; i < primitives.size(); ++i) 
+            inputIndices[primitives[i].get()] = i;
+        ordering.resize(orderedPrimitives.size());
+        for(int i = 0; i < orderedPrimitives.size(); ++i) 
+            ordering[i] = inputIndices[orderedPrimitives[i].get()];
+    }
+    if(!lazy) 
+        primitives.swap(orderedPrimitives);
     nodes = AllocAligned<LinearBVHNode>(totalNodes);
-    LinearTreeBytes += (totalNodes * sizeof(LinearBVHNode) + primitives.size() * sizeof(primitives[0]));
     int offset = 0;
-    FlattenBVHTree(root, offset);
+    FlattenBVHTree(root, nodes, offset);
     DCHECK_EQ(totalNodes, offset);
+    if(options.layout != BVHLayout::DepthFirst && !options.compressNodes && !lazy) 
+        LayoutNodes(options.layout, std::vector<Float>());
+    if(useCache) 
+        SaveCache(cachePath, cacheHash, nInputs, ordering);
+    int64_t nodeBytes = totalNodes * sizeof(LinearBVHNode);
+    LinkParents();
+    if(options.compressNodes && treeDepth >= STACK_SIZE) 
+        LOG(WARNING) << "The BVH with depth " << treeDepth << " is too deep for the compressed traversal, it is kept uncompressed";
+    else if(options.compressNodes && !lazy && nodes[0].nPrimitives == 0) { // a tree with only one leaf is kept uncompressed
+        int nInteriors = 0;
+        for(int i = 0; i < totalNodes; ++i) 
+            if(nodes[i].nPrimitives == 0) ++nInteriors;
+        compressedNodes = AllocAligned<CompressedBVHNode>(nInteriors);
+        rootBound = nodes[0].bound;
+        offset = 0;
+        CompressBVHTree(0, offset);
+        DCHECK_EQ(nInteriors, offset);
+        ReleaseNodes();
+        LOG(INFO) << "Compress BVH nodes from " << nodeBytes << " bytes to " << nInteriors * sizeof(CompressedBVHNode) << " bytes";
+        nodeBytes = nInteriors * sizeof(CompressedBVHNode);
+    }
+    LinearTreeBytes += (nodeBytes + primitives.size() * sizeof(primitives[0]));
+    PackTriangles();
     LOG(INFO) << "Build BVH success with " << totalNodes << " nodes";
 }
 
 BVHAccel::~BVHAccel() {
-    free(nodes);
+    ReleaseNodes();
+    FreeAligned(compressedNodes);
+    FreeAligned(packedTriangles);
+}
+
+/**
+ * Copy the vertices of the triangles in primitives into a new array in the same order, other primitives are marked by NaN.
+ * @return The array allocated by AllocAligned, null if there isn't any triangle.
+*/
+static PackedTriangle *PackPrimitiveTriangles(const std::vector<std::shared_ptr<Primitive>> &primitives, bool parallel, int chunkSize) {
+    PackedTriangle *packedTriangles = AllocAligned<PackedTriangle>(primitives.size());
+    std::atomic<bool> hasTriangle(false);
+    ParallelFor(parallel, [&](int64_t i){
+        PackedTriangle &packed = packedTriangles[i];
+        if(primitives[i]->TriangleVertices(packed.p)) hasTriangle = true;
+        else packed.p[0].x = std::numeric_limits<Float>::quiet_NaN();
+    }, primitives.size(), chunkSize);
+    if(!hasTriangle) {
+        FreeAligned(packedTriangles);
+        return nullptr;
+    }
+    PackedTriangleBytes += primitives.size() * sizeof(PackedTriangle);
+    return packedTriangles;
+}
+
+void BVHAccel::PackTriangles() {
+    if(!options.packTriangles || !lazySubtrees.empty()) return; // lazy subtrees pack their own primitives when they are built
+    if(packedTriangles != nullptr) {
+        FreeAligned(packedTriangles);
+        packedTriangles = nullptr;
+        PackedTriangleBytes -= primitives.size() * sizeof(PackedTriangle);
+    }
+    packedTriangles = PackPrimitiveTriangles(primitives, ParallelForLoopExecutor::NumThreads() > 1 && primitives.size() >= PARALLEL_CHUNK_SIZE, PARALLEL_CHUNK_SIZE);
+}
+
+/**
+ * The closest hit of a packed triangle found by the traversal so far, primitive is its index in primitives, -1 if there isn't one.
+*/
+struct TriangleHit {
+    int primitive = -1; // The distance of the hit is ray.tMax
+};
+
+/**
+ * The output of BVHQuery::AllHits, a primitive referenced by several leaves is reported once.
+*/
+struct BVHAllHits {
+    explicit BVHAllHits(std::vector<SurfaceInteraction> &isects): isects(isects) {}
+    std::vector<SurfaceInteraction> &isects;
+    std::unordered_set<const Primitive *> primitives; // The primitives already reported
+};
+
+BVHTreeView BVHAccel::TreeView() const {
+    return {nodes, primitives.data(), packedTriangles, siblingPairs, treeDepth};
+}
+
+inline bool BVHAccel::IntersectLeaf(const BVHTreeView &tree, int offset, int nPrimitives, const Ray &ray, SurfaceInteraction &isect, TriangleHit &closest) const {
+    if(nPrimitives == LAZY_SUBTREE) {
+        if(!IntersectLazySubtree(offset, ray, isect)) return false;
+        closest.primitive = -1;
+        return true;
+    }
+    bool isHit = false;
+    for(int i = offset; i < offset + nPrimitives; ++i) {
+        if(tree.packedTriangles != nullptr && !std::isnan(tree.packedTriangles[i].p[0].x)) { // the same test with Triangle, only the hit is recorded
+            const PackedTriangle &packed = tree.packedTriangles[i];
+            Float tHit;
+            if(!IntersectTriangle(ray, packed.p[0], packed.p[1], packed.p[2], tHit)) continue;
+            ray.tMax = tHit;
+            closest.primitive = i;
+            isHit = true;
+        } else if(tree.primitives[i]->Intersect(ray, isect)) {
+            closest.primitive = -1;
+            isHit = true;
+        }
+    }
+    return isHit;
+}
+
+inline void BVHAccel::FinishTriangleHit(const BVHTreeView &tree, const Ray &ray, const TriangleHit &closest, SurfaceInteraction &isect) const {
+    if(closest.primitive >= 0) tree.primitives[closest.primitive]->FinishDeferredHit(ray, isect);
+}
+
+inline bool BVHAccel::IntersectPLeaf(const BVHTreeView &tree, int offset, int nPrimitives, const Ray &ray) const {
+    if(nPrimitives == LAZY_SUBTREE) return IntersectPLazySubtree(offset, ray);
+    for(int i = offset; i < offset + nPrimitives; ++i) {
+        if(tree.packedTriangles != nullptr && !std::isnan(tree.packedTriangles[i].p[0].x)) {
+            const PackedTriangle &packed = tree.packedTriangles[i];
+            Float tHit;
+            if(IntersectTriangle(ray, packed.p[0], packed.p[1], packed.p[2], tHit)) return true;
+        } else if(tree.primitives[i]->IntersectP(ray)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool BVHAccel::IntersectAllLeaf(const BVHTreeView &tree, int offset, int nPrimitives, const Ray &ray, BVHAllHits &hits) const {
+    if(nPrimitives == LAZY_SUBTREE) return TraverseOctant<BVHQuery::AllHits>(BuildLazySubtree(offset).View(), ray, nullptr, &hits);
+    bool isHit = false;
+    for(int i = offset; i < offset + nPrimitives; ++i) {
+        const Primitive *primitive = tree.primitives[i].get();
+        Ray r = ray; // every primitive is tested with the original tMax
+        SurfaceInteraction isect;
+        if(!primitive->Intersect(r, isect) || !hits.primitives.insert(primitive).second) continue; // only the hit ones are looked up
+        hits.isects.push_back(isect);
+        isHit = true;
+    }
+    return isHit;
+}
+
+template <BVHQuery Query>
+inline bool BVHAccel::QueryLeaf(const BVHTreeView &tree, int offset, int nPrimitives, const Ray &ray, SurfaceInteraction *isect, TriangleHit &closest, BVHAllHits *hits) const {
+    if constexpr(Query == BVHQuery::ClosestHit) return IntersectLeaf(tree, offset, nPrimitives, ray, *isect, closest);
+    else if constexpr(Query == BVHQuery::AnyHit) return IntersectPLeaf(tree, offset, nPrimitives, ray);
+    else return IntersectAllLeaf(tree, offset, nPrimitives, ray, *hits);
+}
+
+void BVHAccel::ReleaseNodes() {
+    ParentLinkBytes -= parents.size() * sizeof(int);
+    parents.clear();
+#if defined(PBRT_HAVE_MMAP)
+    if(mappedFile != nullptr) {
+        munmap(mappedFile, mappedSize);
+        mappedFile = nullptr;
+        nodes = nullptr;
+        return;
+    }
+#endif
+    FreeAligned(nodes);
+    nodes = nullptr;
+}
+
+/**
+ * Whether the cached node at index only refers to nodes and references inside the arrays, the children of an interior node are
+ * at index + 1 and secondChildOffset, or at secondChildOffset and secondChildOffset + 1 for sibling pairs.
+*/
+bool BVHAccel::IsValidCachedNode(const LinearBVHNode &node, int64_t index, int64_t totalNodes, int64_t nReferences, bool siblingPairs) {
+    if(node.nPrimitives > 0) 
+        return node.nPrimitives <= MAX_LEAF_PRIMITIVES && node.primitiveOffset >= 0 && node.primitiveOffset + (int64_t)node.nPrimitives <= nReferences;
+    if(node.axis > 2 || node.secondChildOffset <= 0) return false; // the root is never a child
+    return siblingPairs ? node.secondChildOffset + (int64_t)1 < totalNodes : index + 1 < totalNodes && node.secondChildOffset < totalNodes;
+}
+
+bool BVHAccel::LoadCache(const std::string &path, uint64_t hash, const std::vector<std::shared_ptr<Primitive>> &inputs) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if(fp == nullptr) return false;
+    BVHCacheHeader header;
+    bool valid = fread(&header, sizeof(header), 1, fp) == 1 &&
+                 memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == BVH_CACHE_VERSION && header.nodeSize == sizeof(LinearBVHNode) && 
+                 header.hash == hash && header.nInputs == inputs.size() && header.totalNodes > 0 &&
+                 header.nodesOffset == sizeof(header) && header.orderingOffset == header.nodesOffset + header.totalNodes * sizeof(LinearBVHNode);
+    size_t fileSize = header.orderingOffset + header.nReferences * sizeof(int32_t);
+    valid = valid && fseek(fp, 0, SEEK_END) == 0 && ftell(fp) == fileSize;
+    if(!valid) {
+        fclose(fp);
+        LOG(WARNING) << "Ignore the invalid BVH cache " << path;
+        return false;
+    }
+    const int32_t *ordering;
+    std::vector<int32_t> orderingBuffer;
+#if defined(PBRT_HAVE_MMAP)
+    fclose(fp);
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    void *mapped = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0); // private mapping, Refit writes copies of the pages
+    close(fd);
+    if(mapped == MAP_FAILED) return false;
+    mappedFile = mapped;
+    mappedSize = fileSize;
+    nodes = (LinearBVHNode *)((uint8_t *)mapped + header.nodesOffset);
+    ordering = (const int32_t *)((uint8_t *)mapped + header.orderingOffset);
+#else
+    nodes = AllocAligned<LinearBVHNode>(header.totalNodes);
+    orderingBuffer.resize(header.nReferences);
+    bool read = fseek(fp, header.nodesOffset, SEEK_SET) == 0 &&
+                fread(nodes, sizeof(LinearBVHNode), header.totalNodes, fp) == header.totalNodes &&
+                fread(orderingBuffer.data(), sizeof(int32_t), header.nReferences, fp) == header.nReferences;
+    fclose(fp);
+    if(!read) {
+        ReleaseNodes();
+        return false;
+    }
+    ordering = orderingBuffer.data();
+#endif
+    // A corrupted file of the right size must not make traversal read out of bounds, so every reference and every node is checked
+    bool pairs = options.layout != BVHLayout::DepthFirst; // the layout is a part of the hash
+    std::vector<std::shared_ptr<Primitive>> orderedPrimitives(header.nReferences);
+    for(int64_t i = 0; i < std::max(header.nReferences, header.totalNodes); ++i) {
+        bool validReference = i >= header.nReferences || (ordering[i] >= 0 && ordering[i] < inputs.size());
+        bool validNode = i >= header.totalNodes || IsValidCachedNode(nodes[i], i, header.totalNodes, header.nReferences, pairs);
+        if(!validReference || !validNode) {
+            ReleaseNodes();
+            LOG(WARNING) << "Ignore the invalid BVH cache " << path;
+            return false;
+        }
+        if(i < header.nReferences) orderedPrimitives[i] = inputs[ordering[i]];
+    }
+    primitives.swap(orderedPrimitives);
+    totalNodes = header.totalNodes;
+    siblingPairs = pairs;
+    return true;
+}
+
+void BVHAccel::SaveCache(const std::string &path, uint64_t hash, int nInputs, const std::vector<int> &ordering) const {
+    BVHCacheHeader header;
+    memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = BVH_CACHE_VERSION;
+    header.nodeSize = sizeof(LinearBVHNode);
+    header.hash = hash;
+    header.totalNodes = totalNodes;
+    header.nReferences = ordering.size();
+    header.nInputs = nInputs;
+    header.nodesOffset = sizeof(header);
+    header.orderingOffset = header.nodesOffset + totalNodes * sizeof(LinearBVHNode);
+    std::vector<int32_t> ordering32(ordering.begin(), ordering.end());
+
+    // Write a temporary file then rename it, so another process never loads a half written file
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+    std::string tempPath = path + ".tmp";
+    FILE *fp = fopen(tempPath.c_str(), "wb");
+    if(fp == nullptr) {
+        LOG(WARNING) << "Can't write the BVH cache " << path;
+        return;
+    }
+    bool written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                   fwrite(nodes, sizeof(LinearBVHNode), totalNodes, fp) == totalNodes &&
+                   fwrite(ordering32.data(), sizeof(int32_t), ordering32.size(), fp) == ordering32.size();
+    written = (fclose(fp) == 0) && written;
+    if(written) std::filesystem::rename(tempPath, path, error);
+    if(!written || error) {
+        std::filesystem::remove(tempPath, error);
+        LOG(WARNING) << "Can't write the BVH cache " << path;
+        return;
+    }
+    LOG(INFO) << "Save BVH into " << path;
+}
+
+BVHBuildNode *BVHAccel::ParallelBuild(std::vector<MemoryArena> &arenas, std::vector<BVHPrimitiveInfo> &primitiveInfos, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives) {
+    std::vector<BVHBuildTask> tasks;
+    BVHBuildNode *root = RecursiveBuild(arenas[0], primitiveInfos, 0, primitiveInfos.size(), totalNodes, orderedPrimitives, &tasks);
+    
+    // Hand out the largest subtrees first, so no thread is left with a big subtree at the end
+    std::vector<int> order(tasks.size());
+    for(int i = 0; i < tasks.size(); ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](int a, int b){
+        return tasks[a].end - tasks[a].begin > tasks[b].end - tasks[b].begin;
+    });
+    ParallelForLoopExecutor::ParallelFor1D([&](int64_t i){
+        BVHBuildTask &task = tasks[order[i]];
+        BVHBuildNode *subtree = RecursiveBuild(arenas[ThreadIndex], primitiveInfos, task.begin, task.end, task.totalNodes, orderedPrimitives);
+        *task.node = *subtree;
+    }, tasks.size(), 1);
+    
+    for(const BVHBuildTask &task: tasks)
+        totalNodes += task.totalNodes;
+    return root;
+}
+
+BVHBuildNode *BVHAccel::LazyBuild(MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfos, int &totalNodes) {
+    std::vector<BVHBuildTask> tasks;
+    std::vector<std::shared_ptr<Primitive>> unused;
+    BVHBuildNode *root = RecursiveBuild(arena, primitiveInfos, 0, primitiveInfos.size(), totalNodes, unused, &tasks, std::max(1, options.lazySubtreeSize));
+    lazySubtrees.reserve(tasks.size());
+    for(const BVHBuildTask &task: tasks) {
+        BVHBuildNode *node = task.node; // the placeholder becomes a leaf standing for the subtree
+        node->primitiveOffset = lazySubtrees.size();
+        node->nPrimitives = LAZY_SUBTREE;
+        node->children[0] = node->children[1] = nullptr;
+        ++totalNodes;
+        lazySubtrees.emplace_back(new LazySubtree());
+        lazySubtrees.back()->infos.assign(primitiveInfos.begin() + task.begin, primitiveInfos.begin() + task.end);
+    }
+    LazySubtreesTotal += tasks.size();
+    LOG(INFO) << "Lazy BVH deferred " << tasks.size() << " subtrees";
+    return root;
+}
+
+const LazySubtree &BVHAccel::BuildLazySubtree(int index) const {
+    LazySubtree &subtree = *lazySubtrees[index];
+    std::call_once(subtree.built, [&](){
+        MemoryArena arena;
+        int nNodes = 0;
+        subtree.primitives.resize(subtree.infos.size());
+        BVHBuildNode *root = RecursiveBuild(arena, subtree.infos, 0, subtree.infos.size(), nNodes, subtree.primitives);
+        subtree.nodes = AllocAligned<LinearBVHNode>(nNodes);
+        int offset = 0;
+        FlattenBVHTree(root, subtree.nodes, offset);
+        DCHECK_EQ(nNodes, offset);
+        std::vector<int> depths(nNodes, 0); // a parent is stored before its children
+        for(int i = 0; i < nNodes; ++i) {
+            subtree.depth = std::max(subtree.depth, depths[i]);
+            if(subtree.nodes[i].nPrimitives == 0) 
+                depths[i + 1] = depths[subtree.nodes[i].secondChildOffset] = depths[i] + 1;
+        }
+        std::vector<BVHPrimitiveInfo>().swap(subtree.infos);
+        if(options.packTriangles) 
+            subtree.packedTriangles = PackPrimitiveTriangles(subtree.primitives, false, PARALLEL_CHUNK_SIZE); // it runs on the thread of the ray
+        LinearTreeBytes += nNodes * sizeof(LinearBVHNode) + subtree.primitives.size() * sizeof(subtree.primitives[0]);
+        ++LazySubtreesBuilt;
+    });
+    return subtree;
+}
+
+bool BVHAccel::IntersectLazySubtree(int index, const Ray &ray, SurfaceInteraction &isect) const {
+    return TraverseOctant<BVHQuery::ClosestHit>(BuildLazySubtree(index).View(), ray, &isect, nullptr);
+}
+
+bool BVHAccel::IntersectPLazySubtree(int index, const Ray &ray) const {
+    return TraverseOctant<BVHQuery::AnyHit>(BuildLazySubtree(index).View(), ray, nullptr, nullptr);
+}
+
+/**
+ * Put primitiveInfos[begin, end) into a leaf node, the primitives are stored in the same range of orderedPrimitives.
+*/
+static void InitLeafNode(BVHBuildNode *node, const std::vector<BVHPrimitiveInfo> &primitiveInfos, int begin, int end, const Bounds3f &bounds, const std::vector<std::shared_ptr<Primitive>> &primitives, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives) {
+    for(int i = begin; i < end; ++i) 
+        orderedPrimitives[i] = primitives[primitiveInfos[i].index];
+    node->InitLeaf(begin, end - begin, bounds);
 }
 
-std::shared_ptr<BVHBuildNode> BVHAccel::RecursiveBuild(std::vector<BVHPrimitiveInfo> &primitiveInfos, int begin, int end, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives) {
+BVHBuildNode *BVHAccel::RecursiveBuild(MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfos, int begin, int end, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives, std::vector<BVHBuildTask> *tasks, int taskSize) const {
     DCHECK_NE(begin, end);
-    std::shared_ptr<BVHBuildNode> node = std::make_shared<BVHBuildNode>();
-    ++totalNodes;
+    BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
     int nPrimitives = end - begin;
+    bool parallel = tasks != nullptr && ParallelForLoopExecutor::NumThreads() > 1 && nPrimitives > PARALLEL_CHUNK_SIZE; // only large nodes are worth to compute in parallel
     
-    Bounds3f bounds;
-    for(int i = begin; i < end; ++i)
-        bounds = Union(bounds, primitiveInfos[i].bound);
+    Bounds3f bounds, centroidBounds;
+    ComputeBounds(primitiveInfos, begin, end, parallel, PARALLEL_CHUNK_SIZE, bounds, centroidBounds);
     
+    if(tasks != nullptr && nPrimitives <= taskSize) { // defer the subtree, it will be built as a parallel task or a lazy subtree
+        node->bound = bounds;
+        tasks->push_back(BVHBuildTask{node, begin, end});
+        return node;
+    }
+    ++totalNodes;
+
     if(nPrimitives <= 1) { // build leaf node if left primitive less than 1
-        int firstOffset = orderedPrimitives.size();
-        for(int i = begin; i < end; ++i) {
-            int index = primitiveInfos[i].index;
-            orderedPrimitives.push_back(primitives[index]);
-        }
-        node->InitLeaf(firstOffset, nPrimitives, bounds);
+        InitLeafNode(node, primitiveInfos, begin, end, bounds, primitives, orderedPrimitives);
         return node;
     }
 
-    Bounds3f centroidBounds;
-    for(int i = begin; i < end; ++i) 
-        centroidBounds = Union(centroidBounds, primitiveInfos[i].centroid);
     int dim = centroidBounds.MaximumExtent();
     int mid = (begin + end) / 2;
 
     if(centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) { // if all primitive with same centroid bounds, put them together as leaf node
-        int firstOffset = orderedPrimitives.size();
-        for(int i = begin; i < end; ++i) {
-            int index = primitiveInfos[i].index;
-            orderedPrimitives.push_back(primitives[index]);
+        if(nPrimitives > MAX_LEAF_PRIMITIVES) { // too many for a leaf, split them in the middle though the children overlap
+            node->InitInterior(dim, 
+                               RecursiveBuild(arena, primitiveInfos, begin, mid, totalNodes, orderedPrimitives, tasks, taskSize),
+                               RecursiveBuild(arena, primitiveInfos, mid, end, totalNodes, orderedPrimitives, tasks, taskSize));
+            return node;
         }
-        node->InitLeaf(firstOffset, nPrimitives, bounds);
+        InitLeafNode(node, primitiveInfos, begin, end, bounds, primitives, orderedPrimitives);
         return node;
     }
 
@@ -155,7 +952,7 @@ std::shared_ptr<BVHBuildNode> BVHAccel::RecursiveBuild(std::vector<BVHPrimitiveI
         }
         case SplitMethod::SAH: // for SAH and defualt, both use SAH
         default: {
-            if(nPrimitives <= SHA_THRESHOLD) { // if primitive amount less than SHA_THRESHOLD, don't use SAH， just use EqualCounts
+            if(nPrimitives <= options.sahThreshold) { // if primitive amount less than sahThreshold, don't use SAH， just use EqualCounts
                 mid = (begin + end) / 2;
                 std::nth_element(&primitiveInfos[begin], &primitiveInfos[mid], &primitiveInfos[end - 1] + 1, [dim](const BVHPrimitiveInfo &a, const BVHPrimitiveInfo &b){
                     return a.centroid[dim] < b.centroid[dim];
@@ -163,165 +960,1954 @@ std::shared_ptr<BVHBuildNode> BVHAccel::RecursiveBuild(std::vector<BVHPrimitiveI
                 break;
             }
 
-            BucketInfo buckets[SHA_N_BUCKETS];
-            for(int i = begin; i < end; ++i) { // partition primitves into buckets by each in centroid bound ratio
-                int b = centroidBounds.Offset(primitiveInfos[i].centroid)[dim] * SHA_N_BUCKETS;
-                if(b == SHA_N_BUCKETS) --b;
-                DCHECK_GE(b, 0);
-                DCHECK_LT(b, SHA_N_BUCKETS);
-                ++buckets[b].count;
-                buckets[b].bound = Union(buckets[b].bound, primitiveInfos[i].bound);
-            }
+            int nBuckets = options.sahBuckets;
+            BucketInfo buckets[MAX_SAH_BUCKETS];
+            ComputeBuckets(primitiveInfos, begin, end, centroidBounds, dim, parallel, PARALLEL_CHUNK_SIZE, buckets, nBuckets);
 
-            Float cost[SHA_N_BUCKETS - 1]; // calculate each partitions cost
-            for(int i = 0; i < SHA_N_BUCKETS - 1; ++i) {
+            Float cost[MAX_SAH_BUCKETS - 1] = {}; // calculate each partitions cost
+            for(int i = 0; i < nBuckets - 1; ++i) {
                 int c0 = 0, c1 = 0;
                 Bounds3f b0, b1;
                 for(int j = 0; j <= i; ++j) {
                     c0 += buckets[j].count;
                     b0 = Union(b0, buckets[j].bound);
                 }
-                for(int j = i + 1; j < SHA_N_BUCKETS; ++j) {
+                for(int j = i + 1; j < nBuckets; ++j) {
                     c1 += buckets[j].count;
                     b1 = Union(b1, buckets[j].bound);
                 }
-                cost[i] = 1 + (c0 * b0.SurfaceArea() + c1 * b1.SurfaceArea()) / bounds.SurfaceArea();
+                cost[i] = options.traversalCost + options.intersectionCost * (c0 * b0.SurfaceArea() + c1 * b1.SurfaceArea()) / bounds.SurfaceArea();
             }
 
             int minimumIndex = 0;
             Float minimumCost = cost[0];
-            for(int i = 1; i < SHA_N_BUCKETS - 1; ++i) {
+            for(int i = 1; i < nBuckets - 1; ++i) {
                 if(cost[i] < minimumCost) {
                     minimumCost = cost[i];
                     minimumIndex = i;
                 }
             }
 
-            Float leafCost = nPrimitives;
+            Float leafCost = options.intersectionCost * nPrimitives;
             if(nPrimitives > maxPrimitivesInNode || minimumCost < leafCost) { // if primitive amouts greater than maxPrimitivesInNode or minimumCost less than leafCost(traversal all primitives spend time)
                 BVHPrimitiveInfo *ptrMid = std::partition(&primitiveInfos[begin], &primitiveInfos[end - 1] + 1, [&](const BVHPrimitiveInfo &info){
-                    int b = centroidBounds.Offset(info.centroid)[dim] * SHA_N_BUCKETS;
-                    if(b == SHA_N_BUCKETS) --b;
+                    int b = centroidBounds.Offset(info.centroid)[dim] * nBuckets;
+                    if(b == nBuckets) --b;
                     DCHECK_GE(b, 0);
-                    DCHECK_LT(b, SHA_N_BUCKETS);
+                    DCHECK_LT(b, nBuckets);
                     return b <= minimumIndex;
                 });
                 mid = ptrMid - &primitiveInfos[0];
             } else { // otherwise put them together as a leaf node
-                int firstOffset = orderedPrimitives.size();
-                for(int i = begin; i < end; ++i) {
-                    int index = primitiveInfos[i].index;
-                    orderedPrimitives.push_back(primitives[index]);
-                }
-                node->InitLeaf(firstOffset, nPrimitives, bounds);
+                InitLeafNode(node, primitiveInfos, begin, end, bounds, primitives, orderedPrimitives);
                 return node;
             }
             break;
         }
     }
     node->InitInterior(dim, 
-                       RecursiveBuild(primitiveInfos, begin, mid, totalNodes, orderedPrimitives),
-                       RecursiveBuild(primitiveInfos, mid, end, totalNodes, orderedPrimitives));
+                       RecursiveBuild(arena, primitiveInfos, begin, mid, totalNodes, orderedPrimitives, tasks, taskSize),
+                       RecursiveBuild(arena, primitiveInfos, mid, end, totalNodes, orderedPrimitives, tasks, taskSize));
     return node;
 }
 
-int BVHAccel::FlattenBVHTree(const std::shared_ptr<BVHBuildNode> node, int &offset) {
-    LinearBVHNode *linearNode = nodes + offset;
-    int myOffset = offset++;
-    linearNode->bound = node->bound;
-    if(node->nPrimitives == 0) { // Interior node
-        linearNode->axis = node->splitAxis;
-        linearNode->nPrimitives = 0;
-        FlattenBVHTree(node->children[0], offset);
-        linearNode->secondChildOffset = FlattenBVHTree(node->children[1], offset);
-    } else {
-        linearNode->primitiveOffset = node->primitiveOffset;
-        linearNode->nPrimitives = node->nPrimitives;
-    }
-    return myOffset;
+/**
+ * The references of the sweep SAH builder, sorted[axis] lists the indices of primitiveInfos by their centroids on the axis.
+ * The lists are partitioned together, so any range [begin, end) holds the same references in all of them.
+*/
+struct SweepSAHState {
+    explicit SweepSAHState(const std::vector<BVHPrimitiveInfo> &infos): primitiveInfos(infos) {}
+    const std::vector<BVHPrimitiveInfo> &primitiveInfos;
+    std::vector<int> sorted[3];
+    std::vector<Bounds3f> rightBounds; // rightBounds[i] is the bound of the references from the ith to the end of the range
+    std::vector<char> isLeft; // Whether a reference goes to the left child of the current split
+    std::vector<int> scratch; // For the stable partition
+};
+
+/**
+ * Compute the Morton code for each primitive by its centroid offset in the centroid bound, then sort them by the code.
+*/
+static void SortByMortonCode(const std::vector<BVHPrimitiveInfo> &primitiveInfos, const Bounds3f &centroidBounds, int mortonBits, bool parallel, int chunkSize, std::vector<MortonPrimitive> &mortonPrimitives) {
+    int nPrimitives = primitiveInfos.size();
+    mortonPrimitives.resize(nPrimitives);
+    int mortonScale = 1 << mortonBits;
+    ParallelFor(parallel, [&](int64_t i){
+        mortonPrimitives[i].primitiveIndex = i;
+        Vector3f centroidOffset = centroidBounds.Offset(primitiveInfos[i].centroid);
+        mortonPrimitives[i].mortonCode = EncodeMorton3(centroidOffset * mortonScale);
+    }, nPrimitives, 512);
+    RadixSort(mortonPrimitives, parallel, chunkSize);
 }
 
-bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction &isect) const {
-    if(nodes == nullptr) return false;
+BVHBuildNode *BVHAccel::HLBVHBuild(std::vector<MemoryArena> &arenas, const std::vector<BVHPrimitiveInfo> &primitiveInfos, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives) {
+    int nPrimitives = primitiveInfos.size();
+    bool parallel = ParallelForLoopExecutor::NumThreads() > 1 && nPrimitives >= PARALLEL_BUILD_THRESHOLD;
+    Bounds3f bounds, centroidBounds;
+    ComputeBounds(primitiveInfos, 0, nPrimitives, parallel, PARALLEL_CHUNK_SIZE, bounds, centroidBounds);
 
-    // because we need to traversal a linear tree, so we need a assistant stack
-    int currentNodeIndex = 0; // Index of current access node in nodes
-    int stack[64]; // use a array to represent stack
-    int stackTopIndex = 0; // Index of top element in stack. Actually (stackTopIndex - 1) represent top element in the stack
-    Vector3f invD(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
-    int dirIsNeg[3] = {invD.x < 0, invD.y < 0, invD.z < 0};
-    bool isHit = false;
-    while(true) {
-        LinearBVHNode *node = nodes + currentNodeIndex;
-        if(node->bound.IntersectP(ray, invD, dirIsNeg)) {
-            if(node->nPrimitives > 0) { // meet leaf node, traversal all primitives find the last hit point
-                for(int i = 0; i < node->nPrimitives; ++i) {
-                    if(primitives[node->primitiveOffset + i]->Intersect(ray, isect)) {
-                        isHit = true;
-                    }
-                }
-                // if there are other subtree, go on traversal, otherwise break loop
-                if(stackTopIndex == 0) break;
-                currentNodeIndex = stack[--stackTopIndex];
-            } else { // meet Iterior node, traverl one of its two childrens, and another push the stack
-                if(dirIsNeg[node->axis]) { // if the direction in splited axis is negative, we intersect with the right subtree first, otherwise with left subtree
-                    currentNodeIndex = node->secondChildOffset;
-                    stack[stackTopIndex++] = currentNodeIndex + 1; // record left subtree index
-                } else {
-                    currentNodeIndex = currentNodeIndex + 1;
-                    stack[stackTopIndex++] = node->secondChildOffset; 
-                }
-            }
-        } else {
-            // if there are other subtree, go on traversal, otherwise break loop
-            if(stackTopIndex == 0) break;
-            currentNodeIndex = stack[--stackTopIndex];
+    std::vector<MortonPrimitive> mortonPrimitives;
+    SortByMortonCode(primitiveInfos, centroidBounds, MORTON_BITS, parallel, PARALLEL_CHUNK_SIZE, mortonPrimitives);
+
+    // Find the intervals of primitives for each treelet, primitives in a treelet have the same high bits
+    struct Treelet {
+        int begin, end;
+        int totalNodes = 0;
+        BVHBuildNode *root;
+    };
+    std::vector<Treelet> treelets;
+    PBRT_CONSTEXPR uint32_t treeletMask = ((1 << TREELET_BITS) - 1) << (3 * MORTON_BITS - TREELET_BITS);
+    for(int begin = 0, end = 1; end <= nPrimitives; ++end) {
+        if(end == nPrimitives || ((mortonPrimitives[begin].mortonCode & treeletMask) != (mortonPrimitives[end].mortonCode & treeletMask))) {
+            treelets.push_back(Treelet{begin, end, 0, nullptr});
+            begin = end;
         }
     }
-    ++HitTimes;
-    return isHit;
+
+    // Build all treelets, the bits above the treelet mask are same in a treelet
+    ParallelFor(parallel, [&](int64_t i){
+        Treelet &treelet = treelets[i];
+        int firstBitIndex = 3 * MORTON_BITS - 1 - TREELET_BITS;
+        treelet.root = EmitLBVH(arenas[ThreadIndex], primitiveInfos, mortonPrimitives, treelet.begin, treelet.end, firstBitIndex, treelet.totalNodes, orderedPrimitives);
+    }, treelets.size(), 1);
+
+    std::vector<BVHBuildNode *> treeletRoots;
+    treeletRoots.reserve(treelets.size());
+    for(Treelet &treelet: treelets) {
+        totalNodes += treelet.totalNodes;
+        treeletRoots.push_back(treelet.root);
+    }
+    return BuildUpperSAH(arenas[0], treeletRoots, 0, treeletRoots.size(), totalNodes);
 }
 
-bool BVHAccel::IntersectP(const Ray &ray) const {
-    if(nodes == nullptr) return false;
+BVHBuildNode *BVHAccel::EmitLBVH(MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfos, const std::vector<MortonPrimitive> &mortonPrimitives, int begin, int end, int bitIndex, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives) {
+    DCHECK_LT(begin, end);
+    int nPrimitives = end - begin;
+    if(bitIndex == -1 && nPrimitives > MAX_LEAF_PRIMITIVES) { // the codes are all same but too many for a leaf, split them in the middle
+        int mid = (begin + end) / 2;
+        BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+        ++totalNodes;
+        BVHBuildNode *c0 = EmitLBVH(arena, primitiveInfos, mortonPrimitives, begin, mid, bitIndex, totalNodes, orderedPrimitives);
+        BVHBuildNode *c1 = EmitLBVH(arena, primitiveInfos, mortonPrimitives, mid, end, bitIndex, totalNodes, orderedPrimitives);
+        node->InitInterior(0, c0, c1);
+        return node;
+    }
+    if(bitIndex == -1 || nPrimitives <= maxPrimitivesInNode) { // no bit can split or primitives are few enough, create a leaf
+        BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+        ++totalNodes;
+        Bounds3f bounds;
+        for(int i = begin; i < end; ++i) {
+            const BVHPrimitiveInfo &info = primitiveInfos[mortonPrimitives[i].primitiveIndex];
+            orderedPrimitives[i] = primitives[info.index];
+            bounds = Union(bounds, info.bound);
+        }
+        node->InitLeaf(begin, nPrimitives, bounds);
+        return node;
+    }
     
-    // because we need to traversal a linear tree, so we need a assistant stack
-    int currentNodeIndex = 0; // Index of current access node in nodes
-    int stack[64]; // use a array to represent stack
-    int stackTopIndex = 0; // Index of top element in stack. Actually (stackTopIndex - 1) represent top element in the stack
+    uint32_t mask = 1 << bitIndex;
+    if((mortonPrimitives[begin].mortonCode & mask) == (mortonPrimitives[end - 1].mortonCode & mask)) // all primitives are on the same side of this bit, try next bit
+        return EmitLBVH(arena, primitiveInfos, mortonPrimitives, begin, end, bitIndex - 1, totalNodes, orderedPrimitives);
+
+    // binary search the first primitive whose bit is one, primitives are sorted, so the bit is zero in the front and one in the back
+    const MortonPrimitive *ptrMid = std::partition_point(&mortonPrimitives[begin], &mortonPrimitives[end - 1] + 1, [mask](const MortonPrimitive &p){
+        return (p.mortonCode & mask) == 0;
+    });
+    int mid = ptrMid - &mortonPrimitives[0];
+    DCHECK_GT(mid, begin);
+    DCHECK_LT(mid, end);
+
+    BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+    ++totalNodes;
+    BVHBuildNode *c0 = EmitLBVH(arena, primitiveInfos, mortonPrimitives, begin, mid, bitIndex - 1, totalNodes, orderedPrimitives);
+    BVHBuildNode *c1 = EmitLBVH(arena, primitiveInfos, mortonPrimitives, mid, end, bitIndex - 1, totalNodes, orderedPrimitives);
+    node->InitInterior(bitIndex % 3, c0, c1); // the Morton code interleaves x, y, z from the lowest bit
+    return node;
+}
+
+BVHBuildNode *BVHAccel::BuildUpperSAH(MemoryArena &arena, std::vector<BVHBuildNode *> &treeletRoots, int begin, int end, int &totalNodes) {
+    DCHECK_LT(begin, end);
+    int nNodes = end - begin;
+    if(nNodes == 1) return treeletRoots[begin];
+
+    BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+    ++totalNodes;
+    Bounds3f bounds, centroidBounds;
+    for(int i = begin; i < end; ++i) {
+        bounds = Union(bounds, treeletRoots[i]->bound);
+        centroidBounds = Union(centroidBounds, (treeletRoots[i]->bound.pMin + treeletRoots[i]->bound.pMax) / 2);
+    }
+    int dim = centroidBounds.MaximumExtent();
+    int mid = (begin + end) / 2;
+    auto centroid = [dim](const BVHBuildNode *n) { return (n->bound.pMin[dim] + n->bound.pMax[dim]) / 2; };
+    
+    if(centroidBounds.pMax[dim] != centroidBounds.pMin[dim]) { // otherwise treelets can't be distinguished, just split them in the middle
+        int nBuckets = options.sahBuckets;
+        BucketInfo buckets[MAX_SAH_BUCKETS];
+        auto bucketIndex = [&](const BVHBuildNode *n) {
+            int b = nBuckets * ((centroid(n) - centroidBounds.pMin[dim]) / (centroidBounds.pMax[dim] - centroidBounds.pMin[dim]));
+            if(b == nBuckets) --b;
+            DCHECK_GE(b, 0);
+            DCHECK_LT(b, nBuckets);
+            return b;
+        };
+        for(int i = begin; i < end; ++i) {
+            int b = bucketIndex(treeletRoots[i]);
+            ++buckets[b].count;
+            buckets[b].bound = Union(buckets[b].bound, treeletRoots[i]->bound);
+        }
+
+        int minimumIndex = 0;
+        Float minimumCost = Infinity;
+        for(int i = 0; i < nBuckets - 1; ++i) {
+            int c0 = 0, c1 = 0;
+            Bounds3f b0, b1;
+            for(int j = 0; j <= i; ++j) {
+                c0 += buckets[j].count;
+                b0 = Union(b0, buckets[j].bound);
+            }
+            for(int j = i + 1; j < nBuckets; ++j) {
+                c1 += buckets[j].count;
+                b1 = Union(b1, buckets[j].bound);
+            }
+            if(c0 == 0 || c1 == 0) continue; // an empty side doesn't split anything
+            Float cost = options.traversalCost + options.intersectionCost * (c0 * b0.SurfaceArea() + c1 * b1.SurfaceArea()) / bounds.SurfaceArea();
+            if(cost < minimumCost) {
+                minimumCost = cost;
+                minimumIndex = i;
+            }
+        }
+
+        BVHBuildNode **ptrMid = std::partition(&treeletRoots[begin], &treeletRoots[end - 1] + 1, [&](const BVHBuildNode *n){
+            return bucketIndex(n) <= minimumIndex;
+        });
+        mid = ptrMid - &treeletRoots[0];
+    }
+    if(mid == begin || mid == end) { // the partition failed, split them into same count
+        mid = (begin + end) / 2;
+        std::nth_element(&treeletRoots[begin], &treeletRoots[mid], &treeletRoots[end - 1] + 1, [&](const BVHBuildNode *a, const BVHBuildNode *b){
+            return centroid(a) < centroid(b);
+        });
+    }
+    node->InitInterior(dim, 
+                       BuildUpperSAH(arena, treeletRoots, begin, mid, totalNodes),
+                       BuildUpperSAH(arena, treeletRoots, mid, end, totalNodes));
+    return node;
+}
+
+void BVHAccel::PreSplitReferences(std::vector<BVHPrimitiveInfo> &references) const {
+    Bounds3f root;
+    for(const BVHPrimitiveInfo &ref: references) 
+        root = Union(root, ref.bound);
+    Float minArea = options.preSplitThreshold * root.SurfaceArea();
+    int budget = options.preSplitBudget * references.size();
+    std::priority_queue<std::pair<Float, int>> largest; // The area and index of the references may be split
+    for(int i = 0; i < references.size(); ++i) {
+        Float area = references[i].bound.SurfaceArea();
+        if(area > minArea) largest.push({area, i});
+    }
+    int nSplits = 0;
+    while(nSplits < budget && !largest.empty()) {
+        int i = largest.top().second;
+        largest.pop();
+        BVHPrimitiveInfo ref = references[i];
+        int dim = ref.bound.MaximumExtent();
+        Float low = ref.bound.pMin[dim], high = ref.bound.pMax[dim];
+        Float rootLow = root.pMin[dim], rootExtent = root.pMax[dim] - root.pMin[dim];
+        Float position = low;
+        for(int level = 1; level <= PRE_SPLIT_MAX_LEVEL; ++level) { // the first grid plane inside the reference, from the coarsest grid
+            Float cell = rootExtent / (1 << level);
+            Float plane = rootLow + std::ceil((low - rootLow) / cell) * cell;
+            if(plane > low && plane < high) {
+                position = plane;
+                break;
+            }
+        }
+        if(position == low) continue; // too thin to split, keep it
+        Bounds3f left = ref.bound, right = ref.bound;
+        left.pMax[dim] = right.pMin[dim] = position;
+        Bounds3f b0 = primitives[ref.index]->ClippedWorldBound(left);
+        Bounds3f b1 = primitives[ref.index]->ClippedWorldBound(right);
+        if(IsEmpty(b0) || IsEmpty(b1)) continue; // the primitive is only on one side, its bound can't shrink
+        references[i] = BVHPrimitiveInfo(ref.index, b0);
+        references.push_back(BVHPrimitiveInfo(ref.index, b1));
+        ++nSplits;
+        for(int k: {i, (int)references.size() - 1}) {
+            Float area = references[k].bound.SurfaceArea();
+            if(area > minArea) largest.push({area, k});
+        }
+    }
+    PreSplitReferenceCount += nSplits;
+    LOG(INFO) << "Pre-split " << nSplits << " references for " << references.size() - nSplits << " primitives";
+}
+
+BVHBuildNode *BVHAccel::SBVHBuild(MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfos, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives) {
+    Bounds3f bounds;
+    for(const BVHPrimitiveInfo &info: primitiveInfos) 
+        bounds = Union(bounds, info.bound);
+    int splitBudget = options.sbvhSplitBudget * primitiveInfos.size();
+    orderedPrimitives.clear(); // leaves append their references, duplicated primitives make the amount unknown in advance
+    orderedPrimitives.reserve(primitiveInfos.size() + splitBudget);
+    return SpatialSplitBuild(arena, primitiveInfos, bounds.SurfaceArea(), 0, splitBudget, totalNodes, orderedPrimitives);
+}
+
+BVHBuildNode *BVHAccel::SpatialSplitBuild(MemoryArena &arena, std::vector<BVHPrimitiveInfo> references, Float rootArea, int depth, int &splitBudget, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives) {
+    DCHECK(!references.empty());
+    BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+    ++totalNodes;
+    int nReferences = references.size();
+    Bounds3f bounds, centroidBounds;
+    for(const BVHPrimitiveInfo &ref: references) {
+        bounds = Union(bounds, ref.bound);
+        centroidBounds = Union(centroidBounds, ref.centroid);
+    }
+    auto createLeaf = [&]() {
+        if(nReferences > MAX_LEAF_PRIMITIVES) { // too many for a leaf, split them in the middle though the children overlap
+            int half = nReferences / 2;
+            BVHBuildNode *c0 = SpatialSplitBuild(arena, std::vector<BVHPrimitiveInfo>(references.begin(), references.begin() + half), rootArea, depth + 1, splitBudget, totalNodes, orderedPrimitives);
+            BVHBuildNode *c1 = SpatialSplitBuild(arena, std::vector<BVHPrimitiveInfo>(references.begin() + half, references.end()), rootArea, depth + 1, splitBudget, totalNodes, orderedPrimitives);
+            node->InitInterior(0, c0, c1);
+            return node;
+        }
+        int firstOffset = orderedPrimitives.size();
+        for(const BVHPrimitiveInfo &ref: references)
+            orderedPrimitives.push_back(primitives[ref.index]);
+        node->InitLeaf(firstOffset, nReferences, bounds);
+        return node;
+    };
+    if(nReferences <= 1) return createLeaf();
+    Float area = bounds.SurfaceArea();
+
+    // Find the best object split, try buckets of all three axes
+    Float objectCost = Infinity;
+    int objectDim = -1, objectBucket = -1;
+    Bounds3f objectBound0, objectBound1;
+    int nBuckets = options.sahBuckets;
+    auto objectBucketIndex = [&](const BVHPrimitiveInfo &ref, int dim) {
+        int b = centroidBounds.Offset(ref.centroid)[dim] * nBuckets;
+        if(b == nBuckets) --b;
+        DCHECK_GE(b, 0);
+        DCHECK_LT(b, nBuckets);
+        return b;
+    };
+    for(int dim = 0; dim < 3; ++dim) {
+        if(centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) continue;
+        BucketInfo buckets[MAX_SAH_BUCKETS];
+        for(const BVHPrimitiveInfo &ref: references) {
+            int b = objectBucketIndex(ref, dim);
+            ++buckets[b].count;
+            buckets[b].bound = Union(buckets[b].bound, ref.bound);
+        }
+        Bounds3f rightBounds[MAX_SAH_BUCKETS]; // rightBounds[i] is the bound of buckets from i to the end
+        rightBounds[nBuckets - 1] = buckets[nBuckets - 1].bound;
+        for(int i = nBuckets - 2; i >= 0; --i) 
+            rightBounds[i] = Union(rightBounds[i + 1], buckets[i].bound);
+        int c0 = 0;
+        Bounds3f b0;
+        for(int i = 0; i < nBuckets - 1; ++i) {
+            c0 += buckets[i].count;
+            b0 = Union(b0, buckets[i].bound);
+            int c1 = nReferences - c0;
+            if(c0 == 0 || c1 == 0) continue;
+            Float cost = options.traversalCost + options.intersectionCost * (c0 * b0.SurfaceArea() + c1 * rightBounds[i + 1].SurfaceArea()) / area;
+            if(cost < objectCost) {
+                objectCost = cost;
+                objectDim = dim;
+                objectBucket = i;
+                objectBound0 = b0;
+                objectBound1 = rightBounds[i + 1];
+            }
+        }
+    }
+
+    // Try spatial splits only if the children of the object split overlap a lot
+    Float spatialCost = Infinity;
+    int spatialDim = -1;
+    Float spatialPosition = 0;
+    int spatialLeftCount = 0, spatialRightCount = 0;
+    Bounds3f spatialBound0, spatialBound1;
+    auto clipReference = [&](const BVHPrimitiveInfo &ref, const Bounds3f &clip) {
+        return primitives[ref.index]->ClippedWorldBound(pbrt::Intersect(ref.bound, clip));
+    };
+    Float overlapArea = 0;
+    if(objectDim != -1) {
+        Bounds3f overlap = pbrt::Intersect(objectBound0, objectBound1);
+        if(!IsEmpty(overlap)) overlapArea = overlap.SurfaceArea();
+    }
+    if(splitBudget > 0 && depth < SBVH_MAX_SPATIAL_DEPTH && (objectDim == -1 || overlapArea / rootArea > options.sbvhOverlapThreshold)) {
+        for(int dim = 0; dim < 3; ++dim) {
+            Float low = bounds.pMin[dim], extent = bounds.pMax[dim] - bounds.pMin[dim];
+            if(extent <= 0) continue;
+            auto binIndex = [&](Float v) {
+                return Clamp((int)((v - low) / extent * SBVH_SPATIAL_BINS), 0, SBVH_SPATIAL_BINS - 1);
+            };
+            auto binPosition = [&](int i) { // the position of the plane in front of ith bin
+                return i == SBVH_SPATIAL_BINS ? bounds.pMax[dim] : low + extent * i / SBVH_SPATIAL_BINS;
+            };
+            SpatialBin bins[SBVH_SPATIAL_BINS];
+            for(const BVHPrimitiveInfo &ref: references) {
+                int first = binIndex(ref.bound.pMin[dim]), last = binIndex(ref.bound.pMax[dim]);
+                if(first == last) {
+                    bins[first].bound = Union(bins[first].bound, ref.bound);
+                } else {
+                    for(int b = first; b <= last; ++b) {
+                        Bounds3f slab = bounds;
+                        slab.pMin[dim] = binPosition(b);
+                        slab.pMax[dim] = binPosition(b + 1);
+                        bins[b].bound = Union(bins[b].bound, clipReference(ref, slab));
+                    }
+                }
+                ++bins[first].entries;
+                ++bins[last].exits;
+            }
+            Bounds3f rightBounds[SBVH_SPATIAL_BINS];
+            int rightCounts[SBVH_SPATIAL_BINS];
+            rightBounds[SBVH_SPATIAL_BINS - 1] = bins[SBVH_SPATIAL_BINS - 1].bound;
+            rightCounts[SBVH_SPATIAL_BINS - 1] = bins[SBVH_SPATIAL_BINS - 1].exits;
+            for(int i = SBVH_SPATIAL_BINS - 2; i >= 0; --i) {
+                rightBounds[i] = Union(rightBounds[i + 1], bins[i].bound);
+                rightCounts[i] = rightCounts[i + 1] + bins[i].exits;
+            }
+            int c0 = 0;
+            Bounds3f b0;
+            for(int i = 0; i < SBVH_SPATIAL_BINS - 1; ++i) {
+                c0 += bins[i].entries;
+                b0 = Union(b0, bins[i].bound);
+                int c1 = rightCounts[i + 1];
+                if(c0 == 0 || c1 == 0) continue;
+                Float cost = options.traversalCost + options.intersectionCost * (c0 * b0.SurfaceArea() + c1 * rightBounds[i + 1].SurfaceArea()) / area;
+                if(cost < spatialCost) {
+                    spatialCost = cost;
+                    spatialDim = dim;
+                    spatialPosition = binPosition(i + 1);
+                    spatialLeftCount = c0;
+                    spatialRightCount = c1;
+                    spatialBound0 = b0;
+                    spatialBound1 = rightBounds[i + 1];
+                }
+            }
+        }
+    }
+
+    Float leafCost = options.intersectionCost * nReferences;
+    Float minimumCost = std::min(objectCost, spatialCost);
+    if(minimumCost == Infinity || (nReferences <= maxPrimitivesInNode && leafCost <= minimumCost)) 
+        return createLeaf();
+
+    std::vector<BVHPrimitiveInfo> left, right;
+    int dim;
+    if(spatialCost < objectCost) {
+        dim = spatialDim;
+        Bounds3f leftClip = bounds, rightClip = bounds;
+        leftClip.pMax[dim] = spatialPosition;
+        rightClip.pMin[dim] = spatialPosition;
+        for(const BVHPrimitiveInfo &ref: references) {
+            if(ref.bound.pMax[dim] <= spatialPosition) {
+                left.push_back(ref);
+            } else if(ref.bound.pMin[dim] >= spatialPosition) {
+                right.push_back(ref);
+            } else {
+                // The reference crosses the plane, compare the cost of splitting it with putting it into one side(unsplitting)
+                Bounds3f leftBound = clipReference(ref, leftClip), rightBound = clipReference(ref, rightClip);
+                if(IsEmpty(leftBound)) {
+                    right.push_back(BVHPrimitiveInfo(ref.index, rightBound));
+                    continue;
+                }
+                if(IsEmpty(rightBound)) {
+                    left.push_back(BVHPrimitiveInfo(ref.index, leftBound));
+                    continue;
+                }
+                Float splitCost = Union(spatialBound0, leftBound).SurfaceArea() * spatialLeftCount + Union(spatialBound1, rightBound).SurfaceArea() * spatialRightCount;
+                Float leftCost = Union(spatialBound0, ref.bound).SurfaceArea() * spatialLeftCount + spatialBound1.SurfaceArea() * (spatialRightCount - 1);
+                Float rightCost = spatialBound0.SurfaceArea() * (spatialLeftCount - 1) + Union(spatialBound1, ref.bound).SurfaceArea() * spatialRightCount;
+                if(splitBudget > 0 && splitCost < leftCost && splitCost < rightCost) {
+                    left.push_back(BVHPrimitiveInfo(ref.index, leftBound));
+                    right.push_back(BVHPrimitiveInfo(ref.index, rightBound));
+                    --splitBudget;
+                    ++DuplicatedReferences;
+                } else if(leftCost <= rightCost) {
+                    left.push_back(ref);
+                } else {
+                    right.push_back(ref);
+                }
+            }
+        }
+    }
+    if(left.empty() || right.empty()) { // no spatial split or it failed, use the object split
+        if(objectDim == -1) return createLeaf();
+        dim = objectDim;
+        left.clear();
+        right.clear();
+        for(const BVHPrimitiveInfo &ref: references) {
+            if(objectBucketIndex(ref, dim) <= objectBucket) left.push_back(ref);
+            else right.push_back(ref);
+        }
+    }
+    std::vector<BVHPrimitiveInfo>().swap(references); // release memory before going deeper
+    node->InitInterior(dim,
+                       SpatialSplitBuild(arena, std::move(left), rootArea, depth + 1, splitBudget, totalNodes, orderedPrimitives),
+                       SpatialSplitBuild(arena, std::move(right), rootArea, depth + 1, splitBudget, totalNodes, orderedPrimitives));
+    return node;
+}
+
+/**
+ * Compute the cost of each node in the subtree with the same model as building.
+ * The cost is multiplied by the surface area of the node, so the cost of an interior node is the sum of its children plus its traversal cost.
+*/
+static Float ComputeNodeCost(BVHBuildNode *node, const BVHBuildOptions &options) {
+    if(node->nPrimitives > 0) 
+        node->cost = options.intersectionCost * node->nPrimitives * node->bound.SurfaceArea();
+    else
+        node->cost = options.traversalCost * node->bound.SurfaceArea() + ComputeNodeCost(node->children[0], options) + ComputeNodeCost(node->children[1], options);
+    return node->cost;
+}
+
+/**
+ * The split axis of a node merging two children: the axis where the centers of their bounds are separated most.
+ * The children are swapped if needed so c0 has the smaller center in the axis, then the traversal order is decided by the ray direction.
+*/
+static int SeparationAxis(BVHBuildNode *&c0, BVHBuildNode *&c1) {
+    Vector3f d = (c1->bound.pMin + c1->bound.pMax) - (c0->bound.pMin + c0->bound.pMax);
+    int axis = 0;
+    if(std::abs(d.y) > std::abs(d[axis])) axis = 1;
+    if(std::abs(d.z) > std::abs(d[axis])) axis = 2;
+    if(d[axis] < 0) std::swap(c0, c1);
+    return axis;
+}
+
+/**
+ * Set the children of an interior node rebuilt by treelet optimization, the axis and order are decided by SeparationAxis.
+*/
+static void SetTreeletChildren(BVHBuildNode *node, BVHBuildNode *c0, BVHBuildNode *c1) {
+    node->splitAxis = SeparationAxis(c0, c1);
+    node->children[0] = c0;
+    node->children[1] = c1;
+    node->bound = Union(c0->bound, c1->bound);
+}
+
+/**
+ * Restructure the treelet rooted at root with the optimal topology.
+ * The treelet is formed by expanding the leaf with the largest surface area until it has treeletSize leaves,
+ * then every subset of the leaves gets its best cost and partition by dynamic programming.
+ * The interior nodes of the treelet are reused, so the amount of nodes doesn't change and no memory is allocated.
+ * The costs of the treelet leaves must be up to date, the cost of root is updated.
+*/
+static void RestructureTreelet(BVHBuildNode *root, int treeletSize, Float traversalCost) {
+    PBRT_CONSTEXPR int maxTreeletSize = 8;
+    DCHECK_LE(treeletSize, maxTreeletSize);
+    BVHBuildNode *leaves[maxTreeletSize];
+    BVHBuildNode *interiors[maxTreeletSize - 1];
+    int nLeaves = 2, nInteriors = 1;
+    leaves[0] = root->children[0];
+    leaves[1] = root->children[1];
+    interiors[0] = root;
+    while(nLeaves < treeletSize) {
+        int largest = -1;
+        for(int i = 0; i < nLeaves; ++i) {
+            if(leaves[i]->nPrimitives == 0 && (largest == -1 || leaves[i]->bound.SurfaceArea() > leaves[largest]->bound.SurfaceArea()))
+                largest = i;
+        }
+        if(largest == -1) break; // all treelet leaves are actual leaves
+        BVHBuildNode *node = leaves[largest];
+        interiors[nInteriors++] = node;
+        leaves[largest] = node->children[0];
+        leaves[nLeaves++] = node->children[1];
+    }
+    root->cost = traversalCost * root->bound.SurfaceArea() + root->children[0]->cost + root->children[1]->cost;
+    if(nLeaves < 3) return; // two leaves have only one topology
+
+    // Subsets of the leaves are represented by bit masks, every proper subset of s is smaller than s
+    int nSubsets = 1 << nLeaves;
+    Float area[1 << maxTreeletSize], bestCost[1 << maxTreeletSize];
+    int bestPartition[1 << maxTreeletSize];
+    for(int s = 1; s < nSubsets; ++s) {
+        Bounds3f b;
+        for(int i = 0; i < nLeaves; ++i) 
+            if(s & (1 << i)) b = Union(b, leaves[i]->bound);
+        area[s] = b.SurfaceArea();
+    }
+    for(int s = 1; s < nSubsets; ++s) {
+        if((s & (s - 1)) == 0) { // a single leaf keeps its subtree
+            int i = 0;
+            while((1 << i) != s) ++i;
+            bestCost[s] = leaves[i]->cost;
+            continue;
+        }
+        // Only visit the partitions containing the lowest leaf, the others are the same partitions with children swapped
+        int lowest = s & -s;
+        Float cost = Infinity;
+        for(int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+            if(!(p & lowest)) continue;
+            Float c = bestCost[p] + bestCost[s ^ p];
+            if(c < cost) {
+                cost = c;
+                bestPartition[s] = p;
+            }
+        }
+        bestCost[s] = traversalCost * area[s] + cost;
+    }
+    if(bestCost[nSubsets - 1] >= root->cost * (1 - 1e-5f)) return; // keep the treelet if it can't be improved obviously
+
+    // Rebuild the treelet from the root, the subset of leaves which has more than one leaf takes an unused interior node
+    int nextInterior = 1;
+    std::function<BVHBuildNode *(int, BVHBuildNode *)> emit = [&](int s, BVHBuildNode *node) {
+        if((s & (s - 1)) == 0) {
+            int i = 0;
+            while((1 << i) != s) ++i;
+            return leaves[i];
+        }
+        if(node == nullptr) node = interiors[nextInterior++];
+        int p = bestPartition[s];
+        BVHBuildNode *c0 = emit(p, nullptr);
+        BVHBuildNode *c1 = emit(s ^ p, nullptr);
+        SetTreeletChildren(node, c0, c1);
+        node->cost = bestCost[s];
+        return node;
+    };
+    emit(nSubsets - 1, root);
+    DCHECK_EQ(nextInterior, nInteriors);
+}
+
+BVHBuildNode *BVHAccel::SweepSAHBuild(MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfos, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives) {
+    int nPrimitives = primitiveInfos.size();
+    SweepSAHState state(primitiveInfos);
+    for(int axis = 0; axis < 3; ++axis) {
+        std::vector<int> &sorted = state.sorted[axis];
+        sorted.resize(nPrimitives);
+        for(int i = 0; i < nPrimitives; ++i) sorted[i] = i;
+        std::sort(sorted.begin(), sorted.end(), [&](int a, int b){ // the ties are sorted by index, so the tree doesn't depend on the sort algorithm
+            Float ca = primitiveInfos[a].centroid[axis], cb = primitiveInfos[b].centroid[axis];
+            return ca < cb || (ca == cb && a < b);
+        });
+    }
+    state.rightBounds.resize(nPrimitives + 1);
+    state.isLeft.resize(nPrimitives);
+    state.scratch.resize(nPrimitives);
+    return SweepSAHSplit(arena, state, 0, nPrimitives, totalNodes, orderedPrimitives);
+}
+
+BVHBuildNode *BVHAccel::SweepSAHSplit(MemoryArena &arena, SweepSAHState &state, int begin, int end, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives) const {
+    DCHECK_LT(begin, end);
+    BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+    ++totalNodes;
+    const std::vector<BVHPrimitiveInfo> &infos = state.primitiveInfos;
+    int nPrimitives = end - begin;
+    Bounds3f bounds;
+    for(int i = begin; i < end; ++i) 
+        bounds = Union(bounds, infos[state.sorted[0][i]].bound);
+    auto createLeaf = [&]() {
+        for(int i = begin; i < end; ++i) 
+            orderedPrimitives[i] = primitives[infos[state.sorted[0][i]].index];
+        node->InitLeaf(begin, nPrimitives, bounds);
+        return node;
+    };
+    if(nPrimitives == 1) return createLeaf();
+
+    // Sweep each axis from right to left to get the bounds of the right sides, then from left to right to evaluate every split
+    Float minimumCost = Infinity;
+    int bestAxis = 0, bestMid = begin + 1;
+    Float area = bounds.SurfaceArea();
+    for(int axis = 0; axis < 3; ++axis) {
+        const std::vector<int> &sorted = state.sorted[axis];
+        state.rightBounds[end] = Bounds3f();
+        for(int i = end - 1; i > begin; --i) 
+            state.rightBounds[i] = Union(state.rightBounds[i + 1], infos[sorted[i]].bound);
+        Bounds3f leftBound;
+        for(int mid = begin + 1; mid < end; ++mid) { // mid is the first reference of the right side
+            leftBound = Union(leftBound, infos[sorted[mid - 1]].bound);
+            Float cost = options.traversalCost + options.intersectionCost * 
+                         ((mid - begin) * leftBound.SurfaceArea() + (end - mid) * state.rightBounds[mid].SurfaceArea()) / area;
+            if(cost < minimumCost) {
+                minimumCost = cost;
+                bestAxis = axis;
+                bestMid = mid;
+            }
+        }
+    }
+    Float leafCost = options.intersectionCost * nPrimitives;
+    if(nPrimitives <= maxPrimitivesInNode && minimumCost >= leafCost) return createLeaf();
+
+    // Partition the other lists stably, so they keep sorted in both children
+    for(int i = begin; i < end; ++i) 
+        state.isLeft[state.sorted[bestAxis][i]] = i < bestMid;
+    for(int axis = 0; axis < 3; ++axis) {
+        if(axis == bestAxis) continue;
+        std::vector<int> &sorted = state.sorted[axis];
+        int left = begin, right = bestMid;
+        for(int i = begin; i < end; ++i) 
+            state.scratch[state.isLeft[sorted[i]] ? left++ : right++] = sorted[i];
+        DCHECK_EQ(left, bestMid);
+        std::copy(state.scratch.begin() + begin, state.scratch.begin() + end, sorted.begin() + begin);
+    }
+    node->InitInterior(bestAxis, 
+                       SweepSAHSplit(arena, state, begin, bestMid, totalNodes, orderedPrimitives),
+                       SweepSAHSplit(arena, state, bestMid, end, totalNodes, orderedPrimitives));
+    return node;
+}
+
+BVHBuildNode *BVHAccel::PLOCBuild(std::vector<MemoryArena> &arenas, const std::vector<BVHPrimitiveInfo> &primitiveInfos, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives) {
+    int nPrimitives = primitiveInfos.size();
+    bool parallel = ParallelForLoopExecutor::NumThreads() > 1 && nPrimitives >= PARALLEL_BUILD_THRESHOLD;
+    Bounds3f bounds, centroidBounds;
+    ComputeBounds(primitiveInfos, 0, nPrimitives, parallel, PARALLEL_CHUNK_SIZE, bounds, centroidBounds);
+    std::vector<MortonPrimitive> mortonPrimitives;
+    SortByMortonCode(primitiveInfos, centroidBounds, MORTON_BITS, parallel, PARALLEL_CHUNK_SIZE, mortonPrimitives);
+
+    // Every primitive is a leaf cluster, leafPrimitives[i] is the primitive of the ith leaf in the Morton order
+    std::vector<std::shared_ptr<Primitive>> leafPrimitives(nPrimitives);
+    std::vector<BVHBuildNode *> clusters(nPrimitives);
+    ParallelFor(parallel, [&](int64_t i){
+        const BVHPrimitiveInfo &info = primitiveInfos[mortonPrimitives[i].primitiveIndex];
+        leafPrimitives[i] = primitives[info.index];
+        clusters[i] = arenas[ThreadIndex].Alloc<BVHBuildNode>();
+        clusters[i]->InitLeaf(i, 1, info.bound);
+    }, nPrimitives, 512);
+
+    int radius = std::max(1, options.plocRadius);
+    std::vector<int> nearest(nPrimitives);
+    std::vector<BVHBuildNode *> merged(nPrimitives);
+    while(clusters.size() > 1) {
+        int nClusters = clusters.size();
+        bool parallelPass = parallel && nClusters >= PLOC_PARALLEL_THRESHOLD;
+        // The ties are broken by the smaller index, so the pair with the globally smallest distance is always mutual and merged
+        ParallelFor(parallelPass, [&](int64_t i){
+            Float bestArea = Infinity;
+            for(int j = std::max<int>(0, i - radius); j <= std::min<int>(nClusters - 1, i + radius); ++j) {
+                if(j == i) continue;
+                Float area = Union(clusters[i]->bound, clusters[j]->bound).SurfaceArea();
+                if(area < bestArea) {
+                    bestArea = area;
+                    nearest[i] = j;
+                }
+            }
+        }, nClusters, 256);
+        ParallelFor(parallelPass, [&](int64_t i){
+            int j = nearest[i];
+            if(nearest[j] != i) {
+                merged[i] = clusters[i];
+            } else if(i < j) { // the mutual pair is merged by the smaller index
+                BVHBuildNode *node = arenas[ThreadIndex].Alloc<BVHBuildNode>();
+                BVHBuildNode *c0 = clusters[i], *c1 = clusters[j];
+                int axis = SeparationAxis(c0, c1);
+                node->InitInterior(axis, c0, c1);
+                merged[i] = node;
+            } else {
+                merged[i] = nullptr;
+            }
+        }, nClusters, 256);
+
+        // Compact the clusters in the same order, each chunk counts its clusters and writes them after the previous chunks
+        int nChunks = (nClusters + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+        std::vector<int> chunkOffsets(nChunks + 1, 0);
+        ParallelFor(parallelPass, [&](int64_t chunk){
+            int end = std::min<int>(nClusters, (chunk + 1) * PARALLEL_CHUNK_SIZE);
+            for(int i = chunk * PARALLEL_CHUNK_SIZE; i < end; ++i) 
+                if(merged[i] != nullptr) ++chunkOffsets[chunk + 1];
+        }, nChunks, 1);
+        for(int chunk = 0; chunk < nChunks; ++chunk) 
+            chunkOffsets[chunk + 1] += chunkOffsets[chunk];
+        ParallelFor(parallelPass, [&](int64_t chunk){
+            int end = std::min<int>(nClusters, (chunk + 1) * PARALLEL_CHUNK_SIZE);
+            int offset = chunkOffsets[chunk];
+            for(int i = chunk * PARALLEL_CHUNK_SIZE; i < end; ++i) 
+                if(merged[i] != nullptr) clusters[offset++] = merged[i];
+        }, nChunks, 1);
+        DCHECK_LT(chunkOffsets[nChunks], nClusters);
+        clusters.resize(chunkOffsets[nChunks]);
+    }
+
+    int offset = 0;
+    CollapsePLOCLeaves(clusters[0], leafPrimitives, orderedPrimitives, offset, totalNodes);
+    DCHECK_EQ(offset, nPrimitives);
+    return clusters[0];
+}
+
+int BVHAccel::CollapsePLOCLeaves(BVHBuildNode *node, const std::vector<std::shared_ptr<Primitive>> &leafPrimitives, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives, int &offset, int &totalNodes) const {
+    int nodesBefore = totalNodes++;
+    Float area = node->bound.SurfaceArea();
+    if(node->nPrimitives > 0) {
+        orderedPrimitives[offset] = leafPrimitives[node->primitiveOffset];
+        node->primitiveOffset = offset++;
+        node->cost = options.intersectionCost * area;
+        return 1;
+    }
+    int first = offset;
+    int n = CollapsePLOCLeaves(node->children[0], leafPrimitives, orderedPrimitives, offset, totalNodes) + 
+            CollapsePLOCLeaves(node->children[1], leafPrimitives, orderedPrimitives, offset, totalNodes);
+    node->cost = options.traversalCost * area + node->children[0]->cost + node->children[1]->cost;
+    Float leafCost = options.intersectionCost * n * area;
+    if(n <= maxPrimitivesInNode && leafCost <= node->cost) { // the primitives of the subtree are already contiguous
+        node->nPrimitives = n;
+        node->primitiveOffset = first;
+        node->children[0] = node->children[1] = nullptr;
+        node->cost = leafCost;
+        totalNodes = nodesBefore + 1;
+    }
+    return n;
+}
+
+void BVHAccel::OptimizeTreelets(BVHBuildNode *root) {
+    if(root->nPrimitives > 0) return;
+    bool parallel = ParallelForLoopExecutor::NumThreads() > 1;
+    Float originalCost = ComputeNodeCost(root, options);
+    for(int pass = 0; pass < options.treeletPasses; ++pass) {
+        // Group interior nodes by depth, treelets rooted at the same depth never overlap
+        std::vector<std::vector<BVHBuildNode *>> levels;
+        levels.push_back({root});
+        while(true) {
+            std::vector<BVHBuildNode *> next;
+            for(BVHBuildNode *node: levels.back()) {
+                for(BVHBuildNode *child: node->children) 
+                    if(child->nPrimitives == 0) next.push_back(child);
+            }
+            if(next.empty()) break;
+            levels.push_back(std::move(next));
+        }
+        // From bottom to top, so the subtrees below a treelet are optimized and their costs are updated before it
+        for(int depth = levels.size() - 1; depth >= 0; --depth) {
+            std::vector<BVHBuildNode *> &level = levels[depth];
+            ParallelFor(parallel && level.size() >= TREELET_PARALLEL_THRESHOLD, [&](int64_t i){
+                RestructureTreelet(level[i], TREELET_SIZE, options.traversalCost);
+            }, level.size(), 16);
+        }
+    }
+    LOG(INFO) << "Optimize BVH treelets, SAH cost from " << originalCost / root->bound.SurfaceArea() << " to " << root->cost / root->bound.SurfaceArea();
+}
+
+/**
+ * Compute the cost of every linear node with the same model as ComputeNodeCost.
+ * Children are always after their parent in nodes in every layout, so a reverse pass visits children first.
+*/
+void BVHAccel::ComputeLinearCosts(std::vector<Float> &costs) const {
+    costs.resize(totalNodes);
+    for(int i = totalNodes - 1; i >= 0; --i) {
+        const LinearBVHNode &node = nodes[i];
+        if(node.nPrimitives > 0) 
+            costs[i] = options.intersectionCost * node.nPrimitives * node.bound.SurfaceArea();
+        else
+            costs[i] = options.traversalCost * node.bound.SurfaceArea() + costs[ChildIndex(i, 0)] + costs[ChildIndex(i, 1)];
+    }
+}
+
+/**
+ * The SAH cost of the subtree rooted at nodes[index], it is independent of the scale of the subtree.
+*/
+inline Float SubtreeCost(const LinearBVHNode *nodes, const std::vector<Float> &costs, int index) {
+    Float area = nodes[index].bound.SurfaceArea();
+    return area > 0 ? costs[index] / area : 0;
+}
+
+/**
+ * Move the primitive offsets of all leaves in the subtree by base.
+*/
+static void OffsetLeaves(BVHBuildNode *node, int base) {
+    if(node->nPrimitives > 0) {
+        node->primitiveOffset += base;
+        return;
+    }
+    OffsetLeaves(node->children[0], base);
+    OffsetLeaves(node->children[1], base);
+}
+
+void BVHAccel::Refit() {
+    if(compressedNodes != nullptr) {
+        LOG(ERROR) << "Refit doesn't support compressed BVH nodes";
+        return;
+    }
+    if(!lazySubtrees.empty()) {
+        LOG(ERROR) << "Refit doesn't support lazy BVH";
+        return;
+    }
+    if(nodes == nullptr) return;
+    bool monitor = options.refitRebuildThreshold > 0;
+    std::vector<Float> costs;
+    if(monitor && refitSubtrees.empty()) { // the bounds are still the built ones, record their costs as the baseline
+        ComputeLinearCosts(costs);
+        for(int index: FindRefitSubtrees()) 
+            refitSubtrees.push_back(RefitSubtree{index, SubtreeCost(nodes, costs, index)});
+    }
+    RefitBounds();
+    PackTriangles(); // the vertices moved
+    if(!monitor) return;
+    ComputeLinearCosts(costs);
+    std::vector<int> degraded;
+    for(const RefitSubtree &subtree: refitSubtrees) {
+        if(nodes[subtree.nodeIndex].nPrimitives == 0 && SubtreeCost(nodes, costs, subtree.nodeIndex) > subtree.baselineCost * options.refitRebuildThreshold)
+            degraded.push_back(subtree.nodeIndex);
+    }
+    if(!degraded.empty()) 
+        RebuildSubtrees(degraded);
+}
+
+std::vector<int> BVHAccel::FindRefitSubtrees() const {
+    std::vector<int> counts(totalNodes); // How many primitives each subtree has
+    for(int i = totalNodes - 1; i >= 0; --i) 
+        counts[i] = nodes[i].nPrimitives > 0 ? nodes[i].nPrimitives : counts[ChildIndex(i, 0)] + counts[ChildIndex(i, 1)];
+    std::vector<int> roots;
+    std::vector<int> toVisit = {0};
+    while(!toVisit.empty()) {
+        int index = toVisit.back();
+        toVisit.pop_back();
+        if(counts[index] <= REFIT_SUBTREE_SIZE || nodes[index].nPrimitives > 0) {
+            roots.push_back(index);
+            continue;
+        }
+        toVisit.push_back(ChildIndex(index, 1));
+        toVisit.push_back(ChildIndex(index, 0));
+    }
+    return roots;
+}
+
+void BVHAccel::RefitBounds() {
+    // Group nodes by depth, a node only reads its children in the deeper level
+    std::vector<int> depths(totalNodes, 0);
+    int maxDepth = 0;
+    for(int i = 0; i < totalNodes; ++i) {
+        maxDepth = std::max(maxDepth, depths[i]);
+        if(nodes[i].nPrimitives == 0) 
+            depths[ChildIndex(i, 0)] = depths[ChildIndex(i, 1)] = depths[i] + 1;
+    }
+    std::vector<std::vector<int>> levels(maxDepth + 1);
+    for(int i = 0; i < totalNodes; ++i) 
+        levels[depths[i]].push_back(i);
+
+    bool parallel = ParallelForLoopExecutor::NumThreads() > 1;
+    for(int depth = maxDepth; depth >= 0; --depth) {
+        const std::vector<int> &level = levels[depth];
+        ParallelFor(parallel && level.size() >= REFIT_PARALLEL_THRESHOLD, [&](int64_t k){
+            int index = level[k];
+            LinearBVHNode &node = nodes[index];
+            if(node.nPrimitives > 0) {
+                Bounds3f bound;
+                for(int i = 0; i < node.nPrimitives; ++i) 
+                    bound = Union(bound, primitives[node.primitiveOffset + i]->WorldBound());
+                node.bound = bound;
+            } else {
+                node.bound = Union(nodes[ChildIndex(index, 0)].bound, nodes[ChildIndex(index, 1)].bound);
+            }
+        }, level.size(), 256);
+    }
+}
+
+void BVHAccel::RebuildSubtrees(const std::vector<int> &roots) {
+    int nSubtrees = roots.size();
+    std::vector<MemoryArena> arenas(std::max(1, ParallelForLoopExecutor::NumThreads()));
+    std::vector<BVHBuildNode *> subtreeRoots(nSubtrees);
+    std::vector<int> subtreeNodes(nSubtrees, 0);
+    std::vector<std::vector<std::shared_ptr<Primitive>>> subtreePrimitives(nSubtrees);
+    ParallelFor(ParallelForLoopExecutor::NumThreads() > 1 && nSubtrees > 1, [&](int64_t k){
+        // The references in the leaves are rebuilt, an info indexes the position of its reference in primitives
+        std::vector<BVHPrimitiveInfo> infos;
+        std::vector<int> toVisit = {roots[k]};
+        while(!toVisit.empty()) {
+            int index = toVisit.back();
+            toVisit.pop_back();
+            const LinearBVHNode &node = nodes[index];
+            if(node.nPrimitives > 0) {
+                for(int i = node.primitiveOffset; i < node.primitiveOffset + node.nPrimitives; ++i) 
+                    infos.push_back(BVHPrimitiveInfo(i, primitives[i]->WorldBound()));
+            } else {
+                toVisit.push_back(ChildIndex(index, 1));
+                toVisit.push_back(ChildIndex(index, 0));
+            }
+        }
+        subtreePrimitives[k].resize(infos.size());
+        subtreeRoots[k] = RecursiveBuild(arenas[ThreadIndex], infos, 0, infos.size(), subtreeNodes[k], subtreePrimitives[k]);
+    }, nSubtrees, 1);
+
+    // The primitives of rebuilt subtrees are appended after the current ones, then all leaves are gathered in the new order
+    std::vector<std::shared_ptr<Primitive>> sources(primitives);
+    std::unordered_map<int, std::pair<BVHBuildNode *, int>> replaced;
+    for(int k = 0; k < nSubtrees; ++k) {
+        OffsetLeaves(subtreeRoots[k], sources.size());
+        sources.insert(sources.end(), subtreePrimitives[k].begin(), subtreePrimitives[k].end());
+        replaced[roots[k]] = std::make_pair(subtreeRoots[k], subtreeNodes[k]);
+    }
+    int newTotalNodes = 0;
+    BVHBuildNode *root = UnflattenBVHTree(arenas[0], 0, replaced, newTotalNodes);
+    ReleaseNodes();
+    nodes = AllocAligned<LinearBVHNode>(newTotalNodes);
+    int offset = 0;
+    FlattenBVHTree(root, nodes, offset);
+    DCHECK_EQ(newTotalNodes, offset);
+    primitives.clear();
+    for(int i = 0; i < newTotalNodes; ++i) {
+        LinearBVHNode &node = nodes[i];
+        if(node.nPrimitives == 0) continue;
+        int first = primitives.size();
+        primitives.insert(primitives.end(), sources.begin() + node.primitiveOffset, sources.begin() + node.primitiveOffset + node.nPrimitives);
+        node.primitiveOffset = first;
+    }
+    int oldTotalNodes = totalNodes;
+    totalNodes = newTotalNodes;
+    siblingPairs = false;
+    if(options.layout != BVHLayout::DepthFirst) 
+        LayoutNodes(options.layout, std::vector<Float>());
+    LinkParents();
+    LinearTreeBytes += (int64_t)(totalNodes - oldTotalNodes) * sizeof(LinearBVHNode);
+
+    // The tree above the watched subtrees is not changed, so they are found again in the same order
+    std::vector<Float> costs;
+    ComputeLinearCosts(costs);
+    std::vector<int> watched = FindRefitSubtrees();
+    DCHECK_EQ(watched.size(), refitSubtrees.size());
+    for(int k = 0; k < refitSubtrees.size(); ++k) {
+        if(replaced.count(refitSubtrees[k].nodeIndex)) 
+            refitSubtrees[k].baselineCost = SubtreeCost(nodes, costs, watched[k]);
+        refitSubtrees[k].nodeIndex = watched[k];
+    }
+    PackTriangles(); // the primitives are reordered
+    LOG(INFO) << "Refit BVH rebuilt " << nSubtrees << " degraded subtrees";
+}
+
+BVHBuildNode *BVHAccel::UnflattenBVHTree(MemoryArena &arena, int index, const std::unordered_map<int, std::pair<BVHBuildNode *, int>> &replaced, int &totalNodes) {
+    auto it = replaced.find(index);
+    if(it != replaced.end()) {
+        totalNodes += it->second.second;
+        return it->second.first;
+    }
+    const LinearBVHNode &linearNode = nodes[index];
+    BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+    ++totalNodes;
+    node->bound = linearNode.bound;
+    node->nPrimitives = linearNode.nPrimitives;
+    if(linearNode.nPrimitives > 0) {
+        node->primitiveOffset = linearNode.primitiveOffset;
+        node->children[0] = node->children[1] = nullptr;
+    } else {
+        node->splitAxis = linearNode.axis;
+        node->children[0] = UnflattenBVHTree(arena, ChildIndex(index, 0), replaced, totalNodes);
+        node->children[1] = UnflattenBVHTree(arena, ChildIndex(index, 1), replaced, totalNodes);
+    }
+    return node;
+}
+
+int BVHAccel::FlattenBVHTree(const BVHBuildNode *node, LinearBVHNode *linearNodes, int &offset) {
+    LinearBVHNode *linearNode = linearNodes + offset;
+    int myOffset = offset++;
+    linearNode->bound = node->bound;
+    if(node->nPrimitives == 0) { // Interior node
+        linearNode->axis = node->splitAxis;
+        linearNode->nPrimitives = 0;
+        FlattenBVHTree(node->children[0], linearNodes, offset);
+        linearNode->secondChildOffset = FlattenBVHTree(node->children[1], linearNodes, offset);
+    } else {
+        CHECK_LE(node->nPrimitives, LAZY_SUBTREE) << "A leaf has more primitives than a linear node can count";
+        linearNode->primitiveOffset = node->primitiveOffset;
+        linearNode->nPrimitives = node->nPrimitives;
+    }
+    return myOffset;
+}
+
+void BVHAccel::LayoutNodes(BVHLayout layout, const std::vector<Float> &visits) {
+    std::vector<Float> heat(visits);
+    if(heat.empty()) { // the probability that a ray hitting the root visits a node is proportional to its surface area
+        heat.resize(totalNodes);
+        for(int i = 0; i < totalNodes; ++i) 
+            heat[i] = nodes[i].bound.SurfaceArea();
+    }
+    // A unit is the sibling pair of an interior node, it is identified by the index of the node
+    auto isInterior = [&](int index) { return nodes[index].nPrimitives == 0; };
+    auto unitHeat = [&](int unit) { return heat[ChildIndex(unit, 0)] + heat[ChildIndex(unit, 1)]; };
+    std::vector<int> order; // The current index of each node in the new layout, -1 is the padding
+    order.reserve(totalNodes + 1);
+    auto emit = [&](int unit) {
+        order.push_back(ChildIndex(unit, 0));
+        order.push_back(ChildIndex(unit, 1));
+    };
+    bool pairs = layout != BVHLayout::DepthFirst;
+    if(!pairs) {
+        std::vector<int> toVisit = {0};
+        while(!toVisit.empty()) {
+            int index = toVisit.back();
+            toVisit.pop_back();
+            order.push_back(index);
+            if(isInterior(index)) {
+                toVisit.push_back(ChildIndex(index, 1));
+                toVisit.push_back(ChildIndex(index, 0));
+            }
+        }
+    } else {
+        // The root is alone, a padding node after it makes every pair start at an even index, so a pair fills one 64 bytes cache line
+        order.push_back(0);
+        order.push_back(-1);
+        if(layout == BVHLayout::VanEmdeBoas && isInterior(0)) {
+            std::vector<int> heights(totalNodes, 0); // The height of the unit tree below each interior node
+            for(int i = totalNodes - 1; i >= 0; --i) {
+                if(!isInterior(i)) continue;
+                heights[i] = 1;
+                for(int c = 0; c < 2; ++c) 
+                    if(isInterior(ChildIndex(i, c))) heights[i] = std::max(heights[i], heights[ChildIndex(i, c)] + 1);
+            }
+            // Lay out the top half levels of the unit tree, then each subtree below them, both recursively
+            std::function<void(int, int)> layoutSubtree = [&](int unit, int height) {
+                if(height == 1) {
+                    emit(unit);
+                    return;
+                }
+                int top = height / 2;
+                layoutSubtree(unit, top);
+                std::vector<std::pair<int, int>> toVisit = {{unit, 0}};
+                std::vector<int> bottoms;
+                while(!toVisit.empty()) {
+                    std::pair<int, int> item = toVisit.back();
+                    toVisit.pop_back();
+                    if(item.second == top) {
+                        bottoms.push_back(item.first);
+                        continue;
+                    }
+                    for(int c = 1; c >= 0; --c) 
+                        if(isInterior(ChildIndex(item.first, c))) toVisit.push_back({ChildIndex(item.first, c), item.second + 1});
+                }
+                for(int bottom: bottoms) 
+                    layoutSubtree(bottom, std::min(height - top, heights[bottom]));
+            };
+            layoutSubtree(0, heights[0]);
+        } else if(isInterior(0)) {
+            int capacity = std::numeric_limits<int>::max(); // HotFirst is one treelet with all nodes
+            if(layout == BVHLayout::CacheLineTreelets) 
+                capacity = std::max(1, (int)(LAYOUT_CACHE_LINES * PBRT_L1_CACHE_LINE_SIZE / (2 * sizeof(LinearBVHNode))));
+            else if(layout == BVHLayout::PageTreelets) 
+                capacity = LAYOUT_PAGE_SIZE / (2 * sizeof(LinearBVHNode));
+            // Grow each treelet from its root to the hottest units, the units left on the frontier are the roots of other treelets.
+            // Treelets are laid out in depth first order, so a treelet is close to its parent treelet.
+            std::vector<int> treeletRoots = {0};
+            while(!treeletRoots.empty()) {
+                std::priority_queue<std::pair<Float, int>> frontier;
+                frontier.push({unitHeat(treeletRoots.back()), treeletRoots.back()});
+                treeletRoots.pop_back();
+                for(int size = 0; !frontier.empty() && size < capacity; ++size) {
+                    int unit = frontier.top().second;
+                    frontier.pop();
+                    emit(unit);
+                    for(int c = 0; c < 2; ++c) 
+                        if(isInterior(ChildIndex(unit, c))) frontier.push({unitHeat(ChildIndex(unit, c)), ChildIndex(unit, c)});
+                }
+                std::vector<int> rest;
+                for(; !frontier.empty(); frontier.pop()) 
+                    rest.push_back(frontier.top().second);
+                treeletRoots.insert(treeletRoots.end(), rest.rbegin(), rest.rend()); // the hottest one is laid out first
+            }
+        }
+    }
+    DCHECK_EQ(order.size(), totalNodes + (pairs ? 1 : 0) - (siblingPairs ? 1 : 0)); // the old padding is not reachable
+
+    std::vector<int> newIndices(totalNodes, -1);
+    for(int i = 0; i < order.size(); ++i) 
+        if(order[i] >= 0) newIndices[order[i]] = i;
+    LinearBVHNode *newNodes = AllocAligned<LinearBVHNode>(order.size());
+    for(int i = 0; i < order.size(); ++i) {
+        LinearBVHNode &node = newNodes[i];
+        if(order[i] < 0) { // a leaf which is never reached, it stays valid after Refit
+            node = LinearBVHNode();
+            node.bound = primitives[0]->WorldBound();
+            node.primitiveOffset = 0;
+            node.nPrimitives = 1;
+            continue;
+        }
+        node = nodes[order[i]];
+        if(node.nPrimitives > 0) continue;
+        int first = newIndices[ChildIndex(order[i], 0)];
+        int second = newIndices[ChildIndex(order[i], 1)];
+        if(pairs) {
+            DCHECK_EQ(second, first + 1);
+            node.secondChildOffset = first;
+        } else {
+            DCHECK_EQ(first, i + 1);
+            node.secondChildOffset = second;
+        }
+    }
+    ReleaseNodes();
+    nodes = newNodes;
+    totalNodes = order.size();
+    siblingPairs = pairs;
+}
+
+void BVHAccel::Relayout(BVHLayout layout, const std::vector<Ray> &rays) {
+    if(compressedNodes != nullptr) {
+        LOG(ERROR) << "Relayout doesn't support compressed BVH nodes";
+        return;
+    }
+    if(!lazySubtrees.empty()) {
+        LOG(ERROR) << "Relayout doesn't support lazy BVH";
+        return;
+    }
+    if(nodes == nullptr) return;
+    std::vector<Float> visits;
+    if(layout == BVHLayout::HotFirst && !rays.empty()) 
+        CountVisits(rays, visits);
+    int oldTotalNodes = totalNodes;
+    LayoutNodes(layout, visits);
+    LinkParents();
+    LinearTreeBytes += (int64_t)(totalNodes - oldTotalNodes) * sizeof(LinearBVHNode);
+    if(!refitSubtrees.empty()) { // they are found in the same order whatever the layout is
+        std::vector<int> watched = FindRefitSubtrees();
+        DCHECK_EQ(watched.size(), refitSubtrees.size());
+        for(int k = 0; k < refitSubtrees.size(); ++k) 
+            refitSubtrees[k].nodeIndex = watched[k];
+    }
+}
+
+void BVHAccel::CountVisits(const std::vector<Ray> &rays, std::vector<Float> &visits) const {
+    visits.assign(totalNodes, 0);
+    SurfaceInteraction isect;
+    std::vector<int> stack(treeDepth + 1); // a far child is pushed for each level at most
+    for(Ray ray: rays) { // a copy, the hits shorten tMax as Intersect does
+        Vector3f invD(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        int dirIsNeg[3] = {invD.x < 0, invD.y < 0, invD.z < 0};
+        int stackTopIndex = 0;
+        int currentNodeIndex = 0;
+        while(true) {
+            const LinearBVHNode &node = nodes[currentNodeIndex];
+            visits[currentNodeIndex] += 1;
+            if(node.bound.IntersectP(ray, invD, dirIsNeg)) {
+                if(node.nPrimitives == 0) {
+                    stack[stackTopIndex++] = ChildIndex(currentNodeIndex, dirIsNeg[node.axis] ? 0 : 1);
+                    currentNodeIndex = ChildIndex(currentNodeIndex, dirIsNeg[node.axis] ? 1 : 0);
+                    continue;
+                }
+                for(int i = 0; i < node.nPrimitives; ++i) 
+                    primitives[node.primitiveOffset + i]->Intersect(ray, isect);
+            }
+            if(stackTopIndex == 0) break;
+            currentNodeIndex = stack[--stackTopIndex];
+        }
+    }
+}
+
+/**
+ * The area of the part of the primitive reference inside the box, measured by half the surface area of its clipped bound.
+ * The reference only touching a face of the box or not crossing the box gets 0.
+*/
+static Float ClippedArea(const Primitive &primitive, const Bounds3f &reference, const Bounds3f &box) {
+    Bounds3f b = pbrt::Intersect(reference, box);
+    for(int a = 0; a < 3; ++a) {
+        if(b.pMin[a] > b.pMax[a]) return 0;
+        if(b.pMin[a] == b.pMax[a] && reference.pMin[a] < reference.pMax[a]) return 0;
+    }
+    Bounds3f clipped = primitive.ClippedWorldBound(b);
+    return IsEmpty(clipped) ? 0 : clipped.SurfaceArea() / 2;
+}
+
+BVHQuality BVHAccel::AnalyzeQuality() const {
+    BVHQuality quality;
+    if(compressedNodes != nullptr) {
+        LOG(ERROR) << "AnalyzeQuality doesn't support compressed BVH nodes";
+        return quality;
+    }
+    if(!lazySubtrees.empty()) {
+        LOG(ERROR) << "AnalyzeQuality doesn't support lazy BVH";
+        return quality;
+    }
+    if(nodes == nullptr) return quality;
+    std::vector<Float> costs;
+    ComputeLinearCosts(costs);
+    quality.sahCost = SubtreeCost(nodes, costs, 0);
+    ReportValue(SAHCost, quality.sahCost);
+
+    // Number the nodes in depth first order, a node is an ancestor of another one if the number of the other one is in its range
+    std::vector<int> sizes(totalNodes); // The amount of nodes in each subtree
+    for(int i = totalNodes - 1; i >= 0; --i) 
+        sizes[i] = nodes[i].nPrimitives > 0 ? 1 : 1 + sizes[ChildIndex(i, 0)] + sizes[ChildIndex(i, 1)];
+    std::vector<int> numbers(totalNodes, -1);
+    std::vector<int> leaves;
+    int nInteriors = 0;
+    std::vector<std::pair<int, int>> toVisit = {{0, 0}};
+    while(!toVisit.empty()) {
+        int index = toVisit.back().first, depth = toVisit.back().second;
+        toVisit.pop_back();
+        numbers[index] = leaves.size() + nInteriors;
+        const LinearBVHNode &node = nodes[index];
+        if(node.nPrimitives > 0) {
+            leaves.push_back(index);
+            if(quality.leafDepths.size() <= depth) quality.leafDepths.resize(depth + 1, 0);
+            if(quality.leafSizes.size() <= node.nPrimitives) quality.leafSizes.resize(node.nPrimitives + 1, 0);
+            ++quality.leafDepths[depth];
+            ++quality.leafSizes[node.nPrimitives];
+            ReportValue(LeafDepth, depth);
+            ReportValue(PrimitivesPerLeaf, node.nPrimitives);
+            continue;
+        }
+        ++nInteriors;
+        const Bounds3f &b0 = nodes[ChildIndex(index, 0)].bound;
+        const Bounds3f &b1 = nodes[ChildIndex(index, 1)].bound;
+        Float area = node.bound.SurfaceArea();
+        Float overlap = Overlaps(b0, b1) && area > 0 ? pbrt::Intersect(b0, b1).SurfaceArea() / area : 0;
+        quality.siblingOverlap += overlap;
+        ReportValue(SiblingOverlap, overlap);
+        toVisit.push_back({ChildIndex(index, 1), depth + 1});
+        toVisit.push_back({ChildIndex(index, 0), depth + 1});
+    }
+    if(nInteriors > 0) quality.siblingOverlap /= nInteriors;
+
+    // Every reference is tested with the nodes overlapping it, a leaf is a task
+    std::vector<Float> overlapCosts(leaves.size(), 0), areas(leaves.size(), 0);
+    ParallelFor(ParallelForLoopExecutor::NumThreads() > 1, [&](int64_t k){
+        const LinearBVHNode &leaf = nodes[leaves[k]];
+        int number = numbers[leaves[k]];
+        std::vector<int> stack;
+        for(int i = leaf.primitiveOffset; i < leaf.primitiveOffset + leaf.nPrimitives; ++i) {
+            const Primitive &primitive = *primitives[i];
+            Bounds3f reference = primitive.ClippedWorldBound(leaf.bound); // SBVH references may be a part of the primitive
+            areas[k] += reference.SurfaceArea() / 2;
+            stack.push_back(0);
+            while(!stack.empty()) {
+                int index = stack.back();
+                stack.pop_back();
+                const LinearBVHNode &node = nodes[index];
+                if(!Overlaps(node.bound, reference)) continue;
+                bool isAncestor = numbers[index] <= number && number < numbers[index] + sizes[index];
+                if(!isAncestor) {
+                    Float cost = node.nPrimitives > 0 ? options.intersectionCost * node.nPrimitives : options.traversalCost;
+                    overlapCosts[k] += cost * ClippedArea(primitive, reference, node.bound);
+                }
+                if(node.nPrimitives == 0) {
+                    stack.push_back(ChildIndex(index, 1));
+                    stack.push_back(ChildIndex(index, 0));
+                }
+            }
+        }
+    }, leaves.size(), 64);
+    Float overlapCost = 0, totalArea = 0;
+    for(int k = 0; k < leaves.size(); ++k) {
+        overlapCost += overlapCosts[k];
+        totalArea += areas[k];
+    }
+    quality.epo = totalArea > 0 ? overlapCost / totalArea : 0;
+    ReportValue(EndPointOverlap, quality.epo);
+    return quality;
+}
+
+/**
+ * The cell size of the grid in the axis, 2^exponent is built from the float bits directly.
+*/
+inline float GridScale(int8_t exponent) {
+    return BitsToFloat(uint32_t(exponent + 127) << 23);
+}
+
+/**
+ * Quantize the bound b on the grid of node. The decoded bound is computed exactly as traversal does,
+ * and it is moved outward until it contains b, so the rounding of float arithmetic can't lose any hit.
+*/
+static void QuantizeBound(const CompressedBVHNode &node, const Bounds3f &b, uint8_t qMin[3], uint8_t qMax[3]) {
+    for(int a = 0; a < 3; ++a) {
+        float scale = GridScale(node.exponent[a]);
+        int lo = Clamp((int)std::floor((b.pMin[a] - node.origin[a]) / scale), 0, 255);
+        int hi = Clamp((int)std::ceil((b.pMax[a] - node.origin[a]) / scale), 0, 255);
+        while(lo > 0 && node.origin[a] + lo * scale > b.pMin[a]) --lo;
+        while(hi < 255 && node.origin[a] + hi * scale < b.pMax[a]) ++hi;
+        DCHECK_LE(node.origin[a] + lo * scale, b.pMin[a]);
+        DCHECK_GE(node.origin[a] + hi * scale, b.pMax[a]);
+        qMin[a] = lo;
+        qMax[a] = hi;
+    }
+}
+
+/**
+ * Decode the bound of a child of the compressed node.
+*/
+inline Bounds3f DecodeChildBound(const CompressedBVHNode &node, int child) {
+    Bounds3f b;
+    for(int a = 0; a < 3; ++a) {
+        float scale = GridScale(node.exponent[a]);
+        b.pMin[a] = node.origin[a] + node.childMin[child][a] * scale;
+        b.pMax[a] = node.origin[a] + node.childMax[child][a] * scale;
+    }
+    return b;
+}
+
+int BVHAccel::CompressBVHTree(int index, int &offset) {
+    const LinearBVHNode &linearNode = nodes[index];
+    DCHECK_EQ(linearNode.nPrimitives, 0);
+    int myOffset = offset++;
+    CompressedBVHNode &node = compressedNodes[myOffset];
+    node.axis = linearNode.axis;
+    for(int a = 0; a < 3; ++a) {
+        node.origin[a] = RoundDownToFloat(linearNode.bound.pMin[a]);
+        int exponent;
+        std::frexp((linearNode.bound.pMax[a] - node.origin[a]) / 255, &exponent); // 2^exponent >= extent / 255
+        exponent = Clamp(exponent, -126, 127);
+        while(exponent < 127 && node.origin[a] + 255 * GridScale(exponent) < linearNode.bound.pMax[a]) ++exponent;
+        node.exponent[a] = exponent;
+    }
+    int children[2] = {ChildIndex(index, 0), ChildIndex(index, 1)};
+    for(int i = 0; i < 2; ++i) {
+        const LinearBVHNode &child = nodes[children[i]];
+        QuantizeBound(node, child.bound, node.childMin[i], node.childMax[i]);
+        node.nPrimitives[i] = child.nPrimitives;
+        node.childOffset[i] = child.nPrimitives > 0 ? child.primitiveOffset : CompressBVHTree(children[i], offset);
+    }
+    return myOffset;
+}
+
+template <BVHQuery Query>
+bool BVHAccel::TraverseCompressed(const Ray &ray, SurfaceInteraction *isect, BVHAllHits *hits) const {
+    const BVHTreeView tree = TreeView();
     Vector3f invD(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
     int dirIsNeg[3] = {invD.x < 0, invD.y < 0, invD.z < 0};
+    if(!rootBound.IntersectP(ray, invD, dirIsNeg)) return false;
+    BVHStackItem stack[STACK_SIZE]; // a tree at least STACK_SIZE deep isn't compressed
+    int stackTopIndex = 0;
+    BVHStackItem current = {0, 0}; // start from the root node
+    bool isHit = false;
+    TriangleHit closest; // Only for BVHQuery::ClosestHit
     while(true) {
-        LinearBVHNode *node = nodes + currentNodeIndex;
-        if(node->bound.IntersectP(ray, invD, dirIsNeg)) {
-            if(node->nPrimitives > 0) { // meet leaf node, traversal all primitives find the last hit point
-                for(int i = 0; i < node->nPrimitives; ++i) {
-                    if(primitives[node->primitiveOffset + i]->IntersectP(ray)) {
-                        return true;
-                    }
+        if(current.nPrimitives > 0) {
+            if(QueryLeaf<Query>(tree, current.offset, current.nPrimitives, ray, isect, closest, hits)) {
+                if constexpr(Query == BVHQuery::AnyHit) return true;
+                isHit = true;
+            }
+        } else {
+            const CompressedBVHNode &node = compressedNodes[current.offset];
+            int first = dirIsNeg[node.axis]; // same order with Intersect, the second child is visited first if the direction is negative
+            bool hitFirst = DecodeChildBound(node, first).IntersectP(ray, invD, dirIsNeg);
+            bool hitSecond = DecodeChildBound(node, 1 - first).IntersectP(ray, invD, dirIsNeg);
+            BVHStackItem firstItem = {node.childOffset[first], node.nPrimitives[first]};
+            BVHStackItem secondItem = {node.childOffset[1 - first], node.nPrimitives[1 - first]};
+            if(hitFirst) {
+                if(hitSecond) stack[stackTopIndex++] = secondItem;
+                current = firstItem;
+                continue;
+            }
+            if(hitSecond) {
+                current = secondItem;
+                continue;
+            }
+        }
+        if(stackTopIndex == 0) break;
+        current = stack[--stackTopIndex];
+    }
+    if constexpr(Query == BVHQuery::ClosestHit) FinishTriangleHit(tree, ray, closest, *isect);
+    return isHit;
+}
+
+void BVHAccel::LinkParents() {
+    ParentLinkBytes -= parents.size() * sizeof(int);
+    parents.clear();
+    std::vector<int> links(totalNodes, -1);
+    std::vector<std::pair<int, int>> toVisit = {{0, 0}}; // the node and its depth
+    treeDepth = 0;
+    while(!toVisit.empty()) {
+        int index = toVisit.back().first;
+        int depth = toVisit.back().second;
+        toVisit.pop_back();
+        treeDepth = std::max(treeDepth, depth);
+        if(nodes[index].nPrimitives > 0) continue;
+        for(int child = 0; child < 2; ++child) {
+            links[ChildIndex(index, child)] = index;
+            toVisit.push_back({ChildIndex(index, child), depth + 1});
+        }
+    }
+    if(!options.shortStackTraversal) return;
+    parents.swap(links);
+    ParentLinkBytes += parents.size() * sizeof(int);
+}
+
+int BVHAccel::NextByParentLinks(int index, const int dirIsNeg[3]) const {
+    ++ParentLinkBacktracks;
+    while(index != 0) {
+        int parent = parents[index];
+        int near = dirIsNeg[nodes[parent].axis];
+        if(index == ChildIndex(parent, near)) return ChildIndex(parent, 1 - near);
+        index = parent;
+    }
+    return -1;
+}
+
+bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction &isect) const {
+    if(compressedNodes == nullptr && nodes == nullptr) return false;
+    ++HitTimes;
+    if(compressedNodes != nullptr) return TraverseCompressed<BVHQuery::ClosestHit>(ray, &isect, nullptr);
+    if(!parents.empty()) return TraverseOctant<BVHQuery::ClosestHit, BVHTraversalOrder::ShortStack>(TreeView(), ray, &isect, nullptr);
+    if(options.distanceOrderedTraversal) return TraverseOctant<BVHQuery::ClosestHit, BVHTraversalOrder::DistanceOrdered>(TreeView(), ray, &isect, nullptr);
+    return TraverseOctant<BVHQuery::ClosestHit>(TreeView(), ray, &isect, nullptr);
+}
+
+/**
+ * A far child waiting on the stack of the distance ordered traversal, with the distance at which the ray enters its bound.
+*/
+struct OrderedStackItem {
+    int node;
+    Float tEntry;
+};
+
+bool BVHAccel::IntersectP(const Ray &ray) const {
+    if(compressedNodes != nullptr) return TraverseCompressed<BVHQuery::AnyHit>(ray, nullptr, nullptr);
+    if(nodes == nullptr) return false;
+    if(!parents.empty()) return TraverseOctant<BVHQuery::AnyHit, BVHTraversalOrder::ShortStack>(TreeView(), ray, nullptr, nullptr);
+    return TraverseOctant<BVHQuery::AnyHit>(TreeView(), ray, nullptr, nullptr);
+}
+
+int BVHAccel::IntersectAll(const Ray &ray, std::vector<SurfaceInteraction> &isects) const {
+    int nHits = isects.size();
+    BVHAllHits hits(isects);
+    if(compressedNodes != nullptr) TraverseCompressed<BVHQuery::AllHits>(ray, nullptr, &hits);
+    else if(!parents.empty()) TraverseOctant<BVHQuery::AllHits, BVHTraversalOrder::ShortStack>(TreeView(), ray, nullptr, &hits);
+    else if(nodes != nullptr) TraverseOctant<BVHQuery::AllHits>(TreeView(), ray, nullptr, &hits);
+    return isects.size() - nHits;
+}
+
+/**
+ * Bounds3::IntersectP with the octant of the ray direction known at compile time, so the planes are selected without reading dirIsNeg.
+*/
+template <int Octant>
+inline bool IntersectBound(const Bounds3f &bounds, const Ray &ray, const Vector3f &invDir, Float &tEntry) {
+    static PBRT_CONSTEXPR int dirIsNeg[3] = {Octant & 1, (Octant >> 1) & 1, (Octant >> 2) & 1};
+    return bounds.IntersectP(ray, invDir, dirIsNeg, tEntry);
+}
+
+template <BVHQuery Query, BVHTraversalOrder Order, int Octant>
+bool BVHAccel::Traverse(const BVHTreeView &tree, const Ray &ray, const Vector3f &invD, SurfaceInteraction *isect, BVHAllHits *hits) const {
+    PBRT_CONSTEXPR bool ordered = Order == BVHTraversalOrder::DistanceOrdered;
+    PBRT_CONSTEXPR bool shortStack = Order == BVHTraversalOrder::ShortStack;
+    static PBRT_CONSTEXPR int dirIsNeg[3] = {Octant & 1, (Octant >> 1) & 1, (Octant >> 2) & 1}; // Only for NextByParentLinks
+    using StackItem = typename std::conditional<ordered, OrderedStackItem, int>::type;
+    // because we need to traversal a linear tree, so we need a assistant stack
+    int currentNodeIndex = 0; // Index of current access node in nodes
+    StackItem localStack[shortStack ? SHORT_STACK_SIZE : STACK_SIZE]; // use a array to represent stack
+    std::vector<StackItem> heapStack;
+    StackItem *stack = localStack;
+    if(!shortStack && tree.depth >= STACK_SIZE) { // the far child of every level may be pushed
+        heapStack.resize(tree.depth + 1);
+        stack = heapStack.data();
+    }
+    // Index of top element in stack. Actually (stackTopIndex - 1) represent top element in the stack.
+    // The short stack is a ring buffer, stackTopIndex counts pushes minus pops and only the last stackSize entries are valid
+    int stackTopIndex = 0;
+    int stackSize = 0, nDropped = 0; // Only for the short stack, the dropped far children are found by parent links after the stack is empty
+    Float tEntry[2]; // The entry distances of the current node or its two children
+    if constexpr(ordered) { // the bounds are tested by their parent, so the current node is always hit
+        ++OrderedBoundTests;
+        if(!IntersectBound<Octant>(tree.nodes[0].bound, ray, invD, tEntry[0])) return false;
+    }
+    bool isHit = false;
+    TriangleHit closest; // Only for BVHQuery::ClosestHit
+    while(true) {
+        const LinearBVHNode *node = tree.nodes + currentNodeIndex;
+        if(ordered || IntersectBound<Octant>(node->bound, ray, invD, tEntry[0])) {
+            if(node->nPrimitives > 0) { // meet leaf node, traversal all primitives
+                if(QueryLeaf<Query>(tree, node->primitiveOffset, node->nPrimitives, ray, isect, closest, hits)) {
+                    if constexpr(Query == BVHQuery::AnyHit) return true;
+                    isHit = true;
+                }
+            } else if constexpr(ordered) { // visit the child the ray enters first, the other one is pushed with its entry distance
+                int children[2] = {tree.ChildIndex(currentNodeIndex, 0), tree.ChildIndex(currentNodeIndex, 1)};
+                bool hit0 = IntersectBound<Octant>(tree.nodes[children[0]].bound, ray, invD, tEntry[0]);
+                bool hit1 = IntersectBound<Octant>(tree.nodes[children[1]].bound, ray, invD, tEntry[1]);
+                OrderedBoundTests += 2;
+                if(hit0 && hit1) {
+                    int near = tEntry[1] < tEntry[0];
+                    stack[stackTopIndex++] = {children[1 - near], tEntry[1 - near]};
+                    currentNodeIndex = children[near];
+                    continue;
+                }
+                if(hit0 || hit1) {
+                    currentNodeIndex = children[hit0 ? 0 : 1];
+                    continue;
                 }
-                // if there are other subtree, go on traversal, otherwise break loop
-                if(stackTopIndex == 0) break;
-                else currentNodeIndex = stack[--stackTopIndex];
-            } else { // meet Iterior node, traverl one of its two childrens, and another push the stack
-                if(dirIsNeg[node->axis]) { // if the direction in splited axis is negative, we intersect with the right subtree first, otherwise with left subtree
-                    currentNodeIndex = node->secondChildOffset;
-                    stack[stackTopIndex++] = currentNodeIndex + 1; // record left subtree index
+            } else { // if the direction in splited axis is negative, we intersect with the second subtree first, otherwise with the first subtree
+                int secondFirst = (Octant >> node->axis) & 1;
+                if constexpr(shortStack) {
+                    stack[stackTopIndex++ & (SHORT_STACK_SIZE - 1)] = tree.ChildIndex(currentNodeIndex, 1 - secondFirst);
+                    if(stackSize < SHORT_STACK_SIZE) ++stackSize;
+                    else ++nDropped;
                 } else {
-                    currentNodeIndex = currentNodeIndex + 1;
-                    stack[stackTopIndex++] = node->secondChildOffset; 
+                    stack[stackTopIndex++] = tree.ChildIndex(currentNodeIndex, 1 - secondFirst);
                 }
+                currentNodeIndex = tree.ChildIndex(currentNodeIndex, secondFirst);
+                continue;
             }
+        }
+        if constexpr(ordered) {
+            // A bound the ray enters beyond the closest hit would fail the bound test with the current tMax, skip it without testing again
+            while(stackTopIndex > 0 && stack[stackTopIndex - 1].tEntry >= ray.tMax) {
+                --stackTopIndex;
+                ++OrderedCulledEntries;
+            }
+        }
+        // if there are other subtree, go on traversal, otherwise break loop
+        if constexpr(shortStack) {
+            if(stackSize > 0) {
+                --stackSize;
+                currentNodeIndex = stack[--stackTopIndex & (SHORT_STACK_SIZE - 1)];
+                continue;
+            }
+            if(nDropped == 0) break;
+            --nDropped; // the next node by parent links is the latest dropped one
+            currentNodeIndex = NextByParentLinks(currentNodeIndex, dirIsNeg);
+            if(currentNodeIndex < 0) break;
         } else {
-            // if there are other subtree, go on traversal, otherwise break loop
             if(stackTopIndex == 0) break;
+            if constexpr(ordered) currentNodeIndex = stack[--stackTopIndex].node;
             else currentNodeIndex = stack[--stackTopIndex];
         }
     }
-    return false;
+    if constexpr(Query == BVHQuery::ClosestHit) FinishTriangleHit(tree, ray, closest, *isect);
+    return isHit;
+}
+
+template <BVHQuery Query, BVHTraversalOrder Order>
+bool BVHAccel::TraverseOctant(const BVHTreeView &tree, const Ray &ray, SurfaceInteraction *isect, BVHAllHits *hits) const {
+    Vector3f invD(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    switch((invD.x < 0) | ((invD.y < 0) << 1) | ((invD.z < 0) << 2)) {
+        case 0: return Traverse<Query, Order, 0>(tree, ray, invD, isect, hits);
+        case 1: return Traverse<Query, Order, 1>(tree, ray, invD, isect, hits);
+        case 2: return Traverse<Query, Order, 2>(tree, ray, invD, isect, hits);
+        case 3: return Traverse<Query, Order, 3>(tree, ray, invD, isect, hits);
+        case 4: return Traverse<Query, Order, 4>(tree, ray, invD, isect, hits);
+        case 5: return Traverse<Query, Order, 5>(tree, ray, invD, isect, hits);
+        case 6: return Traverse<Query, Order, 6>(tree, ray, invD, isect, hits);
+        default: return Traverse<Query, Order, 7>(tree, ray, invD, isect, hits);
+    }
+}
+
+/**
+ * The rays of a packet as SoA arrays, so the same component of four rays is loaded by one SSE instruction.
+ * tMax follows the tMax of the rays when they hit, inactive lanes get a ray which never hits.
+*/
+template <int N>
+struct alignas(64) PacketRays {
+    explicit PacketRays(const RayPacket<N> &packet) {
+        for(int i = 0; i < N; ++i) {
+            const Ray &ray = packet.rays[i < packet.size ? i : 0];
+            for(int a = 0; a < 3; ++a) {
+                o[a][i] = ray.o[a];
+                d[a][i] = ray.d[a];
+                invD[a][i] = 1 / ray.d[a];
+            }
+            tMax[i] = i < packet.size ? ray.tMax : -Infinity;
+        }
+    }
+    Float o[3][N], d[3][N], invD[3][N], tMax[N];
+};
+
+// 1 + 2 * gamma(3), the exit distance is enlarged like Bounds3::IntersectP does
+static const Float PacketExitScale = 1 + 2 * gamma(3);
+
+// Four lanes a time with SSE, the packet sizes are all multiples of 4. _mm_max_ps and _mm_min_ps return the second operand
+// if any operand is NaN, so the accumulator is always the second one.
+#if (defined(__SSE__) || defined(_M_X64)) && !defined(PBRT_FLOAT_AS_DOUBLE)
+#define PBRT_PACKET_SSE
+template <int N>
+inline uint32_t IntersectPacketBoundSSE(const Bounds3f &bound, const PacketRays<N> &rays, uint32_t active) {
+    const __m128 scale = _mm_set1_ps(PacketExitScale);
+    uint32_t mask = 0;
+    for(int i = 0; i < N; i += 4) {
+        if(((active >> i) & 0xF) == 0) continue;
+        __m128 tEntry = _mm_setzero_ps();
+        __m128 tExit = _mm_load_ps(rays.tMax + i);
+        for(int a = 0; a < 3; ++a) {
+            __m128 o = _mm_load_ps(rays.o[a] + i);
+            __m128 inv = _mm_load_ps(rays.invD[a] + i);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bound.pMin[a]), o), inv);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bound.pMax[a]), o), inv);
+            tEntry = _mm_max_ps(_mm_min_ps(t0, t1), tEntry);
+            tExit = _mm_min_ps(_mm_mul_ps(_mm_max_ps(t0, t1), scale), tExit);
+        }
+        mask |= _mm_movemask_ps(_mm_cmple_ps(tEntry, tExit)) << i;
+    }
+    return mask & active;
+}
+
+/**
+ * (a0 * b0) - (a1 * b1) in double precision rounded to float, the component of Cross.
+*/
+inline __m128 CrossComponent(__m128 a0, __m128 b0, __m128 a1, __m128 b1) {
+    __m128d lo = _mm_sub_pd(_mm_mul_pd(_mm_cvtps_pd(a0), _mm_cvtps_pd(b0)), _mm_mul_pd(_mm_cvtps_pd(a1), _mm_cvtps_pd(b1)));
+    a0 = _mm_movehl_ps(a0, a0);
+    b0 = _mm_movehl_ps(b0, b0);
+    a1 = _mm_movehl_ps(a1, a1);
+    b1 = _mm_movehl_ps(b1, b1);
+    __m128d hi = _mm_sub_pd(_mm_mul_pd(_mm_cvtps_pd(a0), _mm_cvtps_pd(b0)), _mm_mul_pd(_mm_cvtps_pd(a1), _mm_cvtps_pd(b1)));
+    return _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi));
+}
+
+inline __m128 DotSSE(__m128 x0, __m128 y0, __m128 z0, __m128 x1, __m128 y1, __m128 z1) {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(x0, x1), _mm_mul_ps(y0, y1)), _mm_mul_ps(z0, z1));
+}
+
+/**
+ * The Moller-Trumbore test of IntersectTriangle for four rays a time. The operations are in the same order and precision,
+ * the cross products are computed in double like Cross, so every ray gets exactly the same result as the scalar test.
+*/
+template <int N>
+inline uint32_t IntersectPacketTriangleSSE(const PackedTriangle &triangle, const PacketRays<N> &rays, uint32_t active, Float *tHit) {
+    const Vector3f e1 = triangle.p[1] - triangle.p[0];
+    const Vector3f e2 = triangle.p[2] - triangle.p[0];
+    const __m128 e1x = _mm_set1_ps(e1.x), e1y = _mm_set1_ps(e1.y), e1z = _mm_set1_ps(e1.z);
+    const __m128 e2x = _mm_set1_ps(e2.x), e2y = _mm_set1_ps(e2.y), e2z = _mm_set1_ps(e2.z);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+    uint32_t mask = 0;
+    for(int i = 0; i < N; i += 4) {
+        if(((active >> i) & 0xF) == 0) continue;
+        __m128 dx = _mm_load_ps(rays.d[0] + i), dy = _mm_load_ps(rays.d[1] + i), dz = _mm_load_ps(rays.d[2] + i);
+        __m128 sx = _mm_sub_ps(_mm_load_ps(rays.o[0] + i), _mm_set1_ps(triangle.p[0].x));
+        __m128 sy = _mm_sub_ps(_mm_load_ps(rays.o[1] + i), _mm_set1_ps(triangle.p[0].y));
+        __m128 sz = _mm_sub_ps(_mm_load_ps(rays.o[2] + i), _mm_set1_ps(triangle.p[0].z));
+        // S1 = Cross(d, e2), S2 = Cross(S, e1)
+        __m128 s1x = CrossComponent(dy, e2z, dz, e2y), s1y = CrossComponent(dz, e2x, dx, e2z), s1z = CrossComponent(dx, e2y, dy, e2x);
+        __m128 s2x = CrossComponent(sy, e1z, sz, e1y), s2y = CrossComponent(sz, e1x, sx, e1z), s2z = CrossComponent(sx, e1y, sy, e1x);
+        __m128 invDet = _mm_div_ps(one, DotSSE(s1x, s1y, s1z, e1x, e1y, e1z));
+        __m128 t = _mm_mul_ps(DotSSE(s2x, s2y, s2z, e2x, e2y, e2z), invDet);
+        __m128 b1 = _mm_mul_ps(DotSSE(s1x, s1y, s1z, sx, sy, sz), invDet);
+        __m128 b2 = _mm_mul_ps(DotSSE(s2x, s2y, s2z, dx, dy, dz), invDet);
+        __m128 hit = _mm_and_ps(_mm_cmplt_ps(t, _mm_load_ps(rays.tMax + i)), _mm_cmpgt_ps(t, zero));
+        hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(b1, zero), _mm_cmpgt_ps(b2, zero)));
+        hit = _mm_and_ps(hit, _mm_cmpgt_ps(_mm_sub_ps(_mm_sub_ps(one, b1), b2), zero));
+        _mm_store_ps(tHit + i, t);
+        mask |= _mm_movemask_ps(hit) << i;
+    }
+    return mask & active;
+}
+#endif
+
+/**
+ * The slab test of the bound with the rays in the active mask. It never misses a ray Bounds3::IntersectP hits,
+ * the max and min are written as (t > acc ? t : acc), so a NaN from 0 * infinity is ignored like in the scalar test.
+ * @return The mask of the active rays hitting the bound.
+*/
+template <int N>
+inline uint32_t IntersectPacketBound(const Bounds3f &bound, const PacketRays<N> &rays, uint32_t active) {
+#if defined(PBRT_PACKET_SSE)
+    return IntersectPacketBoundSSE<N>(bound, rays, active);
+#else
+    uint32_t mask = 0;
+    for(int i = 0; i < N; ++i) {
+        Float tEntry = 0, tExit = rays.tMax[i];
+        for(int a = 0; a < 3; ++a) {
+            Float t0 = (bound.pMin[a] - rays.o[a][i]) * rays.invD[a][i];
+            Float t1 = (bound.pMax[a] - rays.o[a][i]) * rays.invD[a][i];
+            Float tNear = t0 < t1 ? t0 : t1, tFar = (t0 < t1 ? t1 : t0) * PacketExitScale;
+            tEntry = tNear > tEntry ? tNear : tEntry;
+            tExit = tFar < tExit ? tFar : tExit;
+        }
+        if(tEntry <= tExit) mask |= 1u << i;
+    }
+    return mask & active;
+#endif
+}
+
+/**
+ * Test the packed triangle with the rays in the active mask, the result of each ray is same with IntersectTriangle.
+ * @param tHit Output the distance of each ray, it is valid only for the hit rays and must be aligned for SSE.
+ * @return The mask of the active rays hitting the triangle before their tMax.
+*/
+template <int N>
+inline uint32_t IntersectPacketTriangle(const PackedTriangle &triangle, const PacketRays<N> &rays, uint32_t active, Float *tHit) {
+#if defined(PBRT_PACKET_SSE)
+    return IntersectPacketTriangleSSE<N>(triangle, rays, active, tHit);
+#else
+    uint32_t mask = 0;
+    for(int i = 0; i < N; ++i) {
+        if((active & (1u << i)) == 0) continue;
+        Ray ray(Point3f(rays.o[0][i], rays.o[1][i], rays.o[2][i]), Vector3f(rays.d[0][i], rays.d[1][i], rays.d[2][i]), rays.tMax[i]);
+        if(IntersectTriangle(ray, triangle.p[0], triangle.p[1], triangle.p[2], tHit[i])) 
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+/**
+ * A node waiting on the packet traversal stack with the rays which hit its parent.
+*/
+struct PacketStackItem {
+    int node;
+    uint32_t mask;
+};
+
+template <int N>
+bool BVHAccel::IntersectPacket(const RayPacket<N> &packet, HitPacket<N> &hits) const {
+    DCHECK(packet.size > 0 && packet.size <= N);
+    hits.mask = 0;
+    if(compressedNodes != nullptr || nodes == nullptr || treeDepth >= STACK_SIZE) {
+        for(int i = 0; i < packet.size; ++i) 
+            if(Intersect(packet.rays[i], hits.isects[i])) hits.mask |= 1u << i;
+        return hits.mask != 0;
+    }
+    ++RayPackets;
+    PacketRays<N> rays(packet);
+    uint32_t negative[3] = {0, 0, 0}; // The rays whose direction is negative in each axis
+    for(int a = 0; a < 3; ++a) 
+        for(int i = 0; i < packet.size; ++i) 
+            if(rays.invD[a][i] < 0) negative[a] |= 1u << i;
+    TriangleHit closest[N]; // Like Intersect, the interactions of packed triangles are built after the traversal
+    alignas(16) Float tHit[N];
+    PacketStackItem stack[STACK_SIZE];
+    int stackTopIndex = 0;
+    PacketStackItem current = {0, (1u << packet.size) - 1};
+    while(true) {
+        const LinearBVHNode *node = nodes + current.node;
+        uint32_t mask = IntersectPacketBound<N>(node->bound, rays, current.mask);
+        if(mask != 0 && node->nPrimitives == LAZY_SUBTREE) { // the lazy subtree is built and traced by each ray
+            for(int lane = 0; lane < N; ++lane) {
+                if((mask & (1u << lane)) && IntersectLazySubtree(node->primitiveOffset, packet.rays[lane], hits.isects[lane])) {
+                    hits.mask |= 1u << lane;
+                    rays.tMax[lane] = packet.rays[lane].tMax;
+                    closest[lane].primitive = -1;
+                }
+            }
+        } else if(mask != 0 && node->nPrimitives > 0) {
+            for(int i = node->primitiveOffset; i < node->primitiveOffset + node->nPrimitives; ++i) {
+                if(packedTriangles != nullptr && !std::isnan(packedTriangles[i].p[0].x)) {
+                    uint32_t hit = IntersectPacketTriangle<N>(packedTriangles[i], rays, mask, tHit);
+                    for(int lane = 0; hit != 0; ++lane, hit >>= 1) {
+                        if((hit & 1) == 0) continue;
+                        packet.rays[lane].tMax = rays.tMax[lane] = tHit[lane];
+                        closest[lane].primitive = i;
+                    }
+                    continue;
+                }
+                for(int lane = 0; lane < N; ++lane) {
+                    if((mask & (1u << lane)) && primitives[i]->Intersect(packet.rays[lane], hits.isects[lane])) {
+                        hits.mask |= 1u << lane;
+                        rays.tMax[lane] = packet.rays[lane].tMax;
+                        closest[lane].primitive = -1;
+                    }
+                }
+            }
+        } else if(mask != 0) { // visit the near child of the first active ray first, the rays of a coherent packet agree on it
+            int first = ChildIndex(current.node, 0);
+            int second = ChildIndex(current.node, 1);
+            bool secondIsNear = (mask & (~mask + 1)) & negative[node->axis];
+            stack[stackTopIndex++] = {secondIsNear ? first : second, mask};
+            current = {secondIsNear ? second : first, mask};
+            continue;
+        }
+        if(stackTopIndex == 0) break;
+        current = stack[--stackTopIndex];
+    }
+    for(int lane = 0; lane < packet.size; ++lane) {
+        if(closest[lane].primitive < 0) continue;
+        FinishTriangleHit(TreeView(), packet.rays[lane], closest[lane], hits.isects[lane]);
+        hits.mask |= 1u << lane;
+    }
+    HitTimes += packet.size;
+    return hits.mask != 0;
 }
 
+template <int N>
+uint32_t BVHAccel::IntersectPPacket(const RayPacket<N> &packet) const {
+    DCHECK(packet.size > 0 && packet.size <= N);
+    uint32_t occluded = 0;
+    if(compressedNodes != nullptr || nodes == nullptr || treeDepth >= STACK_SIZE) {
+        for(int i = 0; i < packet.size; ++i) 
+            if(IntersectP(packet.rays[i])) occluded |= 1u << i;
+        return occluded;
+    }
+    ++RayPackets;
+    PacketRays<N> rays(packet);
+    uint32_t all = (1u << packet.size) - 1;
+    alignas(16) Float tHit[N]; // Not used, any hit is enough
+    PacketStackItem stack[STACK_SIZE];
+    int stackTopIndex = 0;
+    PacketStackItem current = {0, all};
+    while(true) {
+        const LinearBVHNode *node = nodes + current.node;
+        uint32_t mask = IntersectPacketBound<N>(node->bound, rays, current.mask & ~occluded); // any hit is enough, occluded rays are done
+        if(mask != 0 && node->nPrimitives == LAZY_SUBTREE) { // the lazy subtree is built and traced by each ray
+            for(int lane = 0; lane < N; ++lane) 
+                if((mask & (1u << lane)) && IntersectPLazySubtree(node->primitiveOffset, packet.rays[lane])) occluded |= 1u << lane;
+            if(occluded == all) break;
+        } else if(mask != 0 && node->nPrimitives > 0) {
+            for(int i = node->primitiveOffset; i < node->primitiveOffset + node->nPrimitives && mask != 0; ++i) {
+                uint32_t hit = 0;
+                if(packedTriangles != nullptr && !std::isnan(packedTriangles[i].p[0].x)) {
+                    hit = IntersectPacketTriangle<N>(packedTriangles[i], rays, mask, tHit);
+                } else {
+                    for(int lane = 0; lane < N; ++lane) 
+                        if((mask & (1u << lane)) && primitives[i]->IntersectP(packet.rays[lane])) hit |= 1u << lane;
+                }
+                occluded |= hit;
+                mask &= ~hit;
+            }
+            if(occluded == all) break;
+        } else if(mask != 0) {
+            stack[stackTopIndex++] = {ChildIndex(current.node, 1), mask};
+            current = {ChildIndex(current.node, 0), mask};
+            continue;
+        }
+        if(stackTopIndex == 0) break;
+        current = stack[--stackTopIndex];
+    }
+    return occluded;
+}
+
+/**
+ * Sort the rays by the octant of their direction(the top 3 bits) and the 27-bit Morton code of their origin in the bound of all origins,
+ * so the rays starting near each other in the same direction octant are next to each other. primitiveIndex is the index of the ray.
+*/
+static void SortRays(const std::vector<Ray> &rays, bool parallel, int chunkSize, std::vector<MortonPrimitive> &sorted) {
+    Bounds3f originBounds;
+    for(const Ray &ray: rays) 
+        originBounds = Union(originBounds, ray.o);
+    sorted.resize(rays.size());
+    ParallelFor(parallel, [&](int64_t i){
+        const Ray &ray = rays[i];
+        uint32_t octant = (ray.d.x < 0) | ((ray.d.y < 0) << 1) | ((ray.d.z < 0) << 2);
+        sorted[i].primitiveIndex = i;
+        sorted[i].mortonCode = (octant << 27) | (EncodeMorton3(originBounds.Offset(ray.o) * 1024) >> 3);
+    }, rays.size(), 512);
+    RadixSort(sorted, parallel, chunkSize);
+}
+
+int BVHAccel::IntersectStream(const std::vector<Ray> &rays, std::vector<SurfaceInteraction> &isects, std::vector<uint8_t> &hits) const {
+    int nRays = rays.size();
+    isects.resize(nRays);
+    hits.assign(nRays, 0);
+    StreamRays += nRays;
+    bool parallel = ParallelForLoopExecutor::NumThreads() > 1 && nRays >= STREAM_PARALLEL_THRESHOLD;
+    std::vector<MortonPrimitive> sorted;
+    SortRays(rays, parallel, PARALLEL_CHUNK_SIZE, sorted);
+    int nPackets = (nRays + STREAM_PACKET_SIZE - 1) / STREAM_PACKET_SIZE;
+    ParallelFor(parallel, [&](int64_t p){
+        int begin = p * STREAM_PACKET_SIZE;
+        RayPacket<STREAM_PACKET_SIZE> packet;
+        packet.size = std::min(STREAM_PACKET_SIZE, nRays - begin);
+        for(int i = 0; i < packet.size; ++i) 
+            packet.rays[i] = rays[sorted[begin + i].primitiveIndex];
+        HitPacket<STREAM_PACKET_SIZE> packetHits;
+        IntersectPacket(packet, packetHits);
+        for(int i = 0; i < packet.size; ++i) { // scatter the results back to the original order
+            if((packetHits.mask & (1u << i)) == 0) continue;
+            int index = sorted[begin + i].primitiveIndex;
+            rays[index].tMax = packet.rays[i].tMax;
+            isects[index] = packetHits.isects[i];
+            hits[index] = 1;
+        }
+    }, nPackets, 64);
+    return std::count(hits.begin(), hits.end(), 1);
+}
+
+int BVHAccel::IntersectPStream(const std::vector<Ray> &rays, std::vector<uint8_t> &occluded) const {
+    int nRays = rays.size();
+    occluded.assign(nRays, 0);
+    StreamRays += nRays;
+    bool parallel = ParallelForLoopExecutor::NumThreads() > 1 && nRays >= STREAM_PARALLEL_THRESHOLD;
+    std::vector<MortonPrimitive> sorted;
+    SortRays(rays, parallel, PARALLEL_CHUNK_SIZE, sorted);
+    int nPackets = (nRays + STREAM_PACKET_SIZE - 1) / STREAM_PACKET_SIZE;
+    ParallelFor(parallel, [&](int64_t p){
+        int begin = p * STREAM_PACKET_SIZE;
+        RayPacket<STREAM_PACKET_SIZE> packet;
+        packet.size = std::min(STREAM_PACKET_SIZE, nRays - begin);
+        for(int i = 0; i < packet.size; ++i) 
+            packet.rays[i] = rays[sorted[begin + i].primitiveIndex];
+        uint32_t mask = IntersectPPacket(packet);
+        for(int i = 0; i < packet.size; ++i) 
+            if(mask & (1u << i)) occluded[sorted[begin + i].primitiveIndex] = 1;
+    }, nPackets, 64);
+    return std::count(occluded.begin(), occluded.end(), 1);
+}
+
+template bool BVHAccel::IntersectPacket<4>(const RayPacket<4> &packet, HitPacket<4> &hits) const;
+template bool BVHAccel::IntersectPacket<8>(const RayPacket<8> &packet, HitPacket<8> &hits) const;
+template bool BVHAccel::IntersectPacket<16>(const RayPacket<16> &packet, HitPacket<16> &hits) const;
+template uint32_t BVHAccel::IntersectPPacket<4>(const RayPacket<4> &packet) const;
+template uint32_t BVHAccel::IntersectPPacket<8>(const RayPacket<8> &packet) const;
+template uint32_t BVHAccel::IntersectPPacket<16>(const RayPacket<16> &packet) const;
+
 Bounds3f BVHAccel::WorldBound() const {
+    if(compressedNodes != nullptr) return rootBound;
     return nodes == nullptr ? Bounds3f() : nodes->bound;
 }
 
@@ -9,13 +9,142 @@
 #include "pbrt.h"
 #include "primitive.h"
 #include "geometry.h"
+#include "memory.h"
+
+#include <unordered_map>
 
 namespace pbrt {
 
-struct LinearBVHNode;
 struct BVHBuildNode;
 struct BVHPrimitiveInfo;
+struct BVHBuildTask;
+struct MortonPrimitive;
+struct CompressedBVHNode;
+struct RefitSubtree;
+struct PackedTriangle;
+struct TriangleHit;
+struct LazySubtree;
+struct BVHTreeView;
+struct BVHAllHits;
+struct SweepSAHState;
+template <int N> class WideBVHAccel;
+
+/**
+ * A linear BVH node, use it, we can avoid recursive traversal BVH tree, it will prompt performance
+*/
+struct LinearBVHNode {
+    Bounds3f bound; // The bound of the node
+    union
+    {
+        int primitiveOffset; // Only for leaf node, it represents the staring index in the `primitives`
+        int secondChildOffset; // Only for interior node, it represents the second node index in the `primitives`. becase we will use DFS(deep first search) travelsal for the BVH tree, the first child will be recorded with current interior node index + 1, it is knew for us. So we only need to record the second child index in interior node
+    };
+    uint16_t nPrimitives; // Only for leaf node, it represents how many primitives in the leaf node. If we have primitiveOffset and nPrimitives, we can travelsal all primitives in the node. What's more we use this to distinguish if the node is leaf or interior. If this nPrimitives equal zero, we will see it as leaf node, otherwise interior node.
+    uint8_t axis; // Only for interior, it represents which axies the node had been splited.
+    uint8_t pad[1]; // make sure 32 bytes for whole struct, it will more effective for CPU
+};
+
+/**
+ * The order in which the linear nodes are stored. DepthFirst puts the first child right after its parent, the other layouts
+ * keep the two children of a node next to each other(a sibling pair) and decide where the pairs go:
+ * VanEmdeBoas splits the tree at half height recursively, so any subtree of height h is stored in a contiguous range whatever the cache size is.
+ * CacheLineTreelets and PageTreelets cluster the pairs into treelets filling a few cache lines or one page, the treelets are grown
+ * from their root by the surface area of nodes. HotFirst puts the nodes visited most at the front, visits are estimated by
+ * the surface area after building, or counted from sample rays by BVHAccel::Relayout.
+*/
+enum class BVHLayout {
+    DepthFirst, VanEmdeBoas, CacheLineTreelets, PageTreelets, HotFirst
+};
+
+/**
+ * Some options to build the BVHAccel, the default values are good for most scenes.
+*/
+struct BVHBuildOptions {
+    Float sbvhSplitBudget = 0.3; // SBVH: the maximum amount of references created by spatial splits, as a ratio of the amount of primitives
+    Float sbvhOverlapThreshold = 1e-5; // SBVH: only try spatial splits when the overlap area of object split children divided by the root area is greater than it
+    int plocRadius = 16; // PLOC: how many clusters on each side in the Morton order are searched for the nearest neighbour
+    Float preSplitBudget = 0; // Pre-split: the maximum amount of references added by splitting large references before building, as a ratio of the amount of primitives, 0 disables it. Only used by SAH, Middle, EqualCounts and SweepSAH
+    Float preSplitThreshold = 1e-4; // Pre-split: only references whose bound surface area divided by the root area is greater than it are split
+    bool compressNodes = false; // Store the flattened tree with CompressedBVHNode, it saves about 40% memory of nodes but decoding bounds costs some traversal time
+    Float refitRebuildThreshold = 1.5; // Refit: rebuild a subtree when its SAH cost grows beyond this ratio of the cost after building, 0 disables rebuilding
+    std::string cacheDirectory; // If it is not empty, the built tree is saved into this directory and loaded next time with the same primitives and options. Compressed nodes are not cached
+    int treeletPasses = 0; // How many times the treelets are restructured after building to reduce the SAH cost, 0 disables it. It works with every split method
+    BVHLayout layout = BVHLayout::DepthFirst; // The order of the linear nodes, it doesn't change the tree, only where each node is stored. It is ignored by compressed nodes
+    int sahBuckets = 12; // The amount of buckets to evaluate SAH splits, it is clamped to [2, MAX_SAH_BUCKETS]
+    int sahThreshold = 2; // Nodes with no more primitives than it are split into same counts instead of evaluating SAH
+    Float traversalCost = 1; // The cost of testing a ray with the bound of a node, only the ratio to intersectionCost matters
+    Float intersectionCost = 1; // The cost of testing a ray with a primitive
+    /**
+     * Only build the upper levels eagerly, each subtree with at most lazySubtreeSize primitives is built the first time a ray reaches it.
+     * Only used by SAH, Middle and EqualCounts, other methods build eagerly with a warning. The cache, compression, treelets and layouts are ignored
+     * with a warning, and the tree can't be refitted, relaid out or analyzed. The triangles of a subtree are packed when it is built.
+    */
+    bool lazyBuild = false;
+    int lazySubtreeSize = 4096; // Lazy build: the maximum amount of primitives of a subtree built on demand
+    /**
+     * Intersect computes the entry distances of both children and visits the nearer one first, the farther one is pushed with its entry distance
+     * and skipped without another bound test if a closer hit is found. It's ignored by compressed nodes and the short stack traversal.
+     * The extra bound tests usually cost more than the culling saves, it's only about as fast as the default order when most rays are occluded.
+    */
+    bool distanceOrderedTraversal = false;
+    bool shortStackTraversal = false; // Traverse with a stack of SHORT_STACK_SIZE entries and parent links instead of a stack for the whole depth, it saves stack memory but is slower
+    bool packTriangles = true; // Copy the vertices of triangles into an array in the order of leaves, so a leaf reads consecutive memory
+    bool calibrateCostModel = false; // Measure traversalCost and intersectionCost on this CPU(once per process) and use them instead of the values above
+};
 
+/**
+ * What a traversal of BVHAccel looks for: the closest hit(Intersect), any hit(IntersectP) or all hits(IntersectAll).
+*/
+enum class BVHQuery {
+    ClosestHit, AnyHit, AllHits
+};
+
+/**
+ * The order in which a traversal of BVHAccel visits the children of a node.
+*/
+enum class BVHTraversalOrder {
+    Stack, // The first child by the sign of the ray direction in the split axis, the other one is pushed on the stack
+    ShortStack, // Same order with Stack, see BVHBuildOptions::shortStackTraversal
+    DistanceOrdered // The child whose bound the ray enters first, see BVHBuildOptions::distanceOrderedTraversal
+};
+
+/**
+ * A packet of N coherent rays traced together by BVHAccel::IntersectPacket, e.g. the camera rays of a block of pixels or the shadow rays from them.
+ * Only the first size rays are traced, so a packet at the border of the image can be partial.
+*/
+template <int N>
+struct RayPacket {
+    static_assert(N == 4 || N == 8 || N == 16, "RayPacket only supports 4, 8 or 16 rays");
+    Ray rays[N];
+    int size = N; // It must be in [1, N]
+};
+
+/**
+ * The result of tracing a RayPacket, isects[i] is valid only if bit i of mask is set.
+*/
+template <int N>
+struct HitPacket {
+    SurfaceInteraction isects[N];
+    uint32_t mask = 0; // Bit i is set if rays[i] hit something
+};
+
+/**
+ * The quality metrics of a built BVHAccel, they are computed by BVHAccel::AnalyzeQuality.
+ * The costs use the same model as building, see BVHBuildOptions::traversalCost and BVHBuildOptions::intersectionCost.
+*/
+struct BVHQuality {
+    Float sahCost = 0; // The expected cost of a ray hitting the root bound, the sum of node costs weighted by their surface area relative to the root
+    /**
+     * The end-point overlap: the surface area of primitives inside the bound of a node but not referenced by its subtree,
+     * weighted by the node cost(traversalCost for an interior node, intersectionCost for each primitive of a leaf) and divided by
+     * the surface area of all primitives. Rays hitting these parts traverse the node in vain,
+     * it predicts the traversal cost better than sahCost when nodes overlap. The area of a part is measured by its clipped bound.
+    */
+    Float epo = 0;
+    Float siblingOverlap = 0; // The average ratio of the overlap area of the two children to the area of an interior node
+    std::vector<int64_t> leafDepths; // leafDepths[d] is the amount of leaves at depth d, the root is at depth 0
+    std::vector<int64_t> leafSizes; // leafSizes[n] is the amount of leaves with n primitives
+};
 
 /**
  * an accelerator base the BVH(Bounding Volume Hierarchies)
@@ -23,28 +152,330 @@ struct BVHPrimitiveInfo;
 class BVHAccel : public Aggregate {
 public:
     /**
-     * BVH will split primitive with three way: SHA(Surface Area Heuristic), Middle(Split with median) and EqualCounts(Split into same count)
+     * BVH will split primitive with seven way: SHA(Surface Area Heuristic), Middle(Split with median), EqualCounts(Split into same count),
+     * HLBVH(Sort primitives along the Morton curve, build treelets with Morton code bits then build the upper levels with SAH),
+     * SBVH(SAH with spatial splits, a primitive crossing the split plane may be referenced by both children),
+     * PLOC(Merge nearest clusters in the Morton order from bottom to top) and SweepSAH(SAH evaluated at every centroid on all axes)
     */
     enum class SplitMethod {
-        SAH, Middle, EqualCounts
+        SAH, Middle, EqualCounts, HLBVH, SBVH, PLOC, SweepSAH
     };
-    BVHAccel(std::vector<std::shared_ptr<Primitive>> ps, SplitMethod sm = SplitMethod::SAH, int maxPrimsInNode = 1);
+    static PBRT_CONSTEXPR int MAX_SAH_BUCKETS = 64; // The capacity of bucket arrays, BVHBuildOptions::sahBuckets can't exceed it
+    BVHAccel(std::vector<std::shared_ptr<Primitive>> ps, SplitMethod sm = SplitMethod::SAH, int maxPrimsInNode = 1, const BVHBuildOptions &options = BVHBuildOptions());
     ~BVHAccel();
     virtual bool Intersect(const Ray &ray, SurfaceInteraction &isect) const override;
     virtual bool IntersectP(const Ray &ray) const override;
     virtual Bounds3f WorldBound() const override;
 
+    /**
+     * Find all hits of the ray before ray.tMax, e.g. for transparent surfaces, ray.tMax is not changed. The hits are in the traversal order,
+     * not sorted by distance. A primitive referenced by more than one leaf(SBVH or pre-split references) is reported once.
+     * @return The amount of hits appended to isects.
+    */
+    int IntersectAll(const Ray &ray, std::vector<SurfaceInteraction> &isects) const;
+
+    /**
+     * Trace a packet of coherent rays with one traversal: a node is fetched once for the packet and its bound is tested with all active rays
+     * by SIMD, the rays missing it are masked off in its subtree. The packed triangles of a leaf are also tested with all active rays at once.
+     * The hits and the tMax of the rays are the same as calling Intersect for each ray. Compressed trees and trees at least STACK_SIZE deep
+     * trace the rays one by one.
+     * @return Whether any ray hit.
+    */
+    template <int N>
+    bool IntersectPacket(const RayPacket<N> &packet, HitPacket<N> &hits) const;
+    template <int N>
+    uint32_t IntersectPPacket(const RayPacket<N> &packet) const; // Return the mask of the rays hitting anything, e.g. the occluded shadow rays
+
+    /**
+     * Trace a large batch of arbitrary rays, e.g. secondary or ambient occlusion rays, which are incoherent one by one but coherent in aggregate.
+     * The rays are sorted by the octant of their direction and the Morton code of their origin, then every STREAM_PACKET_SIZE consecutive rays
+     * are traced as a packet by IntersectPacket. The results are in the original order, the tMax of the rays are updated like Intersect does.
+     * The packets are traced in parallel if the executor is available.
+     * @param isects Output the hit of each ray, isects[i] is valid only if hits[i] is 1.
+     * @return The amount of rays hitting something.
+    */
+    int IntersectStream(const std::vector<Ray> &rays, std::vector<SurfaceInteraction> &isects, std::vector<uint8_t> &hits) const;
+    int IntersectPStream(const std::vector<Ray> &rays, std::vector<uint8_t> &occluded) const; // occluded[i] is 1 if rays[i] hits anything
+
+    /**
+     * Update the bounds after primitives moved, e.g. the points of a TriangleMesh are changed by animation.
+     * The topology is kept, leaf bounds are recomputed from primitives and interior bounds are merged from bottom to top,
+     * the nodes of a level are refitted in parallel. The SAH cost of subtrees with at most REFIT_SUBTREE_SIZE primitives
+     * is compared with the cost after building, the subtrees degraded beyond options.refitRebuildThreshold are rebuilt.
+     * It doesn't support compressed nodes or lazy subtrees.
+    */
+    void Refit();
+
+    /**
+     * Store the linear nodes in another layout, the tree is not changed.
+     * @param rays Only used by BVHLayout::HotFirst, the nodes are ordered by how many times these rays visit them.
+     *             If it is empty, the visits are estimated by the surface area of nodes.
+     * It doesn't support compressed nodes or lazy subtrees.
+    */
+    void Relayout(BVHLayout layout, const std::vector<Ray> &rays = std::vector<Ray>());
+
+    /**
+     * Compute the quality metrics of the tree, they are also reported as stats under the category "BVH".
+     * The end-point overlap tests every primitive against the nodes overlapping it, it runs in parallel if the executor is available.
+     * It doesn't support compressed nodes or lazy subtrees.
+    */
+    BVHQuality AnalyzeQuality() const;
+
+    /**
+     * Measure the cost model on this CPU: the time of Bounds3::IntersectP is the traversal cost and the time of
+     * Triangle::Intersection is the intersection cost. intersectionCost is always 1, traversalCost is the ratio of the two times.
+    */
+    static void CalibrateCostModel(Float &traversalCost, Float &intersectionCost);
+
 private:
-    std::shared_ptr<BVHBuildNode> RecursiveBuild(std::vector<BVHPrimitiveInfo> &primitiveInfos, int begin, int end, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives);
-    int FlattenBVHTree(const std::shared_ptr<BVHBuildNode> node, int &offset); // Flatten a BVH tree into a linear array tree
+    template <int N> friend class WideBVHAccel; // It collapses the flattened tree into wide nodes
+
+    /**
+     * The index of the first(child = 0) or second(child = 1) child of the interior node nodes[index].
+     * In the depth first layout the first child follows its parent, in other layouts secondChildOffset is the index of the first child
+     * and the second child follows it.
+    */
+    int ChildIndex(int index, int child) const {
+        if(siblingPairs) return nodes[index].secondChildOffset + child;
+        return child == 0 ? index + 1 : nodes[index].secondChildOffset;
+    }
+
+    /**
+     * Build the BVH tree for primitiveInfos[begin, end) recursively, all nodes are allocated in the arena.
+     * The primitives of a leaf node are written into orderedPrimitives at the same index they have in primitiveInfos,
+     * so the leaf offset only depends on the partition result, not on the order in which subtrees are built.
+     * @param tasks If it is not null, subtrees with no more than taskSize primitives are not built, they are recorded as tasks
+     *              and built later by ParallelBuild or LazyBuild. Large nodes will also compute their bounds and SAH buckets in parallel.
+    */
+    BVHBuildNode *RecursiveBuild(MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfos, int begin, int end, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives, std::vector<BVHBuildTask> *tasks = nullptr, int taskSize = PARALLEL_TASK_SIZE) const;
+    
+    /**
+     * Build the BVH tree with all threads of ParallelForLoopExecutor. The upper levels are built on the main thread,
+     * then the remaining subtrees are built in parallel. It produces exactly the same tree as RecursiveBuild does.
+     * @param arenas One arena for each thread, a thread only allocates nodes in arenas[ThreadIndex].
+    */
+    BVHBuildNode *ParallelBuild(std::vector<MemoryArena> &arenas, std::vector<BVHPrimitiveInfo> &primitiveInfos, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives);
+
+    /**
+     * Build the upper levels for options.lazyBuild, each subtree with at most options.lazySubtreeSize primitives is left as a placeholder leaf
+     * with LAZY_SUBTREE primitives, its primitiveOffset is the index in lazySubtrees. primitives keeps the input order, the subtrees index it.
+    */
+    BVHBuildNode *LazyBuild(MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfos, int &totalNodes);
+
+    /**
+     * Build lazySubtrees[index] if it isn't built yet. Only the first thread reaching it builds it, the others wait until it is published.
+    */
+    const LazySubtree &BuildLazySubtree(int index) const;
+    bool IntersectLazySubtree(int index, const Ray &ray, SurfaceInteraction &isect) const; // Traverse lazySubtrees[index] with the same kernel as the whole tree
+    bool IntersectPLazySubtree(int index, const Ray &ray) const;
+
+    /**
+     * Build the BVH tree with HLBVH: each primitive gets a 30-bit Morton code from its centroid, after radix sorting,
+     * primitives with the same high 12 bits form a treelet which is split by the remaining bits, then the treelets are
+     * combined with SAH. Morton codes, sorting and treelets are all computed in parallel if the executor is available.
+    */
+    BVHBuildNode *HLBVHBuild(std::vector<MemoryArena> &arenas, const std::vector<BVHPrimitiveInfo> &primitiveInfos, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives);
+    
+    /**
+     * Build a treelet by splitting mortonPrimitives[begin, end) with the Morton code bit from bitIndex to 0.
+    */
+    BVHBuildNode *EmitLBVH(MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfos, const std::vector<MortonPrimitive> &mortonPrimitives, int begin, int end, int bitIndex, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives);
+    
+    /**
+     * Combine treeletRoots[begin, end) into one tree with SAH.
+    */
+    BVHBuildNode *BuildUpperSAH(MemoryArena &arena, std::vector<BVHBuildNode *> &treeletRoots, int begin, int end, int &totalNodes);
+
+    /**
+     * Build the BVH tree with the full sweep SAH for the best quality, every position between two neighbouring centroids on all three axes
+     * is evaluated exactly instead of the buckets on one axis. The references are sorted on each axis once, then the sorted lists are
+     * stably partitioned by every split, so a level costs O(n) and the whole build costs O(n log n). It runs on the main thread only.
+    */
+    BVHBuildNode *SweepSAHBuild(MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfos, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives);
+    BVHBuildNode *SweepSAHSplit(MemoryArena &arena, SweepSAHState &state, int begin, int end, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives) const; // Build the node for the range [begin, end) of the sorted lists
+
+    /**
+     * Build the BVH tree bottom up with PLOC(parallel locally-ordered clustering). Every primitive starts as a cluster in the Morton order,
+     * in each iteration every cluster finds the nearest one within options.plocRadius on both sides, measured by the surface area of their union,
+     * the mutual nearest pairs are merged and the clusters are compacted. Each step runs in parallel if the executor is available.
+     * At last the subtrees are collapsed into leaves where the SAH cost prefers them.
+    */
+    BVHBuildNode *PLOCBuild(std::vector<MemoryArena> &arenas, const std::vector<BVHPrimitiveInfo> &primitiveInfos, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives);
+
+    /**
+     * Move the primitives of the PLOC tree into orderedPrimitives in the depth first order of leaves, so every subtree has a contiguous range,
+     * and turn a subtree into a leaf if it has at most maxPrimitivesInNode primitives and the leaf is cheaper. It also computes the costs.
+     * @return The amount of primitives in the subtree.
+    */
+    int CollapsePLOCLeaves(BVHBuildNode *node, const std::vector<std::shared_ptr<Primitive>> &leafPrimitives, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives, int &offset, int &totalNodes) const;
+    
+    /**
+     * Build the BVH tree with SBVH, the leaves may reference a primitive more than once,
+     * so orderedPrimitives may be bigger than primitives.
+    */
+    BVHBuildNode *SBVHBuild(MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfos, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives);
+
+    /**
+     * Build a SBVH node for the references, it chooses the best one from the object split, the spatial split and the leaf.
+     * @param rootArea The surface area of the root node, it decides whether the spatial split is worth trying.
+     * @param splitBudget How many references can still be duplicated by spatial splits.
+    */
+    BVHBuildNode *SpatialSplitBuild(MemoryArena &arena, std::vector<BVHPrimitiveInfo> references, Float rootArea, int depth, int &splitBudget, int &totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrimitives);
+
+    /**
+     * Split the references with large bounds before building(early split clipping), the largest reference is split first until
+     * options.preSplitBudget is used up or no reference is larger than options.preSplitThreshold of the root area.
+     * A reference is split by the coarsest plane of a power of two grid over the root bound crossing its longest axis,
+     * so the split planes line up with the planes the builder is likely to choose, each half is clipped by ClippedWorldBound.
+     * The new references are appended, they have the same index with the split one.
+    */
+    void PreSplitReferences(std::vector<BVHPrimitiveInfo> &references) const;
+
+    /**
+     * Reduce the SAH cost of the built tree by treelet restructuring(TRBVH). Every interior node is the root of a treelet with
+     * up to TREELET_SIZE leaves, the best topology of the treelet is found by dynamic programming over all subsets of its leaves.
+     * Nodes are visited from the deepest level to the root, treelets at the same level are independent and optimized in parallel.
+    */
+    void OptimizeTreelets(BVHBuildNode *root);
+
+    static int FlattenBVHTree(const BVHBuildNode *node, LinearBVHNode *linearNodes, int &offset); // Flatten a BVH tree into a linear array tree in the depth first order
+
+    /**
+     * Compress the interior node nodes[index] and its interior descendants into compressedNodes in depth first order.
+     * Leaves are not stored as nodes, their primitive ranges are kept in the parent.
+     * @return The index of the compressed node.
+    */
+    int CompressBVHTree(int index, int &offset);
+
+    std::vector<int> FindRefitSubtrees() const; // The roots of the largest subtrees with at most REFIT_SUBTREE_SIZE primitives, in depth first order
+    void RefitBounds(); // Recompute all bounds from primitives with the current topology
+    void RebuildSubtrees(const std::vector<int> &roots); // Rebuild the subtrees rooted at nodes[roots[i]] with SAH and flatten the whole tree again
+
+    /**
+     * Turn the linear subtree rooted at nodes[index] back into build nodes, the subtrees in replaced are replaced by
+     * the new built subtrees, the value is the new root and the amount of its nodes.
+    */
+    BVHBuildNode *UnflattenBVHTree(MemoryArena &arena, int index, const std::unordered_map<int, std::pair<BVHBuildNode *, int>> &replaced, int &totalNodes);
+
+    /**
+     * Load the tree from the cache file, the nodes are mapped into memory without copying if mmap is available.
+     * @param hash The hash of primitive bounds and build options, the file is used only if it has the same hash.
+     * @param inputs The primitives passed to the constructor, they are reordered by the cached ordering.
+    */
+    bool LoadCache(const std::string &path, uint64_t hash, const std::vector<std::shared_ptr<Primitive>> &inputs);
+    static bool IsValidCachedNode(const LinearBVHNode &node, int64_t index, int64_t totalNodes, int64_t nReferences, bool siblingPairs); // See LoadCache
+    
+    /**
+     * Save the flattened tree into the cache file, with the index of each primitive reference in the input primitives.
+    */
+    void SaveCache(const std::string &path, uint64_t hash, int nInputs, const std::vector<int> &ordering) const;
+
+    void ReleaseNodes(); // Free or unmap the linear nodes
+
+    /**
+     * Reorder the linear nodes into the layout, the stats are not updated.
+     * @param visits The expected visits of each node in the current order, HotFirst puts the nodes with more visits at the front
+     *               and the treelets grow to the children with more visits. If it is empty, the surface area is used.
+    */
+    void LayoutNodes(BVHLayout layout, const std::vector<Float> &visits);
+
+    void ComputeLinearCosts(std::vector<Float> &costs) const; // The SAH cost of every linear node, see ComputeNodeCost
+    void CountVisits(const std::vector<Ray> &rays, std::vector<Float> &visits) const; // How many times each node is visited by Intersect for the rays
+
+    /**
+     * Copy the vertices of triangle primitives into packedTriangles in the order of primitives, other primitives are marked by NaN.
+     * It is called after building, loading, refitting and rebuilding, nothing is packed if there are no triangles.
+    */
+    void PackTriangles();
+    /**
+     * Test the primitives[offset, offset + nPrimitives). A hit of a packed triangle only shortens ray.tMax and is recorded in closest,
+     * other primitives fill isect directly and clear closest. The interaction of the recorded triangle is built by FinishTriangleHit
+     * after the traversal, so it is built once per ray instead of once per hit.
+    */
+    bool IntersectLeaf(const BVHTreeView &tree, int offset, int nPrimitives, const Ray &ray, SurfaceInteraction &isect, TriangleHit &closest) const;
+    void FinishTriangleHit(const BVHTreeView &tree, const Ray &ray, const TriangleHit &closest, SurfaceInteraction &isect) const; // Build isect for the recorded hit if there is one
+    bool IntersectPLeaf(const BVHTreeView &tree, int offset, int nPrimitives, const Ray &ray) const;
+    BVHTreeView TreeView() const; // The arrays of the whole tree
+
+    /**
+     * Find the depth of the tree, and link every node to its parent if the short stack traversal is used.
+     * It is called whenever the linear nodes are reordered.
+    */
+    void LinkParents();
+
+    /**
+     * The next node to visit after the traversal finished the subtree nodes[index], found by walking up the parent links:
+     * it is the far child of the nearest ancestor whose near child contains the subtree, -1 if there isn't one.
+     * The near child is the one visited first, the second child if the ray direction is negative in the split axis.
+    */
+    int NextByParentLinks(int index, const int dirIsNeg[3]) const;
+
+    /**
+     * The traversal kernel of Intersect, IntersectP and IntersectAll. Octant has a bit for each axis whose ray direction is negative,
+     * so the slab planes of bound tests and the order of children are decided at compile time. The octant is selected once per ray by TraverseOctant.
+     * With BVHTraversalOrder::ShortStack the stack keeps the last SHORT_STACK_SIZE far children. When it overflows the oldest entries are dropped,
+     * after the stack runs out they are found again by NextByParentLinks, so it only traverses the whole tree, not a lazy subtree.
+     * With BVHTraversalOrder::DistanceOrdered the bounds of both children are tested at their parent, the far one is pushed with its entry distance
+     * and popped without another bound test only if it is still before ray.tMax.
+     * @param tree The whole tree, or a lazy subtree when a lazy leaf is reached.
+     * @param isect The output of BVHQuery::ClosestHit, hits is the output of BVHQuery::AllHits, the other one is null.
+    */
+    template <BVHQuery Query, BVHTraversalOrder Order, int Octant>
+    bool Traverse(const BVHTreeView &tree, const Ray &ray, const Vector3f &invD, SurfaceInteraction *isect, BVHAllHits *hits) const;
+    template <BVHQuery Query, BVHTraversalOrder Order = BVHTraversalOrder::Stack>
+    bool TraverseOctant(const BVHTreeView &tree, const Ray &ray, SurfaceInteraction *isect, BVHAllHits *hits) const;
+    template <BVHQuery Query>
+    bool TraverseCompressed(const Ray &ray, SurfaceInteraction *isect, BVHAllHits *hits) const; // The same queries on compressedNodes, in the order of BVHTraversalOrder::Stack
+
+    /**
+     * Test the leaf for the query of a traversal kernel by IntersectLeaf, IntersectPLeaf or IntersectAllLeaf.
+    */
+    template <BVHQuery Query>
+    bool QueryLeaf(const BVHTreeView &tree, int offset, int nPrimitives, const Ray &ray, SurfaceInteraction *isect, TriangleHit &closest, BVHAllHits *hits) const;
+
+    /**
+     * Append the hits of primitives[offset, offset + nPrimitives) to hits, the primitives already in hits are skipped. A lazy subtree is traversed.
+    */
+    bool IntersectAllLeaf(const BVHTreeView &tree, int offset, int nPrimitives, const Ray &ray, BVHAllHits &hits) const;
     
     std::vector<std::shared_ptr<Primitive>> primitives; // It store all actual primitve, they are the leaf nodes in the BVH tree, and its index in the vector will be recorded to search
     LinearBVHNode *nodes; // a head point for a LinearBVHNode array, we transform a tree node into a linear array, it will get good performance in traversal tree
+    int totalNodes; // The amount of nodes in the linear tree
+    bool siblingPairs; // False for the depth first layout, true for the other layouts which store the children of a node next to each other
+    void *mappedFile; // If nodes are mapped from a cache file, it is the address of the mapping, otherwise it is null
+    size_t mappedSize;
+    std::vector<RefitSubtree> refitSubtrees; // The subtrees watched by Refit, they are found by the first Refit
+    CompressedBVHNode *compressedNodes; // If nodes are compressed, nodes is released and the tree is stored here
+    std::vector<int> parents; // The parent of each linear node(-1 for the root), only linked for the short stack traversal
+    int treeDepth; // The maximum depth of leaves, the root is at depth 0
+    std::vector<std::unique_ptr<LazySubtree>> lazySubtrees; // The subtrees built on demand, only for options.lazyBuild
+    PackedTriangle *packedTriangles; // The vertices of primitives[i] is packedTriangles[i] if it is a triangle, null if options.packTriangles is false
+    Bounds3f rootBound; // The bound of the root node, only used by the compressed tree
     const int maxPrimitivesInNode; // the maximax capacity of primitives in each leaf node
     SplitMethod method; // Which split method, it will be used in split algorithms
+    const BVHBuildOptions options;
 
-    static PBRT_CONSTEXPR int SHA_THRESHOLD = 2;
-    static PBRT_CONSTEXPR int SHA_N_BUCKETS = 12;
+    static PBRT_CONSTEXPR int PARALLEL_BUILD_THRESHOLD = 16384; // If the amount of primitives is less than it, build the tree on the main thread only
+    static PBRT_CONSTEXPR int PARALLEL_TASK_SIZE = 4096; // The minimum amount of primitives of a subtree which is built as a parallel task
+    static PBRT_CONSTEXPR int PARALLEL_CHUNK_SIZE = 16384; // How many primitives a thread handles when computing bounds and buckets in parallel
+    static PBRT_CONSTEXPR int MORTON_BITS = 10; // How many bits of each axis in the Morton code, three axes use 30 bits
+    static PBRT_CONSTEXPR int TREELET_BITS = 12; // The high bits of Morton code which decide the treelet a primitive belongs to
+    static PBRT_CONSTEXPR int PLOC_PARALLEL_THRESHOLD = 4096; // Run a PLOC iteration in parallel only if there are so many clusters
+    static PBRT_CONSTEXPR int SBVH_SPATIAL_BINS = 32; // The amount of bins of spatial splits in each axis
+    static PBRT_CONSTEXPR int PRE_SPLIT_MAX_LEVEL = 20; // The finest level of the grid whose planes split references in PreSplitReferences
+    static PBRT_CONSTEXPR int SBVH_MAX_SPATIAL_DEPTH = 48; // Don't try spatial splits in deeper nodes, keep the tree depth safe for traversal stack
+    static PBRT_CONSTEXPR int TREELET_SIZE = 7; // The maximum amount of leaves of a treelet, the dynamic programming costs O(3^n) for each treelet
+    static PBRT_CONSTEXPR int TREELET_PARALLEL_THRESHOLD = 64; // Optimize the treelets of a level in parallel only if the level has so many nodes
+    static PBRT_CONSTEXPR int REFIT_SUBTREE_SIZE = 4096; // The maximum amount of primitives of a subtree watched by Refit, a degraded subtree is rebuilt as a whole
+    static PBRT_CONSTEXPR int REFIT_PARALLEL_THRESHOLD = 1024; // Refit the nodes of a level in parallel only if the level has so many nodes
+    static PBRT_CONSTEXPR int LAYOUT_CACHE_LINES = 4; // The cache lines a treelet of BVHLayout::CacheLineTreelets spans, one line only holds a single sibling pair
+    static PBRT_CONSTEXPR int LAYOUT_PAGE_SIZE = 4096; // The size of a treelet of BVHLayout::PageTreelets in bytes
+    static PBRT_CONSTEXPR int STACK_SIZE = 64; // The stack of the traversal, a tree at least so deep allocates the stack on the heap and isn't compressed
+    static PBRT_CONSTEXPR int LAZY_SUBTREE = 0xFFFF; // The nPrimitives of a linear node standing for a lazy subtree
+    static PBRT_CONSTEXPR int MAX_LEAF_PRIMITIVES = LAZY_SUBTREE - 1; // The most primitives of a leaf, a larger leaf is split even if its primitives can't be separated
+    static PBRT_CONSTEXPR int SHORT_STACK_SIZE = 8; // The entries of the short stack, it must be a power of 2
+    static PBRT_CONSTEXPR int STREAM_PACKET_SIZE = 16; // The size of the packets a ray stream is traced in
+    static PBRT_CONSTEXPR int STREAM_PARALLEL_THRESHOLD = 4096; // Sort and trace a ray stream in parallel only if it has so many rays
 };
 
 } // namespace pbrt
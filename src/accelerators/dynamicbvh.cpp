@@ -0,0 +1,289 @@
+#include "dynamicbvh.h"
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_COUNTER("BVH/DynamicBVHNode/Rotations", Rotations);
+STAT_COUNTER("BVH/DynamicBVHNode/Balancing rotations", BalancingRotations);
+
+/**
+ * A node of the dynamic tree, the index of a leaf is the handle of its primitive, so it never moves.
+*/
+struct DynamicBVHNode {
+    Bounds3f bound;
+    int parent = -1; // -1 for the root, for a free node it is the next free node
+    int children[2] = {-1, -1}; // Only for interior nodes
+    int height = 0; // 0 for leaves, -1 for free nodes
+    std::shared_ptr<Primitive> primitive; // Only for leaves
+};
+
+DynamicBVHAccel::DynamicBVHAccel(const std::vector<std::shared_ptr<Primitive>> &ps): root(-1), freeList(-1), nPrimitives(0) {
+    nodes.reserve(2 * ps.size());
+    for(const std::shared_ptr<Primitive> &p: ps)
+        Insert(p);
+}
+
+DynamicBVHAccel::~DynamicBVHAccel() {}
+
+int DynamicBVHAccel::Height() const {
+    return root == -1 ? 0 : nodes[root].height;
+}
+
+int DynamicBVHAccel::AllocateNode() {
+    if(freeList != -1) {
+        int index = freeList;
+        freeList = nodes[index].parent;
+        nodes[index] = DynamicBVHNode();
+        return index;
+    }
+    nodes.emplace_back();
+    return nodes.size() - 1;
+}
+
+void DynamicBVHAccel::FreeNode(int index) {
+    nodes[index].primitive.reset();
+    nodes[index].height = -1;
+    nodes[index].parent = freeList;
+    freeList = index;
+}
+
+int DynamicBVHAccel::Insert(const std::shared_ptr<Primitive> &primitive) {
+    int leaf = AllocateNode();
+    nodes[leaf].primitive = primitive;
+    nodes[leaf].bound = primitive->WorldBound();
+    InsertLeaf(leaf);
+    ++nPrimitives;
+    return leaf;
+}
+
+bool DynamicBVHAccel::IsValidHandle(int handle) const {
+    return handle >= 0 && handle < (int)nodes.size() && nodes[handle].height == 0 && nodes[handle].primitive != nullptr;
+}
+
+bool DynamicBVHAccel::Remove(int handle) {
+    if(!IsValidHandle(handle)) {
+        LOG(ERROR) << "Can't remove the primitive of invalid handle " << handle;
+        return false;
+    }
+    RemoveLeaf(handle);
+    FreeNode(handle);
+    --nPrimitives;
+    return true;
+}
+
+bool DynamicBVHAccel::Update(int handle) {
+    if(!IsValidHandle(handle)) {
+        LOG(ERROR) << "Can't update the primitive of invalid handle " << handle;
+        return false;
+    }
+    RemoveLeaf(handle);
+    nodes[handle].bound = nodes[handle].primitive->WorldBound();
+    InsertLeaf(handle);
+    return true;
+}
+
+void DynamicBVHAccel::InsertLeaf(int leaf) {
+    if(root == -1) {
+        root = leaf;
+        nodes[leaf].parent = -1;
+        return;
+    }
+    // Find the sibling with the least cost by branch and bound. Pairing with a node costs the area of their union,
+    // plus the area increase of all its ancestors(inherited cost), a subtree is skipped if even the leaf area can't beat the best.
+    // Only a leaf or a parent of leaves can be the sibling, so the new parent is balanced and the subtree grows by one level at most,
+    // then one rotation of each ancestor keeps the tree balanced like an AVL tree.
+    const Bounds3f bound = nodes[leaf].bound;
+    Float leafArea = bound.SurfaceArea();
+    int sibling = -1;
+    Float bestCost = Infinity;
+    std::vector<std::pair<int, Float>> toVisit = {{root, 0}};
+    while(!toVisit.empty()) {
+        int index = toVisit.back().first;
+        Float inheritedCost = toVisit.back().second;
+        toVisit.pop_back();
+        const DynamicBVHNode &node = nodes[index];
+        Float directCost = Union(node.bound, bound).SurfaceArea();
+        if(node.height <= 1 && directCost + inheritedCost < bestCost) {
+            bestCost = directCost + inheritedCost;
+            sibling = index;
+        }
+        if(node.height == 0) continue;
+        Float childInheritedCost = inheritedCost + directCost - node.bound.SurfaceArea();
+        if(leafArea + childInheritedCost < bestCost) {
+            toVisit.push_back({node.children[0], childInheritedCost});
+            toVisit.push_back({node.children[1], childInheritedCost});
+        }
+    }
+    if(sibling == -1) { // every low node was pruned by the bound, descend to the child whose area grows least
+        sibling = root;
+        while(nodes[sibling].height > 1) {
+            const DynamicBVHNode &node = nodes[sibling];
+            auto growth = [&](int child) { return Union(nodes[child].bound, bound).SurfaceArea() - nodes[child].bound.SurfaceArea(); };
+            sibling = growth(node.children[0]) <= growth(node.children[1]) ? node.children[0] : node.children[1];
+        }
+    }
+
+    int oldParent = nodes[sibling].parent;
+    int newParent = AllocateNode();
+    DynamicBVHNode &parent = nodes[newParent];
+    parent.parent = oldParent;
+    parent.children[0] = sibling;
+    parent.children[1] = leaf;
+    if(oldParent == -1)
+        root = newParent;
+    else
+        nodes[oldParent].children[nodes[oldParent].children[0] == sibling ? 0 : 1] = newParent;
+    nodes[sibling].parent = nodes[leaf].parent = newParent;
+    RefitAncestors(newParent);
+}
+
+void DynamicBVHAccel::RemoveLeaf(int leaf) {
+    if(leaf == root) {
+        root = -1;
+        return;
+    }
+    int parent = nodes[leaf].parent;
+    int grandParent = nodes[parent].parent;
+    int sibling = nodes[parent].children[nodes[parent].children[0] == leaf ? 1 : 0];
+    nodes[sibling].parent = grandParent;
+    if(grandParent == -1) {
+        root = sibling;
+    } else {
+        nodes[grandParent].children[nodes[grandParent].children[0] == parent ? 0 : 1] = sibling;
+        RefitAncestors(grandParent);
+    }
+    FreeNode(parent);
+}
+
+void DynamicBVHAccel::RefitAncestors(int index) {
+    while(index != -1) {
+        DynamicBVHNode &node = nodes[index];
+        const DynamicBVHNode &c0 = nodes[node.children[0]], &c1 = nodes[node.children[1]];
+        node.bound = Union(c0.bound, c1.bound);
+        node.height = 1 + std::max(c0.height, c1.height);
+        Rotate(index);
+        index = node.parent;
+    }
+}
+
+void DynamicBVHAccel::Rotate(int index) {
+    // A rotation swaps a child with a grandchild under the other child. The bound of the node is not changed,
+    // only the other child gets a new bound, so the rotation reducing its surface area most is the best one.
+    DynamicBVHNode &node = nodes[index];
+    int h0 = nodes[node.children[0]].height, h1 = nodes[node.children[1]].height;
+    DCHECK_LE(std::abs(h0 - h1), 2) << "an edit changes the height of a subtree by one level at most";
+    if(std::abs(h0 - h1) > 1) { // the lower child swaps with the higher grandchild under the higher child, then both levels are balanced
+        int lower = h0 < h1 ? 0 : 1;
+        const DynamicBVHNode &higher = nodes[node.children[1 - lower]];
+        SwapWithGrandChild(index, lower, nodes[higher.children[0]].height >= nodes[higher.children[1]].height ? 0 : 1);
+        ++BalancingRotations;
+        return;
+    }
+    Float bestReduction = 0;
+    int bestChild = -1, bestGrandChild = -1;
+    for(int c = 0; c < 2; ++c) {
+        const DynamicBVHNode &other = nodes[node.children[1 - c]];
+        if(other.height == 0) continue;
+        for(int g = 0; g < 2; ++g) {
+            // node.children[c] takes the place of other.children[g] and joins other.children[1 - g], both levels must stay balanced
+            int hMoved = nodes[node.children[c]].height, hKept = nodes[other.children[1 - g]].height, hUp = nodes[other.children[g]].height;
+            int hOther = 1 + std::max(hMoved, hKept);
+            if(std::abs(hMoved - hKept) > 1 || std::abs(hOther - hUp) > 1 || 1 + std::max(hOther, hUp) > node.height) continue;
+            Float area = Union(nodes[node.children[c]].bound, nodes[other.children[1 - g]].bound).SurfaceArea();
+            Float reduction = other.bound.SurfaceArea() - area;
+            if(reduction > bestReduction) {
+                bestReduction = reduction;
+                bestChild = c;
+                bestGrandChild = g;
+            }
+        }
+    }
+    if(bestChild == -1) return;
+    SwapWithGrandChild(index, bestChild, bestGrandChild);
+    ++Rotations;
+}
+
+void DynamicBVHAccel::SwapWithGrandChild(int index, int child, int grandChildIndex) {
+    DynamicBVHNode &node = nodes[index];
+    int moved = node.children[child];
+    int otherIndex = node.children[1 - child];
+    DynamicBVHNode &other = nodes[otherIndex];
+    int grandChild = other.children[grandChildIndex];
+    node.children[child] = grandChild;
+    nodes[grandChild].parent = index;
+    other.children[grandChildIndex] = moved;
+    nodes[moved].parent = otherIndex;
+    const DynamicBVHNode &g0 = nodes[other.children[0]], &g1 = nodes[other.children[1]];
+    other.bound = Union(g0.bound, g1.bound);
+    other.height = 1 + std::max(g0.height, g1.height);
+    node.height = 1 + std::max(nodes[node.children[0]].height, nodes[node.children[1]].height);
+}
+
+bool DynamicBVHAccel::Intersect(const Ray &ray, SurfaceInteraction &isect) const {
+    if(root == -1) return false;
+    int localStack[STACK_SIZE];
+    std::vector<int> heapStack;
+    int *stack = localStack;
+    if(nodes[root].height >= STACK_SIZE) { // the far child of every level may be pushed
+        heapStack.resize(nodes[root].height + 1);
+        stack = heapStack.data();
+    }
+    int stackTopIndex = 0;
+    int currentNodeIndex = root;
+    Vector3f invD(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invD.x < 0, invD.y < 0, invD.z < 0};
+    bool isHit = false;
+    while(true) {
+        const DynamicBVHNode &node = nodes[currentNodeIndex];
+        if(node.bound.IntersectP(ray, invD, dirIsNeg)) {
+            if(node.height == 0) {
+                if(node.primitive->Intersect(ray, isect)) isHit = true;
+            } else { // visit the child whose center is nearer along the ray first
+                const Bounds3f &b0 = nodes[node.children[0]].bound, &b1 = nodes[node.children[1]].bound;
+                bool swap = Dot((b1.pMin + b1.pMax) - (b0.pMin + b0.pMax), ray.d) < 0;
+                stack[stackTopIndex++] = node.children[swap ? 0 : 1];
+                currentNodeIndex = node.children[swap ? 1 : 0];
+                continue;
+            }
+        }
+        if(stackTopIndex == 0) break;
+        currentNodeIndex = stack[--stackTopIndex];
+    }
+    return isHit;
+}
+
+bool DynamicBVHAccel::IntersectP(const Ray &ray) const {
+    if(root == -1) return false;
+    int localStack[STACK_SIZE];
+    std::vector<int> heapStack;
+    int *stack = localStack;
+    if(nodes[root].height >= STACK_SIZE) {
+        heapStack.resize(nodes[root].height + 1);
+        stack = heapStack.data();
+    }
+    int stackTopIndex = 0;
+    int currentNodeIndex = root;
+    Vector3f invD(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invD.x < 0, invD.y < 0, invD.z < 0};
+    while(true) {
+        const DynamicBVHNode &node = nodes[currentNodeIndex];
+        if(node.bound.IntersectP(ray, invD, dirIsNeg)) {
+            if(node.height == 0) {
+                if(node.primitive->IntersectP(ray)) return true;
+            } else {
+                stack[stackTopIndex++] = node.children[1];
+                currentNodeIndex = node.children[0];
+                continue;
+            }
+        }
+        if(stackTopIndex == 0) break;
+        currentNodeIndex = stack[--stackTopIndex];
+    }
+    return false;
+}
+
+Bounds3f DynamicBVHAccel::WorldBound() const {
+    return root == -1 ? Bounds3f() : nodes[root].bound;
+}
+
+} // namespace pbrt
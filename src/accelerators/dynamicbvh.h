@@ -0,0 +1,65 @@
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_SRC_ACCELERATORS_DYNAMICBVH_H_
+#define PBRT_SRC_ACCELERATORS_DYNAMICBVH_H_
+
+#include "pbrt.h"
+#include "primitive.h"
+#include "geometry.h"
+
+namespace pbrt {
+
+struct DynamicBVHNode;
+
+/**
+ * A BVH which supports inserting and removing primitives one by one, like the dynamic AABB trees of physics engines.
+ * A new leaf is paired with the sibling found by branch and bound on the SAH cost, then the bounds of its ancestors are
+ * updated and each ancestor is rotated: an unbalanced one to restore the balance, otherwise by the rotation which reduces
+ * the surface area of its children without unbalancing it. The heights of the children of every node differ by one at most
+ * like an AVL tree, so the height is below 1.44 log2(n + 2) and an edit, which only touches the path from the leaf to the root, costs O(log n).
+ * The tree is slower to traverse than BVHAccel built from scratch, rebuild BVHAccel when editing is done.
+ * Editing must not run concurrently with traversal.
+*/
+class DynamicBVHAccel : public Aggregate {
+public:
+    DynamicBVHAccel(const std::vector<std::shared_ptr<Primitive>> &ps = std::vector<std::shared_ptr<Primitive>>()); // Insert ps in order
+    ~DynamicBVHAccel();
+    virtual bool Intersect(const Ray &ray, SurfaceInteraction &isect) const override;
+    virtual bool IntersectP(const Ray &ray) const override;
+    virtual Bounds3f WorldBound() const override;
+
+    /**
+     * Insert a primitive into the tree.
+     * @return The handle of the primitive, it is valid until the primitive is removed. Then it may be reused by another primitive.
+    */
+    int Insert(const std::shared_ptr<Primitive> &primitive);
+    bool Remove(int handle); // Remove the primitive inserted with the handle, return false and change nothing if the handle is invalid
+    bool Update(int handle); // Reinsert the primitive after it moved, the handle is kept. Return false and change nothing if the handle is invalid
+
+    int Size() const { return nPrimitives; } // The amount of primitives in the tree
+    int Height() const; // The height of the tree, 0 if the root is a leaf or the tree is empty
+
+private:
+    int AllocateNode();
+    void FreeNode(int index);
+    void InsertLeaf(int leaf); // Link the leaf into the tree, its bound must be up to date
+    void RemoveLeaf(int leaf); // Unlink the leaf from the tree, the leaf node is kept
+    void RefitAncestors(int index); // Update the bounds and heights from nodes[index] to the root, rotating each of them
+    void Rotate(int index); // Rebalance the interior node nodes[index], or apply its best rotation if it reduces the surface area
+    void SwapWithGrandChild(int index, int child, int grandChild); // Swap a child of nodes[index] with a grandchild under the other child
+    bool IsValidHandle(int handle) const; // Whether the handle is a leaf in the tree
+
+    std::vector<DynamicBVHNode> nodes; // All nodes, the removed ones are in the free list
+    int root; // The index of the root node, -1 if the tree is empty
+    int freeList; // The first free node, free nodes are linked by their parent field
+    int nPrimitives;
+
+    static PBRT_CONSTEXPR int STACK_SIZE = 64; // The traversal stack on the call stack, a higher tree uses a heap allocated stack
+};
+
+} // namespace pbrt
+
+#endif // PBRT_SRC_ACCELERATORS_DYNAMICBVH_H_
@@ -0,0 +1,273 @@
+
+#include "widebvh.h"
+#include "memory.h"
+#include "stats.h"
+
+#if defined(__SSE__) || defined(__AVX__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+namespace pbrt {
+
+STAT_COUNTER("BVH/WideBVHNode/Interior", WideInteriorNodes);
+STAT_MEMORY_COUNTER("BVH/WideBVHNode", WideTreeBytes);
+
+/**
+ * A node with N children, the bounds are stored as [min or max][axis][child], so the same plane of all children can be loaded at once.
+ * A child slot is either an interior node, a leaf or empty. Empty slots have an inverted bound which no ray can hit.
+*/
+template <int N>
+struct alignas(32) WideBVHNode {
+    float bounds[2][3][N]; // The bounds of children, they are rounded outward when Float is double
+    int32_t offsets[N]; // For interior children, it is the index in the wide nodes, for leaf children, it is the starting index in the `primitives`
+    uint16_t nPrimitives[N]; // How many primitives a leaf child has, 0 means the child is an interior node
+    int32_t nChildren; // The first nChildren slots are used
+};
+
+/**
+ * A child waiting on the traversal stack, it is a leaf if nPrimitives is greater than 0.
+*/
+struct WideStackItem {
+    int32_t offset;
+    int32_t nPrimitives;
+};
+
+// 1 + 2 * gamma(3) in float precision, the exit distance is enlarged like Bounds3::IntersectP does
+static const float ExitScale = 1 + 2 * (3 * std::numeric_limits<float>::epsilon() * 0.5f) / (1 - 3 * std::numeric_limits<float>::epsilon() * 0.5f);
+
+/**
+ * The same robust slab test as Bounds3::IntersectP, for all children of a node.
+ * The max and min are written as (t > acc ? t : acc), so a NaN from 0 * infinity is ignored like in the scalar test.
+ * @param tNear Output the entry distance of each child.
+ * @return A bit mask of the hit children.
+*/
+template <int N>
+inline int IntersectChildren(const WideBVHNode<N> &node, const float org[3], const float invDir[3], const int dirIsNeg[3], float tMax, float *tNear) {
+    float tExit[N];
+    for(int i = 0; i < N; ++i) {
+        tNear[i] = 0;
+        tExit[i] = tMax;
+    }
+    for(int a = 0; a < 3; ++a) {
+        const float *nearPlanes = node.bounds[dirIsNeg[a]][a];
+        const float *farPlanes = node.bounds[1 - dirIsNeg[a]][a];
+        for(int i = 0; i < N; ++i) {
+            float t0 = (nearPlanes[i] - org[a]) * invDir[a];
+            float t1 = (farPlanes[i] - org[a]) * invDir[a] * ExitScale;
+            tNear[i] = t0 > tNear[i] ? t0 : tNear[i];
+            tExit[i] = t1 < tExit[i] ? t1 : tExit[i];
+        }
+    }
+    int mask = 0;
+    for(int i = 0; i < N; ++i)
+        if(tNear[i] <= tExit[i]) mask |= 1 << i;
+    return mask & ((1 << node.nChildren) - 1);
+}
+
+// _mm_max_ps and _mm_min_ps return the second operand if any operand is NaN, so the accumulator is always the second one
+#if defined(__SSE__) || defined(_M_X64)
+template <>
+inline int IntersectChildren<4>(const WideBVHNode<4> &node, const float org[3], const float invDir[3], const int dirIsNeg[3], float tMax, float *tNear) {
+    const __m128 scale = _mm_set1_ps(ExitScale);
+    __m128 tEntry = _mm_setzero_ps();
+    __m128 tExit = _mm_set1_ps(tMax);
+    for(int a = 0; a < 3; ++a) {
+        __m128 o = _mm_set1_ps(org[a]);
+        __m128 inv = _mm_set1_ps(invDir[a]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[dirIsNeg[a]][a]), o), inv);
+        __m128 t1 = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - dirIsNeg[a]][a]), o), inv), scale);
+        tEntry = _mm_max_ps(t0, tEntry);
+        tExit = _mm_min_ps(t1, tExit);
+    }
+    _mm_store_ps(tNear, tEntry);
+    return _mm_movemask_ps(_mm_cmple_ps(tEntry, tExit)) & ((1 << node.nChildren) - 1);
+}
+#endif
+
+#if defined(__AVX__)
+template <>
+inline int IntersectChildren<8>(const WideBVHNode<8> &node, const float org[3], const float invDir[3], const int dirIsNeg[3], float tMax, float *tNear) {
+    const __m256 scale = _mm256_set1_ps(ExitScale);
+    __m256 tEntry = _mm256_setzero_ps();
+    __m256 tExit = _mm256_set1_ps(tMax);
+    for(int a = 0; a < 3; ++a) {
+        __m256 o = _mm256_set1_ps(org[a]);
+        __m256 inv = _mm256_set1_ps(invDir[a]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[dirIsNeg[a]][a]), o), inv);
+        __m256 t1 = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[1 - dirIsNeg[a]][a]), o), inv), scale);
+        tEntry = _mm256_max_ps(t0, tEntry);
+        tExit = _mm256_min_ps(t1, tExit);
+    }
+    _mm256_store_ps(tNear, tEntry);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tEntry, tExit, _CMP_LE_OQ)) & ((1 << node.nChildren) - 1);
+}
+#endif
+
+template <int N>
+WideBVHAccel<N>::WideBVHAccel(std::vector<std::shared_ptr<Primitive>> ps, BVHAccel::SplitMethod sm, int maxPrimsInNode, const BVHBuildOptions &options): nodes(nullptr), totalNodes(0) {
+    BVHBuildOptions binaryOptions = options;
+    binaryOptions.compressNodes = false; // the binary tree is only read by collapsing
+    binaryOptions.lazyBuild = false;
+    BVHAccel bvh(std::move(ps), sm, maxPrimsInNode, binaryOptions);
+    if(bvh.nodes == nullptr) return;
+    bound = bvh.WorldBound();
+    primitives.swap(bvh.primitives);
+    std::vector<WideBVHNode<N>> wideNodes;
+    Collapse(bvh, 0, wideNodes);
+    totalNodes = wideNodes.size();
+    nodes = AllocAligned<WideBVHNode<N>>(totalNodes);
+    std::copy(wideNodes.begin(), wideNodes.end(), nodes);
+    WideTreeBytes += totalNodes * sizeof(WideBVHNode<N>) + primitives.size() * sizeof(primitives[0]);
+    LOG(INFO) << "Build " << N << "-wide BVH success with " << totalNodes << " nodes";
+}
+
+template <int N>
+WideBVHAccel<N>::~WideBVHAccel() {
+    FreeAligned(nodes);
+}
+
+template <int N>
+int WideBVHAccel<N>::Collapse(const BVHAccel &bvh, int index, std::vector<WideBVHNode<N>> &wideNodes) {
+    const LinearBVHNode *binaryNodes = bvh.nodes;
+    int children[N];
+    int nChildren = 0;
+    if(binaryNodes[index].nPrimitives > 0) { // Only happens when the whole tree is one leaf
+        children[nChildren++] = index;
+    } else {
+        children[nChildren++] = bvh.ChildIndex(index, 0);
+        children[nChildren++] = bvh.ChildIndex(index, 1);
+    }
+    while(nChildren < N) {
+        int largest = -1;
+        for(int i = 0; i < nChildren; ++i) {
+            const LinearBVHNode &child = binaryNodes[children[i]];
+            if(child.nPrimitives == 0 && (largest == -1 || child.bound.SurfaceArea() > binaryNodes[children[largest]].bound.SurfaceArea()))
+                largest = i;
+        }
+        if(largest == -1) break; // all children are leaves
+        int opened = children[largest];
+        children[largest] = bvh.ChildIndex(opened, 0);
+        children[nChildren++] = bvh.ChildIndex(opened, 1);
+    }
+
+    int myIndex = wideNodes.size();
+    wideNodes.emplace_back();
+    ++WideInteriorNodes;
+    {
+        WideBVHNode<N> &node = wideNodes[myIndex];
+        node.nChildren = nChildren;
+        for(int i = 0; i < N; ++i) {
+            for(int a = 0; a < 3; ++a) {
+                node.bounds[0][a][i] = Infinity;
+                node.bounds[1][a][i] = -Infinity;
+            }
+            node.offsets[i] = 0;
+            node.nPrimitives[i] = 0;
+        }
+    }
+    for(int i = 0; i < nChildren; ++i) {
+        const LinearBVHNode &child = binaryNodes[children[i]];
+        int offset = child.nPrimitives > 0 ? child.primitiveOffset : Collapse(bvh, children[i], wideNodes);
+        WideBVHNode<N> &node = wideNodes[myIndex]; // the vector may be reallocated by collapsing the child
+        for(int a = 0; a < 3; ++a) {
+            node.bounds[0][a][i] = RoundDownToFloat(child.bound.pMin[a]);
+            node.bounds[1][a][i] = RoundUpToFloat(child.bound.pMax[a]);
+        }
+        node.offsets[i] = offset;
+        node.nPrimitives[i] = child.nPrimitives;
+    }
+    return myIndex;
+}
+
+template <int N>
+bool WideBVHAccel<N>::Intersect(const Ray &ray, SurfaceInteraction &isect) const {
+    if(nodes == nullptr) return false;
+    float org[3], invDir[3];
+    int dirIsNeg[3];
+    for(int a = 0; a < 3; ++a) {
+        org[a] = ray.o[a];
+        invDir[a] = 1 / ray.d[a];
+        dirIsNeg[a] = invDir[a] < 0;
+    }
+    WideStackItem stack[STACK_SIZE];
+    int stackTopIndex = 0;
+    WideStackItem current = {0, 0}; // start from the root node
+    bool isHit = false;
+    while(true) {
+        if(current.nPrimitives > 0) {
+            for(int i = 0; i < current.nPrimitives; ++i) {
+                if(primitives[current.offset + i]->Intersect(ray, isect))
+                    isHit = true;
+            }
+        } else {
+            const WideBVHNode<N> &node = nodes[current.offset];
+            alignas(32) float tNear[N];
+            int mask = IntersectChildren<N>(node, org, invDir, dirIsNeg, ray.tMax, tNear);
+            if(mask != 0) {
+                // Sort the hit children from the farthest to the nearest, push all but the nearest one which is visited next
+                int hits[N];
+                int nHits = 0;
+                for(int i = 0; i < N; ++i) {
+                    if(!(mask & (1 << i))) continue;
+                    int k = nHits++;
+                    while(k > 0 && tNear[hits[k - 1]] < tNear[i]) {
+                        hits[k] = hits[k - 1];
+                        --k;
+                    }
+                    hits[k] = i;
+                }
+                for(int k = 0; k < nHits - 1; ++k)
+                    stack[stackTopIndex++] = {node.offsets[hits[k]], node.nPrimitives[hits[k]]};
+                current = {node.offsets[hits[nHits - 1]], node.nPrimitives[hits[nHits - 1]]};
+                continue;
+            }
+        }
+        if(stackTopIndex == 0) break;
+        current = stack[--stackTopIndex];
+    }
+    return isHit;
+}
+
+template <int N>
+bool WideBVHAccel<N>::IntersectP(const Ray &ray) const {
+    if(nodes == nullptr) return false;
+    float org[3], invDir[3];
+    int dirIsNeg[3];
+    for(int a = 0; a < 3; ++a) {
+        org[a] = ray.o[a];
+        invDir[a] = 1 / ray.d[a];
+        dirIsNeg[a] = invDir[a] < 0;
+    }
+    WideStackItem stack[STACK_SIZE];
+    int stackTopIndex = 0;
+    WideStackItem current = {0, 0};
+    while(true) {
+        if(current.nPrimitives > 0) {
+            for(int i = 0; i < current.nPrimitives; ++i) {
+                if(primitives[current.offset + i]->IntersectP(ray))
+                    return true;
+            }
+        } else { // any hit is enough, so the children are not sorted
+            const WideBVHNode<N> &node = nodes[current.offset];
+            alignas(32) float tNear[N];
+            int mask = IntersectChildren<N>(node, org, invDir, dirIsNeg, ray.tMax, tNear);
+            for(int i = 0; i < N; ++i) {
+                if(mask & (1 << i))
+                    stack[stackTopIndex++] = {node.offsets[i], node.nPrimitives[i]};
+            }
+        }
+        if(stackTopIndex == 0) break;
+        current = stack[--stackTopIndex];
+    }
+    return false;
+}
+
+template <int N>
+Bounds3f WideBVHAccel<N>::WorldBound() const {
+    return bound;
+}
+
+template class WideBVHAccel<4>;
+template class WideBVHAccel<8>;
+
+} // namespace pbrt
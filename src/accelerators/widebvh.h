@@ -0,0 +1,58 @@
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_SRC_ACCELERATORS_WIDEBVH_H_
+#define PBRT_SRC_ACCELERATORS_WIDEBVH_H_
+
+#include "pbrt.h"
+#include "primitive.h"
+#include "geometry.h"
+#include "bvh.h"
+
+namespace pbrt {
+
+template <int N> struct WideBVHNode;
+
+/**
+ * A BVH whose nodes have up to N children, QBVH for 4 and OBVH for 8.
+ * The binary tree built by BVHAccel is collapsed into wide nodes, the bounds of all children are stored as SoA floats,
+ * so a ray is tested with all children of a node by one SIMD slab test(SSE for 4 children, AVX for 8 children).
+ * The hit children are visited from the nearest one to the farthest one.
+ * If the instruction set is not available, the slab test falls back to a plain loop which gives the same result.
+*/
+template <int N>
+class WideBVHAccel : public Aggregate {
+public:
+    static_assert(N == 4 || N == 8, "WideBVHAccel only supports 4 or 8 children");
+    /**
+     * The parameters are same with BVHAccel, they decide how the binary tree is built before collapsing.
+    */
+    WideBVHAccel(std::vector<std::shared_ptr<Primitive>> ps, BVHAccel::SplitMethod sm = BVHAccel::SplitMethod::SAH, int maxPrimsInNode = 1, const BVHBuildOptions &options = BVHBuildOptions());
+    ~WideBVHAccel();
+    virtual bool Intersect(const Ray &ray, SurfaceInteraction &isect) const override;
+    virtual bool IntersectP(const Ray &ray) const override;
+    virtual Bounds3f WorldBound() const override;
+
+private:
+    /**
+     * Collapse the binary subtree rooted at bvh.nodes[index] into wide nodes, the interior child with the largest
+     * surface area is replaced by its two children until the node has N children. Return the index of the wide node.
+    */
+    int Collapse(const BVHAccel &bvh, int index, std::vector<WideBVHNode<N>> &wideNodes);
+
+    std::vector<std::shared_ptr<Primitive>> primitives; // Same with BVHAccel, the leaves reference a range of it
+    WideBVHNode<N> *nodes; // The wide nodes in depth first order, the first one is the root
+    int totalNodes;
+    Bounds3f bound; // The bound of all primitives
+
+    static PBRT_CONSTEXPR int STACK_SIZE = 64 * (N - 1); // Every level of the traversal pushes at most N - 1 children
+};
+
+typedef WideBVHAccel<4> QBVHAccel;
+typedef WideBVHAccel<8> OBVHAccel;
+
+} // namespace pbrt
+
+#endif // PBRT_SRC_ACCELERATORS_WIDEBVH_H_
@@ -0,0 +1,347 @@
+#include <algorithm>
+#include <bitset>
+#include <functional>
+
+#include "tests/pbrt_test.h"
+#include "accelerators/bvh.h"
+#include "material.h"
+#include "parallel.h"
+#include "scene.h"
+#include "shape/triangle.h"
+
+using namespace pbrt;
+
+/**
+ * The benchmarks of BVHAccel, they only print timings and are not run by ctest.
+ * The scenes and rays are generated with fixed seeds and every timing is the median of BENCH_REPEATS runs,
+ * so the numbers of two runs on the same machine can be compared.
+*/
+static const int BENCH_REPEATS = 7;
+static const int BENCH_RAYS = 200000;
+
+/**
+ * The same distribution with generateTestRays: from the origin toward the positive octant, but seeded.
+*/
+static void generateBenchRays(std::vector<Ray> &rays, int size, unsigned int seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<Float> dist(0, 1);
+    rays.reserve(rays.size() + size);
+    for(int i = 0; i < size; ++i)
+        rays.push_back(Ray(Point3f(0, 0, 0), Normalize(Vector3f(dist(rng), dist(rng), dist(rng)))));
+}
+
+/**
+ * Run the function BENCH_REPEATS times and print the median time in milliseconds.
+*/
+static double benchmark(const std::string &name, const std::function<void()> &run) {
+    std::vector<double> times;
+    for(int i = 0; i < BENCH_REPEATS; ++i) {
+        auto begin = std::chrono::high_resolution_clock::now();
+        run();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - begin;
+        times.push_back(elapsed.count());
+    }
+    std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+    double median = times[times.size() / 2];
+    LOG(INFO) << name << " took " << median << " ms(median of " << BENCH_REPEATS << " runs)";
+    return median;
+}
+
+static void traceClosest(const BVHAccel &bvh, const std::vector<Ray> &rays) {
+    int hits = 0;
+    for(const Ray &ray: rays) {
+        Ray r = ray;
+        SurfaceInteraction isect;
+        hits += bvh.Intersect(r, isect);
+    }
+    EXPECT_GT(hits, 0);
+}
+
+static void traceAny(const BVHAccel &bvh, const std::vector<Ray> &rays) {
+    int hits = 0;
+    for(const Ray &ray: rays)
+        hits += bvh.IntersectP(ray);
+    EXPECT_GT(hits, 0);
+}
+
+TEST(BVHAccelBench, TreeletOptimization) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 20000, 2);
+    std::vector<Ray> rays;
+    generateBenchRays(rays, BENCH_RAYS, 2);
+    BVHBuildOptions options;
+    options.treeletPasses = 2;
+    benchmark("Build with SAH", [&]() { BVHAccel(ps, BVHAccel::SplitMethod::SAH); });
+    benchmark("Build with SAH and treelet optimization", [&]() { BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options); });
+    benchmark("Build with HLBVH and treelet optimization", [&]() { BVHAccel(ps, BVHAccel::SplitMethod::HLBVH, 1, options); });
+    ParallelForLoopExecutor::Init(4);
+    benchmark("Build with SAH, treelet optimization and four threads", [&]() { BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options); });
+    ParallelForLoopExecutor::Clean();
+    BVHAccel sahBVH(ps, BVHAccel::SplitMethod::SAH), optimizedBVH(ps, BVHAccel::SplitMethod::SAH, 1, options);
+    benchmark("Intersect with SAH", [&]() { traceClosest(sahBVH, rays); });
+    benchmark("Intersect with SAH and treelet optimization", [&]() { traceClosest(optimizedBVH, rays); });
+}
+
+TEST(BVHAccelBench, Refit) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    std::shared_ptr<TriangleMesh> mesh = generateRandomTriangles(ps, 20000, 5);
+    std::vector<Ray> rays;
+    generateBenchRays(rays, BENCH_RAYS, 5);
+    BVHBuildOptions options;
+    options.refitRebuildThreshold = 0;
+    BVHAccel bvh(ps), refitOnlyBVH(ps, BVHAccel::SplitMethod::SAH, 1, options);
+    benchmark("Build BVH from scratch", [&]() { BVHAccel rebuilt(ps); });
+    for(int i = 0; i < mesh->nVertices; ++i) 
+        mesh->p[i] += Vector3f(0, 0.05 * std::sin(mesh->p[i].x * 3), 0);
+    benchmark("Refit BVH after a small wave", [&]() { bvh.Refit(); });
+
+    // The same scattering with the unit test, only the first run rebuilds the degraded subtrees
+    std::mt19937 rng(6);
+    std::uniform_real_distribution<Float> dist(-1.0, 1.0);
+    for(int i = 0; i < mesh->nTriangles / 4; ++i) {
+        Vector3f offset(dist(rng), dist(rng), dist(rng));
+        for(int j = 0; j < 3; ++j) 
+            mesh->p[mesh->vertexIndices[i * 3 + j]] += offset;
+    }
+    ParallelForLoopExecutor::Init(4);
+    benchmark("Refit BVH with four threads after scattering", [&]() { bvh.Refit(); });
+    ParallelForLoopExecutor::Clean();
+    refitOnlyBVH.Refit();
+    BVHAccel rebuiltBVH(ps);
+    benchmark("Intersect BVH rebuilt from scratch", [&]() { traceClosest(rebuiltBVH, rays); });
+    benchmark("Intersect BVH refitted with subtree rebuilding", [&]() { traceClosest(bvh, rays); });
+    benchmark("Intersect BVH refitted only", [&]() { traceClosest(refitOnlyBVH, rays); });
+}
+
+TEST(BVHAccelBench, Layouts) {
+    std::vector<std::shared_ptr<Primitive>> plane;
+    if(!Scene::loadModel(plane, "../resource/plane/plane.obj")) {
+        LOG(WARNING) << "../resource/plane/plane.obj is not found, the layouts are not benchmarked";
+        return;
+    }
+    std::vector<Ray> rays, trainingRays;
+    generateBenchRays(rays, BENCH_RAYS, 7);
+    generateBenchRays(trainingRays, BENCH_RAYS / 10, 8); // HotFirst counts the visits of other rays
+    const BVHLayout layouts[] = {BVHLayout::DepthFirst, BVHLayout::VanEmdeBoas, BVHLayout::CacheLineTreelets, BVHLayout::PageTreelets, BVHLayout::HotFirst};
+    const char *names[] = {"DepthFirst", "VanEmdeBoas", "CacheLineTreelets", "PageTreelets", "HotFirst"};
+    CacheMissCounter counter;
+    if(!counter.available()) LOG(INFO) << "Cache miss counters are not available, only the times are reported";
+    for(int k = 0; k < 5; ++k) {
+        BVHBuildOptions options;
+        options.layout = layouts[k];
+        BVHAccel planeBVH(plane, BVHAccel::SplitMethod::SAH, 1, options);
+        if(layouts[k] == BVHLayout::HotFirst) planeBVH.Relayout(BVHLayout::HotFirst, trainingRays);
+        double ms = benchmark(std::string("Intersect plane.obj with the layout ") + names[k], [&]() { traceClosest(planeBVH, rays); });
+        counter.start();
+        traceClosest(planeBVH, rays);
+        counter.stop();
+        LOG(INFO) << "Layout " << names[k] << ": " << rays.size() / ms * 1000 << " rays/s, L1 misses: " << counter.l1Misses() 
+                  << ", last level cache misses: " << counter.lastLevelMisses();
+    }
+}
+
+TEST(BVHAccelBench, PackedTriangles) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 100000, 11);
+    std::vector<Ray> rays;
+    generateBenchRays(rays, BENCH_RAYS, 11);
+    BVHBuildOptions unpacked;
+    unpacked.packTriangles = false;
+    BVHAccel packedBVH(ps), unpackedBVH(ps, BVHAccel::SplitMethod::SAH, 1, unpacked);
+    benchmark("Intersect with virtual triangle tests", [&]() { traceClosest(unpackedBVH, rays); });
+    benchmark("Intersect with packed triangles", [&]() { traceClosest(packedBVH, rays); });
+    benchmark("IntersectP with virtual triangle tests", [&]() { traceAny(unpackedBVH, rays); });
+    benchmark("IntersectP with packed triangles", [&]() { traceAny(packedBVH, rays); });
+}
+
+TEST(BVHAccelBench, ShortStack) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 20000, 12);
+    std::vector<Ray> rays;
+    generateBenchRays(rays, BENCH_RAYS, 1);
+    BVHBuildOptions options;
+    options.shortStackTraversal = true;
+    BVHAccel stackBVH(ps), shortStackBVH(ps, BVHAccel::SplitMethod::SAH, 1, options);
+    benchmark("Intersect with the full stack", [&]() { traceClosest(stackBVH, rays); });
+    benchmark("Intersect with the short stack", [&]() { traceClosest(shortStackBVH, rays); });
+    benchmark("IntersectP with the full stack", [&]() { traceAny(stackBVH, rays); });
+    benchmark("IntersectP with the short stack", [&]() { traceAny(shortStackBVH, rays); });
+}
+
+TEST(BVHAccelBench, PreSplit) {
+    std::vector<std::shared_ptr<Primitive>> plane;
+    if(!Scene::loadModel(plane, "../resource/plane/plane.obj")) return;
+    std::vector<Ray> rays;
+    generateBenchRays(rays, BENCH_RAYS, 2);
+    BVHBuildOptions options;
+    options.preSplitBudget = 0.5;
+    benchmark("Build plane.obj with SAH", [&]() { BVHAccel(plane, BVHAccel::SplitMethod::SAH); });
+    benchmark("Build plane.obj with SAH and pre-split", [&]() { BVHAccel(plane, BVHAccel::SplitMethod::SAH, 1, options); });
+    BVHAccel sahBVH(plane, BVHAccel::SplitMethod::SAH), presplitBVH(plane, BVHAccel::SplitMethod::SAH, 1, options);
+    benchmark("Intersect plane.obj with SAH", [&]() { traceClosest(sahBVH, rays); });
+    benchmark("Intersect plane.obj with SAH and pre-split", [&]() { traceClosest(presplitBVH, rays); });
+}
+
+TEST(BVHAccelBench, LazyBuild) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 200000, 14);
+    BVHBuildOptions options;
+    options.lazyBuild = true;
+    options.lazySubtreeSize = 1024;
+    benchmark("Build the whole BVH", [&]() { BVHAccel(ps, BVHAccel::SplitMethod::SAH); });
+    benchmark("Build the upper levels of the lazy BVH", [&]() { BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options); });
+
+    // A narrow cone of rays only reaches a few subtrees, each run starts from a new lazy BVH so it includes building them
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<Float> dist(0, 0.01);
+    std::vector<Ray> cone;
+    for(int i = 0; i < 10000; ++i) 
+        cone.push_back(Ray(Point3f(0, 0, 0), Normalize(Vector3f(1, dist(rng), dist(rng)))));
+    benchmark("Build the lazy BVH and trace a cone of rays", [&]() { traceClosest(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options), cone); });
+    BVHAccel fullBVH(ps, BVHAccel::SplitMethod::SAH);
+    benchmark("Trace a cone of rays with the whole BVH", [&]() { traceClosest(fullBVH, cone); });
+}
+
+/**
+ * The rays of a pinhole camera at (0, 0, -3) looking at the origin, in blocks of 4x4 pixels so every 16 rays are coherent.
+*/
+static void generateCameraRays(std::vector<Ray> &rays, int resolution) {
+    for(int by = 0; by < resolution; by += 4)
+        for(int bx = 0; bx < resolution; bx += 4)
+            for(int y = by; y < by + 4; ++y)
+                for(int x = bx; x < bx + 4; ++x) {
+                    Vector3f d((x + 0.5f) / resolution - 0.5f, (y + 0.5f) / resolution - 0.5f, 1);
+                    rays.push_back(Ray(Point3f(0, 0, -3), Normalize(d)));
+                }
+}
+
+template <int N>
+static void tracePackets(const BVHAccel &bvh, const std::vector<Ray> &rays) {
+    int hits = 0;
+    for(size_t i = 0; i < rays.size(); i += N) {
+        RayPacket<N> packet;
+        std::copy(rays.begin() + i, rays.begin() + i + N, packet.rays);
+        HitPacket<N> hitPacket;
+        bvh.IntersectPacket(packet, hitPacket);
+        hits += std::bitset<N>(hitPacket.mask).count();
+    }
+    EXPECT_GT(hits, 0);
+}
+
+template <int N>
+static void tracePPackets(const BVHAccel &bvh, const std::vector<Ray> &rays) {
+    int hits = 0;
+    for(size_t i = 0; i < rays.size(); i += N) {
+        RayPacket<N> packet;
+        std::copy(rays.begin() + i, rays.begin() + i + N, packet.rays);
+        hits += std::bitset<N>(bvh.IntersectPPacket(packet)).count();
+    }
+    EXPECT_GT(hits, 0);
+}
+
+TEST(BVHAccelBench, PacketTraversal) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000, 21);
+    std::vector<Ray> rays;
+    generateCameraRays(rays, 512);
+    BVHAccel bvh(ps, BVHAccel::SplitMethod::SAH, 4);
+    benchmark("Intersect 512x512 camera rays one by one", [&]() { traceClosest(bvh, rays); });
+    benchmark("Intersect 512x512 camera rays in packets of 4", [&]() { tracePackets<4>(bvh, rays); });
+    benchmark("Intersect 512x512 camera rays in packets of 8", [&]() { tracePackets<8>(bvh, rays); });
+    benchmark("Intersect 512x512 camera rays in packets of 16", [&]() { tracePackets<16>(bvh, rays); });
+    benchmark("IntersectP 512x512 camera rays one by one", [&]() { traceAny(bvh, rays); });
+    benchmark("IntersectP 512x512 camera rays in packets of 16", [&]() { tracePPackets<16>(bvh, rays); });
+}
+
+TEST(BVHAccelBench, RayStream) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000, 22);
+    BVHAccel bvh(ps, BVHAccel::SplitMethod::SAH, 4);
+    std::vector<Ray> cameraRays;
+    generateCameraRays(cameraRays, 256);
+
+    // Ambient occlusion rays from the camera hits in random directions and in random order
+    std::mt19937 rng(22);
+    std::uniform_real_distribution<Float> dist(-1, 1);
+    std::vector<Ray> rays;
+    for(const Ray &ray: cameraRays) {
+        SurfaceInteraction isect;
+        if(!bvh.Intersect(ray, isect)) continue;
+        for(int i = 0; i < 4; ++i) {
+            Vector3f d(dist(rng), dist(rng), dist(rng));
+            if(d.LengthSquared() < 1e-4) d = Vector3f(1, 0, 0);
+            rays.push_back(Ray(isect.p + Normalize(d) * 1e-3, Normalize(d)));
+        }
+    }
+    std::shuffle(rays.begin(), rays.end(), rng);
+    LOG(INFO) << rays.size() << " ambient occlusion rays";
+    std::vector<SurfaceInteraction> isects;
+    std::vector<uint8_t> hits;
+    benchmark("Intersect the rays as a stream", [&]() {
+        std::vector<Ray> streamRays = rays;
+        bvh.IntersectStream(streamRays, isects, hits);
+    });
+    benchmark("Intersect the rays one by one", [&]() { traceClosest(bvh, rays); });
+    benchmark("IntersectP the rays as a stream", [&]() { bvh.IntersectPStream(rays, hits); });
+    benchmark("IntersectP the rays one by one", [&]() { traceAny(bvh, rays); });
+}
+
+TEST(BVHAccelBench, DeferredHitRecord) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000, 23, 0.2); // large overlapping triangles, a ray finds many hits before the closest one
+    std::vector<Ray> rays;
+    generateCameraRays(rays, 256);
+    BVHBuildOptions options;
+    options.packTriangles = false; // every hit builds an interaction in Triangle::Intersection
+    BVHAccel bvh(ps, BVHAccel::SplitMethod::SAH, 4), unpackedBVH(ps, BVHAccel::SplitMethod::SAH, 4, options);
+    benchmark("Trace with an interaction for every hit", [&]() { traceClosest(unpackedBVH, rays); });
+    benchmark("Trace with deferred hit records", [&]() { traceClosest(bvh, rays); });
+}
+
+TEST(BVHAccelBench, DistanceOrdered) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000, 24);
+    // The same wall in front of the triangles with the unit test, the distance order culls the nodes behind it
+    std::vector<int> idxs = {0, 1, 2, 0, 2, 3};
+    std::vector<Point3f> p = {Point3f(-3, -3, -1.5), Point3f(3, -3, -1.5), Point3f(3, 3, -1.5), Point3f(-3, 3, -1.5)};
+    std::vector<Normal3f> n(4);
+    std::shared_ptr<TriangleMesh> wall = std::make_shared<TriangleMesh>(2, 4, idxs, p, n);
+    for(int i = 0; i < 2; ++i) 
+        ps.push_back(std::make_shared<GeometicPrimitive>(std::make_shared<Triangle>(wall, i), nullptr));
+    std::vector<Ray> cameraRays, rays;
+    generateCameraRays(cameraRays, 512);
+    generateBenchRays(rays, BENCH_RAYS, 24);
+    BVHBuildOptions options;
+    options.distanceOrderedTraversal = true;
+    BVHAccel bvh(ps, BVHAccel::SplitMethod::SAH, 4), orderedBVH(ps, BVHAccel::SplitMethod::SAH, 4, options);
+    benchmark("Intersect occluded camera rays with the split axis order", [&]() { traceClosest(bvh, cameraRays); });
+    benchmark("Intersect occluded camera rays with the distance order", [&]() { traceClosest(orderedBVH, cameraRays); });
+    benchmark("Intersect rays from the center with the split axis order", [&]() { traceClosest(bvh, rays); });
+    benchmark("Intersect rays from the center with the distance order", [&]() { traceClosest(orderedBVH, rays); });
+}
+
+TEST(BVHAccelBench, TraversalKernels) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000, 25);
+    std::vector<Ray> rays;
+    generateBenchRays(rays, BENCH_RAYS, 25);
+    BVHBuildOptions shortStackOptions, compressedOptions;
+    shortStackOptions.shortStackTraversal = true;
+    compressedOptions.compressNodes = true;
+    BVHAccel bvh(ps, BVHAccel::SplitMethod::SAH, 4), shortStackBVH(ps, BVHAccel::SplitMethod::SAH, 4, shortStackOptions);
+    BVHAccel compressedBVH(ps, BVHAccel::SplitMethod::SAH, 4, compressedOptions);
+    benchmark("Intersect with the octant kernel", [&]() { traceClosest(bvh, rays); });
+    benchmark("IntersectP with the octant kernel", [&]() { traceAny(bvh, rays); });
+    auto traceAll = [&](const BVHAccel &accel) {
+        int hits = 0;
+        std::vector<SurfaceInteraction> isects;
+        for(const Ray &ray: rays) {
+            isects.clear();
+            hits += accel.IntersectAll(ray, isects);
+        }
+        EXPECT_GT(hits, 0);
+    };
+    benchmark("IntersectAll with the octant kernel", [&]() { traceAll(bvh); });
+    benchmark("IntersectAll with the short stack", [&]() { traceAll(shortStackBVH); });
+    benchmark("IntersectAll with the compressed nodes", [&]() { traceAll(compressedBVH); });
+}
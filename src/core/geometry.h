@@ -707,6 +707,7 @@ public:
     }
     inline bool IntersectP(const Ray &ray, Float &hitt0, Float &hitt1) const;
     inline bool IntersectP(const Ray &ray, const Vector3f &invDir, const int dirIsNeg[3]) const;
+    inline bool IntersectP(const Ray &ray, const Vector3f &invDir, const int dirIsNeg[3], Float &tEntry) const; // Also output the entry distance, it may be negative if the origin is inside
     friend std::ostream &operator<<(std::ostream &os, const Bounds3<T> &b) {
         os << "[" << b.pMin << "-" << b.pMax << "]";
         return os;
@@ -1218,12 +1219,18 @@ inline bool Bounds3<T>::IntersectP(const Ray &ray, Float &hitt0, Float &hitt1) c
 
 template <typename T>
 inline bool Bounds3<T>::IntersectP(const Ray &ray, const Vector3f &invDir, const int dirIsNeg[3]) const {
-    const Bounds3f &bounds = *this;
+    Float tEntry;
+    return IntersectP(ray, invDir, dirIsNeg, tEntry);
+}
+
+template <typename T>
+inline bool Bounds3<T>::IntersectP(const Ray &ray, const Vector3f &invDir, const int dirIsNeg[3], Float &tEntry) const {
+    const Bounds3f &bounds = *this; // the planes are selected without operator[], so a constant dirIsNeg is folded by the compiler
     // Check for ray intersection against $x$ and $y$ slabs
-    Float tMin = (bounds[dirIsNeg[0]].x - ray.o.x) * invDir.x;
-    Float tMax = (bounds[1 - dirIsNeg[0]].x - ray.o.x) * invDir.x;
-    Float tyMin = (bounds[dirIsNeg[1]].y - ray.o.y) * invDir.y;
-    Float tyMax = (bounds[1 - dirIsNeg[1]].y - ray.o.y) * invDir.y;
+    Float tMin = ((dirIsNeg[0] ? bounds.pMax : bounds.pMin).x - ray.o.x) * invDir.x;
+    Float tMax = ((dirIsNeg[0] ? bounds.pMin : bounds.pMax).x - ray.o.x) * invDir.x;
+    Float tyMin = ((dirIsNeg[1] ? bounds.pMax : bounds.pMin).y - ray.o.y) * invDir.y;
+    Float tyMax = ((dirIsNeg[1] ? bounds.pMin : bounds.pMax).y - ray.o.y) * invDir.y;
 
     // Update _tMax_ and _tyMax_ to ensure robust bounds intersection
     tMax *= 1 + 2 * gamma(3);
@@ -1233,14 +1240,15 @@ inline bool Bounds3<T>::IntersectP(const Ray &ray, const Vector3f &invDir, const
     if (tyMax < tMax) tMax = tyMax;
 
     // Check for ray intersection against $z$ slab
-    Float tzMin = (bounds[dirIsNeg[2]].z - ray.o.z) * invDir.z;
-    Float tzMax = (bounds[1 - dirIsNeg[2]].z - ray.o.z) * invDir.z;
+    Float tzMin = ((dirIsNeg[2] ? bounds.pMax : bounds.pMin).z - ray.o.z) * invDir.z;
+    Float tzMax = ((dirIsNeg[2] ? bounds.pMin : bounds.pMax).z - ray.o.z) * invDir.z;
 
     // Update _tzMax_ to ensure robust bounds intersection
     tzMax *= 1 + 2 * gamma(3);
     if (tMin > tzMax || tzMin > tMax) return false;
     if (tzMin > tMin) tMin = tzMin;
     if (tzMax < tMax) tMax = tzMax;
+    tEntry = tMin;
     return (tMin < ray.tMax) && (tMax > 0);
 }
 
@@ -15,4 +15,13 @@ void *AllocAligned(size_t size) {
 #endif
 }
 
+void FreeAligned(void *ptr) {
+    if(!ptr) return;
+#if defined(PBRT_HAVE__ALIGNED_MALLOC)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
 } // namespace pbrt
\ No newline at end of file
@@ -6,6 +6,9 @@
 #ifndef PBRT_SRC_CORE_MEMORY_H_
 #define PBRT_SRC_CORE_MEMORY_H_
 
+#include <list>
+#include <cstddef>
+
 #include "pbrt.h"
 
 namespace pbrt {
@@ -16,6 +19,94 @@ T *AllocAligned(size_t count) {
     return (T *)AllocAligned(count * sizeof(T));
 }
 
+void FreeAligned(void *ptr);
+
+/**
+ * A bump allocator, it allocates memory from big blocks by moving an offset forward.
+ * There is no way to free a single object, all memory is released together when calling Reset or destroying the arena.
+ * Objects allocated in the arena won't be destructed, so only use it for objects which don't own resources.
+ * It isn't thread safe, each thread should use its own arena.
+*/
+class alignas(PBRT_L1_CACHE_LINE_SIZE) MemoryArena {
+public:
+    MemoryArena(size_t blockSize = 262144): blockSize(blockSize) {}
+    MemoryArena(const MemoryArena &) = delete;
+    MemoryArena &operator=(const MemoryArena &) = delete;
+    ~MemoryArena() {
+        FreeAligned(currentBlock);
+        for(auto &block: usedBlocks) FreeAligned(block.second);
+        for(auto &block: availableBlocks) FreeAligned(block.second);
+    }
+
+    /**
+     * Allocate nBytes memory, the memory is aligned with alignof(std::max_align_t).
+    */
+    void *Alloc(size_t nBytes) {
+        const int align = alignof(std::max_align_t);
+        nBytes = (nBytes + align - 1) & ~(align - 1);
+        if(currentBlockPos + nBytes > currentAllocSize) { // current block is full, find a new block
+            if(currentBlock) {
+                usedBlocks.push_back(std::make_pair(currentAllocSize, currentBlock));
+                currentBlock = nullptr;
+                currentAllocSize = 0;
+            }
+            for(auto iter = availableBlocks.begin(); iter != availableBlocks.end(); ++iter) { // try to reuse a block which is released by Reset
+                if(iter->first >= nBytes) {
+                    currentAllocSize = iter->first;
+                    currentBlock = iter->second;
+                    availableBlocks.erase(iter);
+                    break;
+                }
+            }
+            if(!currentBlock) {
+                currentAllocSize = std::max(nBytes, blockSize);
+                currentBlock = AllocAligned<uint8_t>(currentAllocSize);
+            }
+            currentBlockPos = 0;
+        }
+        void *ret = currentBlock + currentBlockPos;
+        currentBlockPos += nBytes;
+        return ret;
+    }
+
+    /**
+     * Allocate an array of n objects of T.
+     * @param runConstructor If it is true, the default constructor of T will be called for each object.
+    */
+    template <typename T>
+    T *Alloc(size_t n = 1, bool runConstructor = true) {
+        T *ret = (T *)Alloc(n * sizeof(T));
+        if(runConstructor)
+            for(size_t i = 0; i < n; ++i) new (&ret[i]) T();
+        return ret;
+    }
+
+    /**
+     * Release all allocated memory, the blocks are kept to be reused by next allocations.
+    */
+    void Reset() {
+        currentBlockPos = 0;
+        availableBlocks.splice(availableBlocks.begin(), usedBlocks);
+    }
+
+    /**
+     * Get the total size of all blocks the arena holds.
+    */
+    size_t TotalAllocated() const {
+        size_t total = currentAllocSize;
+        for(const auto &alloc: usedBlocks) total += alloc.first;
+        for(const auto &alloc: availableBlocks) total += alloc.first;
+        return total;
+    }
+
+private:
+    const size_t blockSize; // The default size of each block
+    size_t currentBlockPos = 0; // The offset of next allocation in current block
+    size_t currentAllocSize = 0; // The size of current block
+    uint8_t *currentBlock = nullptr; // The block the allocation happens
+    std::list<std::pair<size_t, uint8_t *>> usedBlocks, availableBlocks; // Full blocks and blocks released by Reset, the first value is block size
+};
+
 } // namespace pbrt
 
-#endif // PBRT_SRC_CORE_MEMORY_H_
\ No newline at end of file
+#endif // PBRT_SRC_CORE_MEMORY_H_
@@ -2,6 +2,8 @@
 
 namespace pbrt {
 
+PBRT_THREAD_LOCAL int ThreadIndex = 0;
+
 int ParallelForLoopExecutor::nThreads = 0;
 std::vector<std::thread> ParallelForLoopExecutor::threads;
 ParallelForLoopTask* ParallelForLoopExecutor::tasks = nullptr;
@@ -32,6 +34,7 @@ void ParallelForLoopExecutor::Init(std::optional<int> maxAvailableThreads) {
 
 void ParallelForLoopExecutor::WorkerThreadFunc(int index, std::shared_ptr<Barrier> barrier) {
     LOG(INFO) << "Start execute worker thread: " << index;
+    ThreadIndex = index;
     // do something pre-process here
     barrier->Wait();
     barrier.reset(); // release barrier
@@ -190,6 +193,7 @@ void ParallelForLoopExecutor::Clean() {
     
     threads.erase(threads.begin(), threads.end());
     isShutdownThreads = false;
+    nThreads = 0;
 }
 
 void ParallelForLoopExecutor::ReportThreadStats() {
@@ -19,6 +19,12 @@
 
 namespace pbrt {
 
+/**
+ * The index of current thread in ParallelForLoopExecutor, the main thread is 0 and worker threads are from 1 to NumThreads() - 1.
+ * It can be used to pick per-thread data without any lock.
+*/
+extern PBRT_THREAD_LOCAL int ThreadIndex;
+
 class AtomicFloat {
 public:
     explicit AtomicFloat(Float v) { bits = FloatToBits(v); }
@@ -141,6 +147,12 @@ public:
     static void ParallelFor1D(std::function<void(int64_t)> func, int64_t count, int chunkSize);
 
     
+    /**
+     * Get the amount of threads which will execute the parallel for loop, including the main thread.
+     * If the executor has not been initialized, it will return 0.
+    */
+    static int NumThreads() { return nThreads; }
+
     static void MergeWorkerThreadStats();
 
     static void PrintStats(FILE *dest);
@@ -176,6 +176,16 @@ inline double NextFloatDown(double v, int delta = 1) { // Bumping a floating-poi
     return BitsToFloat(ui);
 }
 
+inline float RoundDownToFloat(Float v) { // Convert v to the greatest float which is not greater than v
+    float f = v;
+    return f > v ? NextFloatDown(f) : f;
+}
+
+inline float RoundUpToFloat(Float v) { // Convert v to the smallest float which is not less than v
+    float f = v;
+    return f < v ? NextFloatUp(f) : f;
+}
+
 inline Float Radians(Float deg) { return (Pi / 180) * deg; }
 
 inline Float Degrees(Float rad) { return (180 / Pi) * rad; }
@@ -22,5 +22,36 @@ Bounds3f GeometicPrimitive::WorldBound() const {
     return shape->WorldBound();
 }
 
+Bounds3f GeometicPrimitive::ClippedWorldBound(const Bounds3f &clip) const {
+    return shape->ClippedBound(clip);
+}
+
+bool GeometicPrimitive::TriangleVertices(Point3f p[3]) const {
+    return shape->TriangleVertices(p);
+}
+
+void GeometicPrimitive::FinishDeferredHit(const Ray &ray, SurfaceInteraction &isect) const {
+    isect = shape->DeferredInteraction(ray, ray.tMax);
+    isect.primitive = this;
+}
+
+bool TransformedPrimitive::Intersect(const Ray &ray, SurfaceInteraction &isect) const {
+    Ray r = worldToPrimitive(ray); // the direction is not normalized, so t is same in both spaces
+    SurfaceInteraction localIsect;
+    if(!primitive->Intersect(r, localIsect)) return false;
+    ray.tMax = r.tMax;
+    isect = primitiveToWorld(localIsect);
+    isect.shape = localIsect.shape;
+    isect.primitive = localIsect.primitive;
+    return true;
+}
+
+bool TransformedPrimitive::IntersectP(const Ray &ray) const {
+    return primitive->IntersectP(worldToPrimitive(ray));
+}
+
+Bounds3f TransformedPrimitive::WorldBound() const {
+    return primitiveToWorld(primitive->WorldBound());
+}
 
 } // namespace pbrt
\ No newline at end of file
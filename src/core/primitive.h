@@ -10,6 +10,7 @@
 #include "geometry.h"
 #include "interaction.h"
 #include "shape.h"
+#include "transform.h"
 
 namespace pbrt {
 
@@ -43,6 +44,30 @@ public:
      * Get the world bound of the primitive
     */
     virtual Bounds3f WorldBound() const = 0;
+
+    /**
+     * Get the world bound of the part of the primitive which is inside the clip box.
+     * It is used by the spatial splits of BVH, which split a primitive into several references.
+    */
+    virtual Bounds3f ClippedWorldBound(const Bounds3f &clip) const {
+        return pbrt::Intersect(WorldBound(), clip);
+    }
+
+    /**
+     * Get the vertices if the primitive is a triangle, see Shape::TriangleVertices.
+     * An accelerator records a hit on them and calls FinishDeferredHit for the closest one instead of calling Intersect.
+    */
+    virtual bool TriangleVertices(Point3f /*p*/[3]) const {
+        return false;
+    }
+
+    /**
+     * Fill the interaction of a hit found on the vertices of TriangleVertices, the ray.tMax has been updated to the distance of the hit.
+     * The result is same with the one Intersect would output for the hit.
+    */
+    virtual void FinishDeferredHit(const Ray &/*ray*/, SurfaceInteraction &/*isect*/) const {
+        LOG(FATAL) << "Only the primitives which output TriangleVertices have a deferred hit";
+    }
 };
 
 class GeometicPrimitive: public Primitive {
@@ -52,11 +77,41 @@ public:
     virtual bool IntersectP(const Ray &ray) const override;
     virtual std::shared_ptr<Material> GetMaterial() const override;
     virtual Bounds3f WorldBound() const override;
+    virtual Bounds3f ClippedWorldBound(const Bounds3f &clip) const override;
+    virtual bool TriangleVertices(Point3f p[3]) const override;
+    virtual void FinishDeferredHit(const Ray &ray, SurfaceInteraction &isect) const override;
+    const std::shared_ptr<Shape> &GetShape() const { return shape; }
 private:
     std::shared_ptr<Shape> shape;
     std::shared_ptr<Material> material;
 };
 
+/**
+ * An instance of a primitive placed in the world by a transform, the primitive is usually a BVHAccel over a mesh
+ * in its object space(bottom level), so many instances share one mesh and one BVH. The instances are put into
+ * another BVHAccel(top level). The ray is transformed into the object space of the primitive when it is tested,
+ * and the hit point is transformed back to the world space.
+*/
+class TransformedPrimitive: public Primitive {
+public:
+    TransformedPrimitive(const std::shared_ptr<Primitive> &primitive, const Transform &primitiveToWorld)
+        : primitive(primitive), primitiveToWorld(primitiveToWorld), worldToPrimitive(Inverse(primitiveToWorld)) {}
+    virtual bool Intersect(const Ray &ray, SurfaceInteraction &isect) const override;
+    virtual bool IntersectP(const Ray &ray) const override;
+    
+    /**
+     * The material of the wrapped primitive. If it is an aggregate, get the material from the primitive recorded by the hit instead.
+    */
+    virtual std::shared_ptr<Material> GetMaterial() const override {
+        return primitive->GetMaterial();
+    }
+    virtual Bounds3f WorldBound() const override;
+private:
+    std::shared_ptr<Primitive> primitive;
+    const Transform primitiveToWorld;
+    const Transform worldToPrimitive;
+};
+
 /**
  * A aggregate class for accelerator. An accelerator can inherit this basic class
  * then we can see it as a primivite in the scene. Why call this `Aggregate` becase it
@@ -8,6 +8,7 @@
 namespace pbrt {
 
 std::map<std::string, std::vector<std::shared_ptr<Primitive>>> Scene::PSCache;
+std::map<std::string, std::shared_ptr<BVHAccel>> Scene::BVHCache;
 bool Scene::loadModel(std::vector<std::shared_ptr<Primitive>> &ps, const std::string& path) {
     ps.clear();
     if(PSCache.find(path) != PSCache.end()) {
@@ -52,4 +53,20 @@ bool Scene::loadModel(std::vector<std::shared_ptr<Primitive>> &ps, const std::st
     return true;
 }
 
+bool Scene::loadInstances(std::vector<std::shared_ptr<Primitive>> &instances, const std::string &path, const std::vector<Transform> &transforms, const BVHBuildOptions &options) {
+    std::shared_ptr<BVHAccel> bvh;
+    if(BVHCache.find(path) != BVHCache.end()) {
+        bvh = BVHCache[path];
+    } else {
+        std::vector<std::shared_ptr<Primitive>> ps;
+        if(!loadModel(ps, path)) return false;
+        bvh = std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH, 1, options);
+        BVHCache.insert({path, bvh});
+    }
+    instances.reserve(instances.size() + transforms.size());
+    for(const Transform &t: transforms) 
+        instances.push_back(std::make_shared<TransformedPrimitive>(bvh, t));
+    return true;
+}
+
 } // namespace pbrt
\ No newline at end of file
@@ -18,17 +18,31 @@ namespace pbrt {
 
 class Scene {
 public:
-    Scene(const std::string &modelPath, const std::vector<std::shared_ptr<Light>> &lights)
+    Scene(const std::string &modelPath, const std::vector<std::shared_ptr<Light>> &lights, const BVHBuildOptions &options = BVHBuildOptions())
         :modelPath(modelPath), lights(lights) {
             std::vector<std::shared_ptr<Primitive>> ps;
             bool r = loadModel(ps, modelPath);
             if(!r) {
                 LOG(FATAL) << "load model failure from path: " << modelPath;
             }
-            accel = std::make_shared<BVHAccel>(ps);
+            accel = std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH, 1, options);
+    }
+    /**
+     * Build the scene from primitives directly, e.g. the instances created by loadInstances, they are put into the top level BVH.
+    */
+    Scene(const std::vector<std::shared_ptr<Primitive>> &primitives, const std::vector<std::shared_ptr<Light>> &lights, const BVHBuildOptions &options = BVHBuildOptions())
+        :lights(lights) {
+            accel = std::make_shared<BVHAccel>(primitives, BVHAccel::SplitMethod::SAH, 1, options);
     }
     static bool loadModel(std::vector<std::shared_ptr<Primitive>> &ps, const std::string& path);
+
+    /**
+     * Load the model and build its BVH in the object space once, then append an instance for each transform into instances.
+     * All instances share the mesh and the BVH, so the memory doesn't grow with the amount of instances.
+    */
+    static bool loadInstances(std::vector<std::shared_ptr<Primitive>> &instances, const std::string &path, const std::vector<Transform> &transforms, const BVHBuildOptions &options = BVHBuildOptions());
     static std::map<std::string, std::vector<std::shared_ptr<Primitive>>> PSCache;
+    static std::map<std::string, std::shared_ptr<BVHAccel>> BVHCache; // The object space BVH of each model used by instances
 
     const std::string modelPath;
     std::vector<std::shared_ptr<Light>> lights;
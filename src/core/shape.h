@@ -54,6 +54,35 @@ public:
      * @return The world bould of the shape
     */
     virtual Bounds3f WorldBound() const = 0;
+
+    /**
+     * Get the bound of the part of the shape which is inside the clip box.
+     * The default implementation just intersects the world bound with the clip box, shapes can override it to get a tighter bound.
+     * @param clip The clip box
+     * @return The bound of the clipped shape, if nothing left, return an empty bound
+    */
+    virtual Bounds3f ClippedBound(const Bounds3f &clip) const {
+        return pbrt::Intersect(WorldBound(), clip);
+    }
+
+    /**
+     * Get the vertices if the shape is a triangle which is tested by IntersectTriangle, so an accelerator can test its own packed copy
+     * of the vertices and only build the interaction of the closest hit by DeferredInteraction.
+     * @param p Output the three vertices
+     * @return If the shape is such a triangle, return true, otherwise return false
+    */
+    virtual bool TriangleVertices(Point3f /*p*/[3]) const {
+        return false;
+    }
+
+    /**
+     * Build the interaction of a hit found by IntersectTriangle on the vertices of TriangleVertices, it is same with the one Intersection builds.
+     * @param tHit The distance of the hit point
+    */
+    virtual SurfaceInteraction DeferredInteraction(const Ray &/*ray*/, Float /*tHit*/) const {
+        LOG(FATAL) << "Only the shapes which output TriangleVertices have a deferred interaction";
+        return SurfaceInteraction();
+    }
 };
 
 } // namespace pbrt
@@ -49,6 +49,22 @@ void StatsAccumulator::Print(FILE *dest) {
             }
         }
     }
+    for (auto &distrib : intDistributions) {
+        std::string category, title;
+        getCategoryAndTitle(distrib.first, &category, &title);
+        double avg = (double)distrib.second.sum / (double)distrib.second.count;
+        toPrint[category].push_back(StringPrintf(
+            "%-42s                      %.3f avg [range %" PRId64 " - %" PRId64 "]", title.c_str(), avg,
+            distrib.second.min, distrib.second.max));
+    }
+    for (auto &distrib : floatDistributions) {
+        std::string category, title;
+        getCategoryAndTitle(distrib.first, &category, &title);
+        double avg = distrib.second.sum / (double)distrib.second.count;
+        toPrint[category].push_back(StringPrintf(
+            "%-42s                      %.3f avg [range %f - %f]", title.c_str(), avg,
+            distrib.second.min, distrib.second.max));
+    }
     for (auto &categories : toPrint) {
         fprintf(dest, "  %s\n", categories.first.c_str());
         for (auto &item : categories.second)
@@ -59,6 +75,8 @@ void StatsAccumulator::Print(FILE *dest) {
 void StatsAccumulator::Clear() {
     counters.clear();
     memoryCounters.clear();
+    intDistributions.clear();
+    floatDistributions.clear();
 }
 
 } // namespace pbrt
\ No newline at end of file
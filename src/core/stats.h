@@ -10,6 +10,8 @@
 
 #include <map>
 #include <functional>
+#include <limits>
+#include <algorithm>
 
 #include "pbrt.h"
 
@@ -57,12 +59,39 @@ public:
     void ReportMemoryCounter(const std::string &name, int64_t val) {
         memoryCounters[name] += val;
     }
+    void ReportIntDistribution(const std::string &name, int64_t sum, int64_t count, int64_t min, int64_t max) {
+        if(count == 0) return;
+        intDistributions[name].Merge(sum, count, min, max);
+    }
+    void ReportFloatDistribution(const std::string &name, double sum, int64_t count, double min, double max) {
+        if(count == 0) return;
+        floatDistributions[name].Merge(sum, count, min, max);
+    }
     void Print(FILE *dest);
     void Clear();
 
 private:
     std::map<std::string, int64_t> counters; // A counter to stat amout with name. The key represent name, the value represent amount
     std::map<std::string, int64_t> memoryCounters; // A memory counter to stat memory size by name
+
+    /**
+     * The summary of a distribution, the values are not kept, only the average and the range are printed.
+    */
+    template <typename T>
+    struct Distribution {
+        T sum = 0;
+        int64_t count = 0;
+        T min = std::numeric_limits<T>::max();
+        T max = std::numeric_limits<T>::lowest();
+        void Merge(T s, int64_t c, T mn, T mx) {
+            sum += s;
+            count += c;
+            min = std::min(min, mn);
+            max = std::max(max, mx);
+        }
+    };
+    std::map<std::string, Distribution<int64_t>> intDistributions;
+    std::map<std::string, Distribution<double>> floatDistributions;
 };
 
 #define STAT_COUNTER(title, var) \
@@ -81,6 +110,46 @@ private:
     } \
     static StatRegisterer STATS_REG##var(STATS_FUNC##var)
 
+/**
+ * A distribution of values, e.g. the depth of every leaf. Add a value with ReportValue(var, value),
+ * the average, the minimum and the maximum are printed.
+*/
+#define STAT_INT_DISTRIBUTION(title, var) \
+    static PBRT_THREAD_LOCAL int64_t var##sum = 0; \
+    static PBRT_THREAD_LOCAL int64_t var##count = 0; \
+    static PBRT_THREAD_LOCAL int64_t var##min = std::numeric_limits<int64_t>::max(); \
+    static PBRT_THREAD_LOCAL int64_t var##max = std::numeric_limits<int64_t>::lowest(); \
+    static void STATS_FUNC##var(StatsAccumulator &accum) { \
+        accum.ReportIntDistribution(title, var##sum, var##count, var##min, var##max); \
+        var##sum = 0; \
+        var##count = 0; \
+        var##min = std::numeric_limits<int64_t>::max(); \
+        var##max = std::numeric_limits<int64_t>::lowest(); \
+    } \
+    static StatRegisterer STATS_REG##var(STATS_FUNC##var)
+
+#define STAT_FLOAT_DISTRIBUTION(title, var) \
+    static PBRT_THREAD_LOCAL double var##sum = 0; \
+    static PBRT_THREAD_LOCAL int64_t var##count = 0; \
+    static PBRT_THREAD_LOCAL double var##min = std::numeric_limits<double>::max(); \
+    static PBRT_THREAD_LOCAL double var##max = std::numeric_limits<double>::lowest(); \
+    static void STATS_FUNC##var(StatsAccumulator &accum) { \
+        accum.ReportFloatDistribution(title, var##sum, var##count, var##min, var##max); \
+        var##sum = 0; \
+        var##count = 0; \
+        var##min = std::numeric_limits<double>::max(); \
+        var##max = std::numeric_limits<double>::lowest(); \
+    } \
+    static StatRegisterer STATS_REG##var(STATS_FUNC##var)
+
+#define ReportValue(var, value) \
+    do { \
+        var##sum += (value); \
+        var##count += 1; \
+        var##min = std::min(var##min, decltype(var##min)(value)); \
+        var##max = std::max(var##max, decltype(var##max)(value)); \
+    } while(0)
+
 } // namespace pbrt
 
 #endif // PBRT_SRC_CORE_STATS_H_
\ No newline at end of file
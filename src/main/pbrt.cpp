@@ -14,6 +14,11 @@ using namespace pbrt;
 
 int main(int argc, char* argv[]) {
     google::InitGoogleLogging(argv[0]);
+    bool analyzeBVH = false; // --bvh-quality: analyze the BVH after building, the metrics are printed with other stats
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "--bvh-quality") == 0) analyzeBVH = true;
+        else LOG(WARNING) << "Unknown argument " << argv[i];
+    }
     std::string log_dir = "/tmp/pbr_run_log";
     std::string stat_path = "/tmp/pbr_run_log/stat.txt";
     FILE *fp;
@@ -24,26 +29,41 @@ int main(int argc, char* argv[]) {
     }
     FLAGS_log_dir = log_dir.c_str();
     
+    ParallelForLoopExecutor::Init(std::nullopt); // init before the scene, so the BVH can be built in parallel
     std::vector<std::shared_ptr<Light>> lights;
     lights.push_back(std::make_shared<PointLight>(Point3f(0, 2, 0), RGBAf(1, 1, 1, 1)));
-    std::shared_ptr<Scene> scene = std::make_shared<Scene>("../resource/cube/cube.obj", lights);
+    BVHBuildOptions bvhOptions;
+    bvhOptions.cacheDirectory = log_dir + "/bvh_cache"; // the BVH is loaded from the cache if the model is not changed
+    std::shared_ptr<Scene> scene = std::make_shared<Scene>("../resource/cube/cube.obj", lights, bvhOptions);
+    if(analyzeBVH) scene->accel->AnalyzeQuality();
     Point2i fullResolution = Point2i(512, 512);
     std::shared_ptr<Film> film = std::make_shared<Film>(fullResolution, "result.ppm");
     Transform cameramTransform = LookAt(Point3f(0, 0, -10), Point3f(0, 0, 1), Vector3f(0, 1, 0)) * RotateZ(45) * RotateX(45) * RotateY(45);
     std::shared_ptr<Camera> camera = std::make_shared<PinholeCamera>(Inverse(cameramTransform), film);
-    ParallelForLoopExecutor::Init(std::nullopt);
-    ParallelForLoopExecutor::ParallelFor2D([&](Point2i p){
-        Ray ray;
-        Float weight = camera->generateRay(p, ray);
-        SurfaceInteraction isect;
-        bool r = scene->accel->Intersect(ray, isect);
-        if(r) {
-           RGBAf specturm = isect.primitive->GetMaterial()->kd;
-            film->AddSplat(p, specturm);
-        } else {
-            film->AddSplat(p, RGBAf(0,0,0,1));
+    // Neighbouring camera rays are coherent, so the pixels are traced in blocks of 4x4 as a ray packet
+    Point2i nBlocks((fullResolution.x + 3) / 4, (fullResolution.y + 3) / 4);
+    ParallelForLoopExecutor::ParallelFor2D([&](Point2i block){
+        RayPacket<16> packet;
+        Point2i pixels[16];
+        packet.size = 0;
+        for(int y = block.y * 4; y < std::min(block.y * 4 + 4, fullResolution.y); ++y) {
+            for(int x = block.x * 4; x < std::min(block.x * 4 + 4, fullResolution.x); ++x) {
+                pixels[packet.size] = Point2i(x, y);
+                camera->generateRay(pixels[packet.size], packet.rays[packet.size]);
+                ++packet.size;
+            }
+        }
+        HitPacket<16> hits;
+        scene->accel->IntersectPacket(packet, hits);
+        for(int i = 0; i < packet.size; ++i) {
+            if(hits.mask & (1u << i)) {
+                RGBAf specturm = hits.isects[i].primitive->GetMaterial()->kd;
+                film->AddSplat(pixels[i], specturm);
+            } else {
+                film->AddSplat(pixels[i], RGBAf(0,0,0,1));
+            }
         }
-    }, fullResolution);
+    }, nBlocks);
     ParallelForLoopExecutor::MergeWorkerThreadStats(); 
     ParallelForLoopExecutor::PrintStats(fp);
     ParallelForLoopExecutor::Clean();
@@ -17,39 +17,29 @@ bool Triangle::Intersection(const Ray &ray, Float &tHit, SurfaceInteraction &ise
    const Point3f &p0 = mesh->p[v[0]];
    const Point3f &p1 = mesh->p[v[1]];
    const Point3f &p2 = mesh->p[v[2]];
-   const Vector3f e1 = p1 - p0;
-   const Vector3f e2 = p2 - p0;
-   Vector3f S = ray.o - p0;
-   Vector3f S1 = Cross(ray.d, e2);
-   Vector3f S2 = Cross(S, e1);
-   Vector3f v = Vector3f(Dot(S2, e2), Dot(S1, S), Dot(S2, ray.d));
-   Vector3f r = 1.0f / Dot(S1, e1) * v;
-   if(r.x < ray.tMax && r.x > 0 && r.y > 0 && r.z > 0 && (1 - r.y - r.z) > 0) {
-      float t = r.x;
-      Point3f hitPoint = ray.o + t * ray.d;
-      tHit = t;
-      Normal3f n = Normal3f(Normalize(Cross(e1, e2)));
-      isect = SurfaceInteraction(this, hitPoint, n);
-      isect.shape = this;
-      return true;
-   }
-   return false;
+   if(!IntersectTriangle(ray, p0, p1, p2, tHit)) return false;
+   isect = DeferredInteraction(ray, tHit);
+   return true;
 }
 
+bool Triangle::TriangleVertices(Point3f p[3]) const {
+   for(int i = 0; i < 3; ++i) p[i] = mesh->p[v[i]];
+   return true;
+}
 
-bool Triangle::IntersectionP(const Ray &ray) const {
+SurfaceInteraction Triangle::DeferredInteraction(const Ray &ray, Float tHit) const {
    const Point3f &p0 = mesh->p[v[0]];
    const Point3f &p1 = mesh->p[v[1]];
    const Point3f &p2 = mesh->p[v[2]];
-   const Vector3f e1 = p1 - p0;
-   const Vector3f e2 = p2 - p0;
-   Vector3f S = ray.o - p0;
-   Vector3f S1 = Cross(ray.d, e2);
-   Vector3f S2 = Cross(S, e1);
-   Vector3f v = Vector3f(Dot(S2, e2), Dot(S1, S), Dot(S2, ray.d));
-   Vector3f r = 1.0f / Dot(S1, e1) * v;
-   if(r.x < ray.tMax && r.x > 0 && r.y > 0 && r.z > 0 && (1 - r.y - r.z) > 0) return true;
-   else return false;
+   Point3f hitPoint = ray.o + tHit * ray.d;
+   Normal3f n = Normal3f(Normalize(Cross(p1 - p0, p2 - p0)));
+   return SurfaceInteraction(this, hitPoint, n);
+}
+
+
+bool Triangle::IntersectionP(const Ray &ray) const {
+   Float tHit;
+   return IntersectTriangle(ray, mesh->p[v[0]], mesh->p[v[1]], mesh->p[v[2]], tHit);
 }
 
 Float Triangle::Area() const {
@@ -66,6 +56,43 @@ Bounds3f Triangle::WorldBound() const {
    return Union(Bounds3f(p0, p1), p2);
 }
 
+Bounds3f Triangle::ClippedBound(const Bounds3f &clip) const {
+   // Clip the triangle with the six planes of the box one by one(Sutherland-Hodgman), each plane adds one vertex at most
+   Point3f polygon[9], clipped[9];
+   polygon[0] = mesh->p[v[0]];
+   polygon[1] = mesh->p[v[1]];
+   polygon[2] = mesh->p[v[2]];
+   int nVertices = 3;
+   for(int axis = 0; axis < 3; ++axis) {
+      for(int side = 0; side < 2; ++side) {
+         Float plane = clip[side][axis];
+         auto inside = [&](const Point3f &p) { return side == 0 ? p[axis] >= plane : p[axis] <= plane; };
+         bool allInside = true;
+         for(int i = 0; i < nVertices && allInside; ++i) allInside = inside(polygon[i]);
+         if(allInside) continue; // most planes don't cut the polygon, skip them quickly
+         int nClipped = 0;
+         for(int i = 0; i < nVertices; ++i) {
+            const Point3f &a = polygon[i];
+            const Point3f &b = polygon[(i + 1) % nVertices];
+            bool aInside = inside(a), bInside = inside(b);
+            if(aInside) clipped[nClipped++] = a;
+            if(aInside != bInside) { // the edge crosses the plane, add the cross point
+               Float t = (plane - a[axis]) / (b[axis] - a[axis]);
+               Point3f p = a + (b - a) * t;
+               p[axis] = plane;
+               clipped[nClipped++] = p;
+            }
+         }
+         if(nClipped == 0) return Bounds3f();
+         nVertices = nClipped;
+         for(int i = 0; i < nVertices; ++i) polygon[i] = clipped[i];
+      }
+   }
+   Bounds3f b;
+   for(int i = 0; i < nVertices; ++i) b = Union(b, polygon[i]);
+   return Intersect(b, clip); // remove the float error of the cross points
+}
+
 Interaction Triangle::Sample(Float& pdf) const {
    Float x = std::sqrt(get_random_Float()), y = get_random_Float();
    const Point3f &p0 = mesh->p[v[0]];
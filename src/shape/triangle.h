@@ -24,6 +24,25 @@ struct TriangleMesh {
     std::unique_ptr<Normal3f[]> n;
 };
 
+/**
+ * Test the ray with the triangle p0 p1 p2(Moller-Trumbore). Triangle and the packed triangles of BVHAccel share it, so they get the same hits.
+ * @param tHit Output the distance of the hit point, it is only written if the triangle is hit before ray.tMax.
+*/
+inline bool IntersectTriangle(const Ray &ray, const Point3f &p0, const Point3f &p1, const Point3f &p2, Float &tHit) {
+   const Vector3f e1 = p1 - p0;
+   const Vector3f e2 = p2 - p0;
+   Vector3f S = ray.o - p0;
+   Vector3f S1 = Cross(ray.d, e2);
+   Vector3f S2 = Cross(S, e1);
+   Vector3f v = Vector3f(Dot(S2, e2), Dot(S1, S), Dot(S2, ray.d));
+   Vector3f r = 1.0f / Dot(S1, e1) * v;
+   if(r.x < ray.tMax && r.x > 0 && r.y > 0 && r.z > 0 && (1 - r.y - r.z) > 0) {
+      tHit = r.x;
+      return true;
+   }
+   return false;
+}
+
 class Triangle: public Shape {
 public:
     Triangle(const std::shared_ptr<TriangleMesh> &mesh, int triNumber): mesh(mesh) {
@@ -34,6 +53,10 @@ public:
     virtual Float Area() const override;
     virtual Interaction Sample(Float &pdf) const;
     virtual Bounds3f WorldBound() const override;
+    virtual Bounds3f ClippedBound(const Bounds3f &clip) const override;
+    virtual bool TriangleVertices(Point3f p[3]) const override;
+    virtual SurfaceInteraction DeferredInteraction(const Ray &ray, Float tHit) const override;
+    const Point3f &Vertex(int i) const { return mesh->p[v[i]]; } // The ith vertex, i is 0, 1 or 2
 private:
     const std::shared_ptr<TriangleMesh> mesh;
     const int *v; // the pointer point the vertice index, you can use v[0] v[1] v[2] to access the index in mesh->p[]
@@ -1,9 +1,17 @@
+#include <bitset>
 #include <filesystem>
+#include <set>
 
 #include "pbrt_test.h"
 #include "accelerators/bvh.h"
+#include "accelerators/widebvh.h"
+#include "accelerators/dynamicbvh.h"
 #include "clock.h"
 #include "scene.h"
+#include "parallel.h"
+#include "material.h"
+#include "shape/triangle.h"
+#include "stats.h"
 
 using namespace pbrt;
 
@@ -40,7 +48,7 @@ TEST(BVHAccel, BaseTest) {
 
 void test_bvh_insersect(const std::shared_ptr<BVHAccel> bvh, const std::vector<Ray> rays, std::chrono::milliseconds &begin, std::chrono::milliseconds &end);
 void test_bvh_insersectP(const std::shared_ptr<BVHAccel> bvh, const std::vector<Ray> rays, std::chrono::milliseconds &begin, std::chrono::milliseconds &end);
-std::shared_ptr<BVHAccel> buildBVH(const std::vector<std::shared_ptr<Primitive>> &ps, BVHAccel::SplitMethod method, std::chrono::milliseconds &begin, std::chrono::milliseconds &end);
+std::shared_ptr<BVHAccel> buildBVH(const std::vector<std::shared_ptr<Primitive>> &ps, BVHAccel::SplitMethod method, std::chrono::milliseconds &begin, std::chrono::milliseconds &end, const BVHBuildOptions &options = BVHBuildOptions());
 
 TEST(BVHAccel, ComparePerformance) {
     std::vector<std::shared_ptr<Primitive>> ps;
@@ -60,6 +68,9 @@ TEST(BVHAccel, ComparePerformance) {
 
     auto bvh_sah = buildBVH(ps, BVHAccel::SplitMethod::SAH, begin, end);
     printTime("Build BVH with SAH took: ", begin, end);
+
+    auto bvh_hlbvh = buildBVH(ps, BVHAccel::SplitMethod::HLBVH, begin, end);
+    printTime("Build BVH with HLBVH took: ", begin, end);
     
     LOG(INFO) << "---------------------test insersect----------------------------";
     
@@ -76,6 +87,9 @@ TEST(BVHAccel, ComparePerformance) {
     test_bvh_insersect(bvh_sah, rays, begin, end);
     printTime("Test BVH with SAH took: ", begin, end);
 
+    test_bvh_insersect(bvh_hlbvh, rays, begin, end);
+    printTime("Test BVH with HLBVH took: ", begin, end);
+
     LOG(INFO) << "---------------------test insersectP----------------------------";
 
     test_bvh_insersectP(bvh_middle, rays, begin, end);
@@ -86,6 +100,9 @@ TEST(BVHAccel, ComparePerformance) {
 
     test_bvh_insersectP(bvh_sah, rays, begin, end);
     printTime("Test BVH with SAH took: ", begin, end);
+
+    test_bvh_insersectP(bvh_hlbvh, rays, begin, end);
+    printTime("Test BVH with HLBVH took: ", begin, end);
 }
 
 void test_bvh_insersect(const std::shared_ptr<BVHAccel> bvh, const std::vector<Ray> rays, std::chrono::milliseconds &begin, std::chrono::milliseconds &end) {
@@ -111,9 +128,1162 @@ void test_bvh_insersectP(const std::shared_ptr<BVHAccel> bvh, const std::vector<
     end = getCurrentMilliseconds();
 }
 
-std::shared_ptr<BVHAccel> buildBVH(const std::vector<std::shared_ptr<Primitive>> &ps, BVHAccel::SplitMethod method, std::chrono::milliseconds &begin, std::chrono::milliseconds &end) {
+TEST(BVHAccel, TreeletOptimization) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 20000, 2);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 2000);
+    BVHBuildOptions options;
+    options.treeletPasses = 2;
+
+    auto sahBVH = std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH);
+    auto optimizedBVH = std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH, 1, options);
+    auto optimizedHLBVH = std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::HLBVH, 1, options);
+    ParallelForLoopExecutor::Init(4);
+    auto parallelBVH = std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH, 1, options);
+    ParallelForLoopExecutor::Clean();
+
+    EXPECT_EQ(sahBVH->WorldBound(), optimizedBVH->WorldBound());
+    for(const Ray &r: rays) { // restructuring must not change the closest hit
+        Ray r0 = r, r1 = r, r2 = r, r3 = r;
+        SurfaceInteraction isect0, isect1, isect2, isect3;
+        bool hit0 = sahBVH->Intersect(r0, isect0);
+        bool hit1 = optimizedBVH->Intersect(r1, isect1);
+        bool hit2 = optimizedHLBVH->Intersect(r2, isect2);
+        bool hit3 = parallelBVH->Intersect(r3, isect3);
+        EXPECT_EQ(hit0, hit1);
+        EXPECT_EQ(hit0, hit2);
+        EXPECT_EQ(hit0, hit3);
+        EXPECT_EQ(r0.tMax, r1.tMax);
+        EXPECT_EQ(r0.tMax, r2.tMax);
+        EXPECT_EQ(isect1.primitive, isect3.primitive);
+        EXPECT_EQ(optimizedBVH->IntersectP(r), hit1);
+    }
+}
+
+TEST(BVHAccel, CompressNodes) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 20000, 4);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 2000);
+    std::chrono::milliseconds begin, end;
+    BVHBuildOptions options;
+    options.compressNodes = true;
+
+    auto bvh = buildBVH(ps, BVHAccel::SplitMethod::SAH, begin, end);
+    auto compressedBVH = buildBVH(ps, BVHAccel::SplitMethod::SAH, begin, end, options);
+    auto compressedSBVH = buildBVH(ps, BVHAccel::SplitMethod::SBVH, begin, end, options);
+    BVHAccel compressedLeavesBVH(ps, BVHAccel::SplitMethod::SAH, 4, options);
+    EXPECT_EQ(bvh->WorldBound(), compressedBVH->WorldBound());
+    for(const Ray &r: rays) { // quantized bounds are conservative, the closest hit must not change
+        Ray r0 = r, r1 = r, r2 = r, r3 = r;
+        SurfaceInteraction isect0, isect1, isect2, isect3;
+        bool hit0 = bvh->Intersect(r0, isect0);
+        bool hit1 = compressedBVH->Intersect(r1, isect1);
+        bool hit2 = compressedSBVH->Intersect(r2, isect2);
+        bool hit3 = compressedLeavesBVH.Intersect(r3, isect3);
+        EXPECT_EQ(hit0, hit1);
+        EXPECT_EQ(hit0, hit2);
+        EXPECT_EQ(hit0, hit3);
+        EXPECT_EQ(r0.tMax, r1.tMax);
+        EXPECT_EQ(r0.tMax, r2.tMax);
+        EXPECT_EQ(r0.tMax, r3.tMax);
+        EXPECT_EQ(isect0.primitive, isect1.primitive);
+        EXPECT_EQ(compressedBVH->IntersectP(r), hit0);
+        EXPECT_EQ(compressedLeavesBVH.IntersectP(r), hit0);
+    }
+
+    std::vector<std::shared_ptr<Primitive>> single(ps.begin(), ps.begin() + 1); // a single leaf is not compressed
+    BVHAccel singleBVH(single, BVHAccel::SplitMethod::SAH, 1, options);
+    EXPECT_EQ(single[0]->WorldBound(), singleBVH.WorldBound());
+
+    std::vector<std::shared_ptr<Primitive>> plane;
+    if(!Scene::loadModel(plane, "../resource/plane/plane.obj")) return;
+    bvh = buildBVH(plane, BVHAccel::SplitMethod::SAH, begin, end);
+    compressedBVH = buildBVH(plane, BVHAccel::SplitMethod::SAH, begin, end, options);
+    generateTestRays(rays, 20000);
+    test_bvh_insersect(bvh, rays, begin, end);
+    printTime("Test plane.obj BVH took: ", begin, end);
+    test_bvh_insersect(compressedBVH, rays, begin, end);
+    printTime("Test plane.obj BVH with compressed nodes took: ", begin, end);
+}
+
+/**
+ * Check the closest hits of bvh with intersecting all primitives.
+*/
+static void expectSameWithBruteForce(const Primitive &bvh, const std::vector<std::shared_ptr<Primitive>> &ps, const std::vector<Ray> &rays) {
+    for(const Ray &r: rays) {
+        Ray r0 = r, r1 = r;
+        SurfaceInteraction isect0, isect1;
+        bool hit0 = false;
+        for(const auto &p: ps) hit0 |= p->Intersect(r0, isect0);
+        bool hit1 = bvh.Intersect(r1, isect1);
+        EXPECT_EQ(hit0, hit1);
+        EXPECT_EQ(r0.tMax, r1.tMax);
+        EXPECT_EQ(isect0.primitive, isect1.primitive);
+        EXPECT_EQ(bvh.IntersectP(r), hit1);
+    }
+}
+
+TEST(BVHAccel, NegativeDirections) {
+    // A ray negative on the split axis visits the second child first and pushes the first one, whose index is the node's plus one
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 2000, 20);
+    std::vector<Ray> rays;
+    std::mt19937 rng(20);
+    std::uniform_real_distribution<Float> dist(-1.0, 1.0);
+    for(int i = 0; i < 400; ++i) { // every octant from the center
+        Vector3f d(dist(rng), dist(rng), dist(rng));
+        if(d.LengthSquared() < 1e-4) continue;
+        rays.push_back(Ray(Point3f(0, 0, 0), Normalize(d)));
+    }
+    for(BVHAccel::SplitMethod method: {BVHAccel::SplitMethod::Middle, BVHAccel::SplitMethod::EqualCounts, BVHAccel::SplitMethod::SAH, BVHAccel::SplitMethod::HLBVH})
+        expectSameWithBruteForce(BVHAccel(ps, method), ps, rays);
+}
+
+TEST(BVHAccel, Refit) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    std::shared_ptr<TriangleMesh> mesh = generateRandomTriangles(ps, 20000, 5);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 200);
+    BVHBuildOptions options;
+    options.refitRebuildThreshold = 0;
+    auto bvh = std::make_shared<BVHAccel>(ps);
+    auto refitOnlyBVH = std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH, 1, options);
+    options.refitRebuildThreshold = 1.5;
+    options.treeletPasses = 1;
+    options.layout = BVHLayout::PageTreelets;
+    BVHAccel optimizedBVH(ps, BVHAccel::SplitMethod::SAH, 2, options); // the leaves are not contiguous after restructuring
+
+    // A small wave keeps the topology good
+    for(int i = 0; i < mesh->nVertices; ++i) 
+        mesh->p[i] += Vector3f(0, 0.05 * std::sin(mesh->p[i].x * 3), 0);
+    bvh->Refit();
+    refitOnlyBVH->Refit();
+    optimizedBVH.Refit();
+    expectSameWithBruteForce(*bvh, ps, rays);
+    expectSameWithBruteForce(*refitOnlyBVH, ps, rays);
+    expectSameWithBruteForce(optimizedBVH, ps, rays);
+
+    // Scatter a quarter of the triangles, the subtrees containing them degrade a lot and are rebuilt
+    std::mt19937 rng(6);
+    std::uniform_real_distribution<Float> dist(-1.0, 1.0);
+    for(int i = 0; i < mesh->nTriangles / 4; ++i) {
+        Vector3f offset(dist(rng), dist(rng), dist(rng));
+        for(int j = 0; j < 3; ++j) 
+            mesh->p[mesh->vertexIndices[i * 3 + j]] += offset;
+    }
+    ParallelForLoopExecutor::Init(4);
+    bvh->Refit();
+    refitOnlyBVH->Refit();
+    optimizedBVH.Refit();
+    ParallelForLoopExecutor::Clean();
+    expectSameWithBruteForce(*bvh, ps, rays);
+    expectSameWithBruteForce(*refitOnlyBVH, ps, rays);
+    expectSameWithBruteForce(optimizedBVH, ps, rays);
+    
+    bvh->Refit(); // nothing moved, the bounds are same
+    expectSameWithBruteForce(*bvh, ps, rays);
+}
+
+TEST(BVHAccel, Layouts) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    std::shared_ptr<TriangleMesh> mesh = generateRandomTriangles(ps, 20000, 7);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 2000);
+    const BVHLayout layouts[] = {BVHLayout::DepthFirst, BVHLayout::VanEmdeBoas, BVHLayout::CacheLineTreelets, BVHLayout::PageTreelets, BVHLayout::HotFirst};
+    BVHAccel bvh(ps);
+    for(BVHLayout layout: layouts) { // the layout must not change the closest hit
+        BVHBuildOptions options;
+        options.layout = layout;
+        BVHAccel laidOutBVH(ps, BVHAccel::SplitMethod::SAH, 1, options);
+        EXPECT_EQ(bvh.WorldBound(), laidOutBVH.WorldBound());
+        for(const Ray &r: rays) {
+            Ray r0 = r, r1 = r;
+            SurfaceInteraction isect0, isect1;
+            bool hit0 = bvh.Intersect(r0, isect0);
+            bool hit1 = laidOutBVH.Intersect(r1, isect1);
+            EXPECT_EQ(hit0, hit1);
+            EXPECT_EQ(r0.tMax, r1.tMax);
+            EXPECT_EQ(isect0.primitive, isect1.primitive);
+            EXPECT_EQ(laidOutBVH.IntersectP(r), hit0);
+        }
+    }
+
+    // Relayout from every layout to every layout, then refit the moved triangles
+    BVHAccel relaidBVH(ps);
+    for(BVHLayout layout: layouts) {
+        relaidBVH.Relayout(layout, rays);
+        expectSameWithBruteForce(relaidBVH, ps, std::vector<Ray>(rays.begin(), rays.begin() + 200));
+    }
+    relaidBVH.Relayout(BVHLayout::VanEmdeBoas);
+    std::mt19937 rng(8);
+    std::uniform_real_distribution<Float> dist(-1.0, 1.0);
+    for(int i = 0; i < mesh->nTriangles / 4; ++i) {
+        Vector3f offset(dist(rng), dist(rng), dist(rng));
+        for(int j = 0; j < 3; ++j) 
+            mesh->p[mesh->vertexIndices[i * 3 + j]] += offset;
+    }
+    relaidBVH.Refit();
+    expectSameWithBruteForce(relaidBVH, ps, std::vector<Ray>(rays.begin(), rays.begin() + 200));
+
+}
+
+TEST(BVHAccel, QualityMetrics) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 20000, 9);
+    BVHAccel sahBVH(ps);
+    BVHAccel middleBVH(ps, BVHAccel::SplitMethod::Middle);
+    BVHBuildOptions options;
+    options.layout = BVHLayout::VanEmdeBoas;
+    BVHAccel laidOutBVH(ps, BVHAccel::SplitMethod::SAH, 1, options);
+    BVHAccel bigLeafBVH(ps, BVHAccel::SplitMethod::SAH, 8);
+
+    BVHQuality sah = sahBVH.AnalyzeQuality();
+    BVHQuality middle = middleBVH.AnalyzeQuality();
+    BVHQuality laidOut = laidOutBVH.AnalyzeQuality();
+    BVHQuality bigLeaf = bigLeafBVH.AnalyzeQuality();
+    LOG(INFO) << "SAH: cost " << sah.sahCost << ", EPO " << sah.epo << ", sibling overlap " << sah.siblingOverlap << ", max leaf depth " << sah.leafDepths.size() - 1;
+    LOG(INFO) << "Middle: cost " << middle.sahCost << ", EPO " << middle.epo << ", sibling overlap " << middle.siblingOverlap << ", max leaf depth " << middle.leafDepths.size() - 1;
+    EXPECT_LT(sah.sahCost, middle.sahCost);
+    EXPECT_GT(sah.epo, 0);
+    EXPECT_GT(sah.siblingOverlap, 0);
+    EXPECT_LT(sah.siblingOverlap, 1);
+    EXPECT_EQ(sah.leafDepths[0], 0);
+    EXPECT_EQ(sah.leafSizes.size(), 2); // every leaf has one primitive
+    EXPECT_EQ(sah.leafSizes[1], ps.size());
+    int64_t nLeaves = 0, nReferences = 0;
+    for(int64_t n: sah.leafDepths) nLeaves += n;
+    EXPECT_EQ(nLeaves, ps.size());
+    for(int n = 0; n < bigLeaf.leafSizes.size(); ++n) nReferences += n * bigLeaf.leafSizes[n];
+    EXPECT_EQ(nReferences, ps.size());
+    EXPECT_LE(bigLeaf.leafSizes.size(), 9);
+
+    // The layout doesn't change the tree
+    EXPECT_FLOAT_EQ(sah.sahCost, laidOut.sahCost);
+    EXPECT_FLOAT_EQ(sah.epo, laidOut.epo);
+    EXPECT_FLOAT_EQ(sah.siblingOverlap, laidOut.siblingOverlap);
+    EXPECT_EQ(sah.leafDepths, laidOut.leafDepths);
+
+    // EPO is weighted by the cost model, scaling both costs scales it and the tree stays the same
+    BVHBuildOptions expensive;
+    expensive.traversalCost = 2 * BVHBuildOptions().traversalCost;
+    expensive.intersectionCost = 2 * BVHBuildOptions().intersectionCost;
+    BVHQuality scaled = BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, expensive).AnalyzeQuality();
+    EXPECT_EQ(sah.leafDepths, scaled.leafDepths);
+    EXPECT_FLOAT_EQ(2 * sah.sahCost, scaled.sahCost);
+    EXPECT_FLOAT_EQ(2 * sah.epo, scaled.epo);
+
+    // The metrics are published as distributions
+    StatsAccumulator accum;
+    StatRegisterer::Callback(accum);
+    FILE *fp = tmpfile();
+    accum.Print(fp);
+    rewind(fp);
+    std::string report;
+    char buffer[256];
+    while(fgets(buffer, sizeof(buffer), fp) != nullptr) 
+        report += buffer;
+    fclose(fp);
+    EXPECT_NE(report.find("Quality/SAH cost"), std::string::npos);
+    EXPECT_NE(report.find("Quality/End-point overlap"), std::string::npos);
+    EXPECT_NE(report.find("Quality/Leaf depth"), std::string::npos);
+    EXPECT_NE(report.find("Quality/Primitives per leaf"), std::string::npos);
+}
+
+TEST(BVHAccel, CostModel) {
+    Float traversalCost, intersectionCost;
+    BVHAccel::CalibrateCostModel(traversalCost, intersectionCost);
+    EXPECT_GT(traversalCost, 0);
+    EXPECT_EQ(intersectionCost, 1);
+
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 10000, 10);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 200);
+    BVHBuildOptions options;
+    options.sahBuckets = 2;
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options), ps, rays);
+    options.sahBuckets = 1000; // clamped to MAX_SAH_BUCKETS
+    options.sahThreshold = 16;
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options), ps, rays);
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::SBVH, 1, options), ps, rays);
+    options.calibrateCostModel = true;
+    options.treeletPasses = 1;
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 4, options), ps, rays);
+
+    // Expensive traversal makes bigger leaves
+    auto countLeaves = [](const BVHQuality &quality) {
+        int64_t n = 0;
+        for(int64_t c: quality.leafDepths) n += c;
+        return n;
+    };
+    BVHBuildOptions cheapTraversal, expensiveTraversal;
+    cheapTraversal.traversalCost = 0.25;
+    expensiveTraversal.traversalCost = 4;
+    BVHAccel cheapBVH(ps, BVHAccel::SplitMethod::SAH, 16, cheapTraversal);
+    BVHAccel expensiveBVH(ps, BVHAccel::SplitMethod::SAH, 16, expensiveTraversal);
+    EXPECT_GT(countLeaves(cheapBVH.AnalyzeQuality()), countLeaves(expensiveBVH.AnalyzeQuality()));
+    expectSameWithBruteForce(expensiveBVH, ps, rays);
+}
+
+TEST(BVHAccel, PackedTriangles) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    std::shared_ptr<TriangleMesh> mesh = generateRandomTriangles(ps, 100000, 11);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 200);
+    BVHBuildOptions unpacked;
+    unpacked.packTriangles = false;
+    auto packedBVH = std::make_shared<BVHAccel>(ps);
+    auto unpackedBVH = std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH, 1, unpacked);
+    expectSameWithBruteForce(*packedBVH, ps, rays);
+    expectSameWithBruteForce(*unpackedBVH, ps, rays);
+    BVHBuildOptions compressed;
+    compressed.compressNodes = true;
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, compressed), ps, rays);
+
+    // A mixed leaf, the instance is not packed and falls back to its own test
+    std::vector<std::shared_ptr<Primitive>> mixed(ps.begin(), ps.begin() + 1000);
+    mixed.push_back(std::make_shared<TransformedPrimitive>(std::make_shared<BVHAccel>(std::vector<std::shared_ptr<Primitive>>(ps.begin() + 1000, ps.begin() + 2000)), Transform()));
+    expectSameWithBruteForce(BVHAccel(mixed, BVHAccel::SplitMethod::SAH, 255), mixed, rays);
+
+    // The packed vertices follow a refit
+    for(int i = 0; i < mesh->nVertices; ++i) 
+        mesh->p[i] += Vector3f(0.1, 0, 0);
+    packedBVH->Refit();
+    expectSameWithBruteForce(*packedBVH, ps, rays);
+}
+
+TEST(BVHAccel, ShortStack) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 20000, 12);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 200);
+    BVHBuildOptions options;
+    options.shortStackTraversal = true;
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options), ps, rays);
+    options.layout = BVHLayout::VanEmdeBoas;
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options), ps, rays);
+
+    // Each triangle is 0.4 times the size and distance of the previous one, the middle split peels one triangle off per level
+    std::vector<int> idxs;
+    std::vector<Point3f> p;
+    std::vector<Point3f> centers;
+    int nDeep = 90;
+    std::vector<Normal3f> n(nDeep * 3);
+    for(int i = 0; i < nDeep; ++i) {
+        Float scale = std::pow(Float(0.4), i);
+        Point3f center(scale, scale, scale);
+        centers.push_back(center + Vector3f(0, 0.05, 0.03) * scale);
+        p.push_back(center + Vector3f(-0.2, 0, 0) * scale);
+        p.push_back(center + Vector3f(0.2, 0, 0) * scale);
+        p.push_back(center + Vector3f(0, 0.2, 0.1) * scale);
+        for(int j = 0; j < 3; ++j) idxs.push_back(i * 3 + j);
+    }
+    std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>(nDeep, nDeep * 3, idxs, p, n);
+    std::shared_ptr<Material> material = std::make_shared<Material>(RGBAf(1, 1, 1, 1), RGBAf(1, 1, 1, 1));
+    std::vector<std::shared_ptr<Primitive>> deep;
+    for(int i = 0; i < nDeep; ++i)
+        deep.push_back(std::make_shared<GeometicPrimitive>(std::make_shared<Triangle>(mesh, i), material));
+    BVHBuildOptions compressed;
+    compressed.compressNodes = true; // too deep, it is kept uncompressed
+    BVHAccel deepBVH(deep, BVHAccel::SplitMethod::Middle, 1, compressed);
+    BVHAccel uncompressedBVH(deep, BVHAccel::SplitMethod::Middle);
+    const std::vector<int64_t> &depths = uncompressedBVH.AnalyzeQuality().leafDepths;
+    EXPECT_GE(depths.size(), 64);
+    std::vector<Ray> deepRays;
+    for(int i = 0; i < nDeep; ++i) { // toward each triangle from both sides
+        deepRays.push_back(Ray(Point3f(0.1, -0.2, -1), Normalize(centers[i] - Point3f(0.1, -0.2, -1))));
+        deepRays.push_back(Ray(Point3f(-1, 0.3, 0.5), Normalize(centers[i] - Point3f(-1, 0.3, 0.5))));
+    }
+    expectSameWithBruteForce(deepBVH, deep, deepRays);
+    expectSameWithBruteForce(BVHAccel(deep, BVHAccel::SplitMethod::Middle, 1, options), deep, deepRays); // many entries are dropped
+}
+
+TEST(DynamicBVHAccel, InsertAndRemove) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    std::shared_ptr<TriangleMesh> mesh = generateRandomTriangles(ps, 20000, 11);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 200);
+    DynamicBVHAccel dynamicBVH;
+    auto maxHeight = [](size_t n) { return 1.44 * std::log2(n + 2); }; // the height bound of an AVL tree
+    auto begin = std::chrono::high_resolution_clock::now();
+    std::vector<int> handles;
+    for(const auto &p: ps) 
+        handles.push_back(dynamicBVH.Insert(p));
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::high_resolution_clock::now() - begin;
+    LOG(INFO) << "Insert " << ps.size() << " primitives took " << elapsed.count() / ps.size() << " us per primitive, height: " << dynamicBVH.Height();
+    EXPECT_EQ(dynamicBVH.Size(), ps.size());
+    EXPECT_EQ(dynamicBVH.WorldBound(), BVHAccel(ps).WorldBound());
+    EXPECT_LE(dynamicBVH.Height(), maxHeight(ps.size()));
+    expectSameWithBruteForce(dynamicBVH, ps, rays);
+
+    // Remove a half, move a quarter of the others, then insert the removed ones back
+    std::vector<std::shared_ptr<Primitive>> kept, removed;
+    std::vector<int> keptHandles;
+    for(int i = 0; i < ps.size(); ++i) {
+        if(i % 2 == 0) {
+            dynamicBVH.Remove(handles[i]);
+            removed.push_back(ps[i]);
+        } else {
+            kept.push_back(ps[i]);
+            keptHandles.push_back(handles[i]);
+        }
+    }
+    EXPECT_EQ(dynamicBVH.Size(), kept.size());
+    EXPECT_LE(dynamicBVH.Height(), maxHeight(kept.size()));
+    expectSameWithBruteForce(dynamicBVH, kept, rays);
+    std::mt19937 rng(12);
+    std::uniform_real_distribution<Float> dist(-1.0, 1.0);
+    begin = std::chrono::high_resolution_clock::now();
+    for(int i = 1; i < ps.size(); i += 8) { // odd triangles are kept
+        Vector3f offset(dist(rng), dist(rng), dist(rng));
+        for(int j = 0; j < 3; ++j) 
+            mesh->p[mesh->vertexIndices[i * 3 + j]] += offset;
+        dynamicBVH.Update(handles[i]);
+    }
+    elapsed = std::chrono::high_resolution_clock::now() - begin;
+    LOG(INFO) << "Update " << ps.size() / 8 << " moved primitives took " << elapsed.count() / (ps.size() / 8) << " us per primitive";
+    expectSameWithBruteForce(dynamicBVH, kept, rays);
+    for(const auto &p: removed) 
+        dynamicBVH.Insert(p);
+    expectSameWithBruteForce(dynamicBVH, ps, rays);
+    LOG(INFO) << "Height after editing: " << dynamicBVH.Height();
+    EXPECT_LE(dynamicBVH.Height(), maxHeight(ps.size()));
+
+    // Remove until the tree is empty
+    DynamicBVHAccel small;
+    int h0 = small.Insert(ps[0]), h1 = small.Insert(ps[1]), h2 = small.Insert(ps[2]);
+    EXPECT_TRUE(small.Remove(h1));
+    EXPECT_FALSE(small.Remove(h1)); // removed twice
+    EXPECT_FALSE(small.Update(-1));
+    EXPECT_FALSE(small.Remove(1000));
+    EXPECT_EQ(small.Size(), 2);
+    small.Remove(h0);
+    expectSameWithBruteForce(small, {ps[2]}, rays);
+    small.Remove(h2);
+    EXPECT_EQ(small.Size(), 0);
+    EXPECT_FALSE(small.IntersectP(rays[0]));
+}
+
+TEST(BVHAccel, Cache) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    std::shared_ptr<TriangleMesh> mesh = generateRandomTriangles(ps, 20000, 7);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 2000);
+    std::chrono::milliseconds begin, end;
+    std::filesystem::path cacheDirectory = std::filesystem::temp_directory_path() / "pbrt_bvh_cache_test";
+    std::filesystem::remove_all(cacheDirectory);
+    BVHBuildOptions options;
+    options.cacheDirectory = cacheDirectory.string();
+
+    auto countCacheFiles = [&]() {
+        return std::distance(std::filesystem::directory_iterator(cacheDirectory), std::filesystem::directory_iterator());
+    };
+    auto expectSame = [&](const std::shared_ptr<BVHAccel> &bvh0, const std::shared_ptr<BVHAccel> &bvh1) {
+        EXPECT_EQ(bvh0->WorldBound(), bvh1->WorldBound());
+        for(const Ray &r: rays) {
+            Ray r0 = r, r1 = r;
+            SurfaceInteraction isect0, isect1;
+            EXPECT_EQ(bvh0->Intersect(r0, isect0), bvh1->Intersect(r1, isect1));
+            EXPECT_EQ(r0.tMax, r1.tMax);
+            EXPECT_EQ(isect0.primitive, isect1.primitive);
+            EXPECT_EQ(bvh0->IntersectP(r), bvh1->IntersectP(r));
+        }
+    };
+
+    auto builtBVH = buildBVH(ps, BVHAccel::SplitMethod::SBVH, begin, end, options);
+    printTime("Build BVH with SBVH and save it took: ", begin, end);
+    EXPECT_EQ(countCacheFiles(), 1);
+    auto loadedBVH = buildBVH(ps, BVHAccel::SplitMethod::SBVH, begin, end, options);
+    printTime("Load BVH from cache took: ", begin, end);
+    EXPECT_EQ(countCacheFiles(), 1);
+    expectSame(builtBVH, loadedBVH);
+    
+    auto sahBVH = buildBVH(ps, BVHAccel::SplitMethod::SAH, begin, end, options); // another method is another cache
+    EXPECT_EQ(countCacheFiles(), 2);
+
+    // A moved mesh must not load the old tree, and a loaded tree can be refitted
+    for(int i = 0; i < mesh->nVertices; ++i) 
+        mesh->p[i] += Vector3f(0.3, 0, 0);
+    auto movedBVH = buildBVH(ps, BVHAccel::SplitMethod::SBVH, begin, end, options);
+    EXPECT_EQ(countCacheFiles(), 3);
+    loadedBVH->Refit();
+    expectSame(movedBVH, loadedBVH);
+
+    // Flipping the winding of a triangle or reordering the primitives keeps the bounds, but they are another input
+    std::swap(mesh->p[mesh->vertexIndices[0]], mesh->p[mesh->vertexIndices[1]]);
+    buildBVH(ps, BVHAccel::SplitMethod::SBVH, begin, end, options);
+    EXPECT_EQ(countCacheFiles(), 4);
+    std::reverse(ps.begin(), ps.end());
+    buildBVH(ps, BVHAccel::SplitMethod::SBVH, begin, end, options);
+    EXPECT_EQ(countCacheFiles(), 5);
+
+    // The calibrated costs replace the given ones, so they decide the cache
+    options.calibrateCostModel = true;
+    buildBVH(ps, BVHAccel::SplitMethod::SAH, begin, end, options);
+    EXPECT_EQ(countCacheFiles(), 6);
+    options.traversalCost = 7;
+    buildBVH(ps, BVHAccel::SplitMethod::SAH, begin, end, options);
+    EXPECT_EQ(countCacheFiles(), 6);
+
+    // A corrupted node in a file of the right size is rejected, the tree is built again instead of reading out of bounds
+    std::filesystem::remove_all(cacheDirectory);
+    options.calibrateCostModel = false;
+    auto savedBVH = std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH, 1, options);
+    ASSERT_EQ(countCacheFiles(), 1);
+    std::filesystem::path cacheFile = std::filesystem::directory_iterator(cacheDirectory)->path();
+    for(int64_t offset: {int64_t(1) << 30, int64_t(-1)}) {
+        FILE *fp = fopen(cacheFile.string().c_str(), "r+b");
+        ASSERT_NE(fp, nullptr);
+        int32_t secondChildOffset = offset;
+        fseek(fp, 64 + offsetof(LinearBVHNode, secondChildOffset), SEEK_SET); // the root node after the 64 bytes header
+        fwrite(&secondChildOffset, sizeof(secondChildOffset), 1, fp);
+        fclose(fp);
+        expectSame(savedBVH, std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH, 1, options));
+    }
+    std::filesystem::remove_all(cacheDirectory);
+}
+
+TEST(TransformedPrimitive, Instances) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    std::shared_ptr<TriangleMesh> mesh = generateRandomTriangles(ps, 2000, 8);
+    std::shared_ptr<BVHAccel> meshBVH = std::make_shared<BVHAccel>(ps);
+    std::mt19937 rng(9);
+    std::uniform_real_distribution<Float> dist(-1.0, 1.0);
+    std::vector<Transform> transforms;
+    for(int i = 0; i < 64; ++i) 
+        transforms.push_back(Translate(Vector3f(dist(rng), dist(rng), dist(rng)) * 4) * RotateY(dist(rng) * 180) * Scale(0.5, 0.5, 0.5));
+    
+    // The two-level BVH over instances and a flat BVH over transformed copies of the mesh must find the same hits
+    std::vector<std::shared_ptr<Primitive>> instances, copies;
+    for(const Transform &t: transforms) {
+        instances.push_back(std::make_shared<TransformedPrimitive>(meshBVH, t));
+        std::vector<Point3f> p(mesh->nVertices);
+        std::vector<Normal3f> n(mesh->nVertices);
+        for(int i = 0; i < mesh->nVertices; ++i) p[i] = t(mesh->p[i]);
+        std::shared_ptr<TriangleMesh> copy = std::make_shared<TriangleMesh>(mesh->nTriangles, mesh->nVertices, mesh->vertexIndices, p, n);
+        for(int i = 0; i < mesh->nTriangles; ++i) 
+            copies.push_back(std::make_shared<GeometicPrimitive>(std::make_shared<Triangle>(copy, i), nullptr));
+    }
+    BVHAccel topLevel(instances);
+    BVHAccel flat(copies);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 2000);
+    expectSameWithBruteForce(topLevel, instances, rays); // the same object space tests, so exactly same
+
+    // A ray grazing an edge may be decided differently in the two spaces by rounding, the hit of the other space must be on an edge of a copy
+    auto onEdge = [&](const Point3f &p) {
+        for(const auto &copy: copies) {
+            const Triangle *triangle = static_cast<const Triangle *>(static_cast<const GeometicPrimitive *>(copy.get())->GetShape().get());
+            Point3f p0 = triangle->Vertex(0);
+            Vector3f e1 = triangle->Vertex(1) - p0, e2 = triangle->Vertex(2) - p0, n = Cross(e1, e2);
+            Float b1 = Dot(Cross(p - p0, e2), n) / n.LengthSquared(), b2 = Dot(Cross(e1, p - p0), n) / n.LengthSquared();
+            Float bMin = std::min({1 - b1 - b2, b1, b2});
+            if(std::abs(Dot(p - p0, n)) < 1e-4 * n.Length() && bMin > -1e-4 && bMin < 1e-4) return true;
+        }
+        return false;
+    };
+    int hits = 0, mismatches = 0;
+    for(const Ray &r: rays) {
+        Ray r0 = r, r1 = r;
+        SurfaceInteraction isect0, isect1;
+        bool hit0 = topLevel.Intersect(r0, isect0);
+        bool hit1 = flat.Intersect(r1, isect1);
+        if(hit0 != hit1) { 
+            ++mismatches;
+            EXPECT_TRUE(onEdge(hit0 ? isect0.p : isect1.p));
+            continue;
+        }
+        if(!hit0) continue;
+        ++hits;
+        EXPECT_NEAR(r0.tMax, r1.tMax, 1e-3 * r1.tMax);
+        EXPECT_LT(Distance(isect0.p, isect1.p), 1e-3 * r1.tMax);
+        EXPECT_NEAR(std::abs(Dot(isect0.n, isect1.n)), 1, 1e-3);
+        EXPECT_NE(isect0.primitive, nullptr);
+    }
+    EXPECT_GT(hits, 0);
+    LOG(INFO) << mismatches << " of " << rays.size() << " rays grazing an edge are decided differently in the two spaces";
+    EXPECT_EQ(TransformedPrimitive(ps[0], transforms[0]).GetMaterial(), ps[0]->GetMaterial()); // an instance of a single primitive has its material
+    EXPECT_EQ(topLevel.WorldBound(), Union(topLevel.WorldBound(), flat.WorldBound())); // the transformed bounds are conservative
+
+    std::vector<std::shared_ptr<Primitive>> cubes;
+    if(!Scene::loadInstances(cubes, "../resource/cube/cube.obj", transforms)) return;
+    EXPECT_EQ(cubes.size(), transforms.size());
+    Scene scene(cubes, std::vector<std::shared_ptr<Light>>());
+    EXPECT_EQ(scene.accel->WorldBound(), Union(scene.accel->WorldBound(), transforms[0](Bounds3f(Point3f(-1, -1, -1), Point3f(1, 1, 1)))));
+}
+
+TEST(WideBVHAccel, CompareWithBVH) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 20000, 3);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 2000);
+    std::chrono::milliseconds begin, end;
+
+    auto bvh = buildBVH(ps, BVHAccel::SplitMethod::SAH, begin, end);
+    QBVHAccel qbvh(ps);
+    OBVHAccel obvh(ps, BVHAccel::SplitMethod::SAH, 4);
+    EXPECT_EQ(bvh->WorldBound(), qbvh.WorldBound());
+    EXPECT_EQ(bvh->WorldBound(), obvh.WorldBound());
+    for(const Ray &r: rays) { // collapsing must not change the closest hit
+        Ray r0 = r, r1 = r, r2 = r;
+        SurfaceInteraction isect0, isect1, isect2;
+        bool hit0 = bvh->Intersect(r0, isect0);
+        bool hit1 = qbvh.Intersect(r1, isect1);
+        bool hit2 = obvh.Intersect(r2, isect2);
+        EXPECT_EQ(hit0, hit1);
+        EXPECT_EQ(hit0, hit2);
+        EXPECT_EQ(r0.tMax, r1.tMax);
+        EXPECT_EQ(r0.tMax, r2.tMax);
+        EXPECT_EQ(isect0.primitive, isect1.primitive);
+        EXPECT_EQ(isect0.primitive, isect2.primitive);
+        EXPECT_EQ(qbvh.IntersectP(r), hit0);
+        EXPECT_EQ(obvh.IntersectP(r), hit0);
+    }
+
+    std::vector<std::shared_ptr<Primitive>> single(ps.begin(), ps.begin() + 1); // the root is a leaf
+    QBVHAccel singleQBVH(single);
+    EXPECT_EQ(single[0]->WorldBound(), singleQBVH.WorldBound());
+
+    std::vector<std::shared_ptr<Primitive>> plane;
+    if(!Scene::loadModel(plane, "../resource/plane/plane.obj")) return;
+    bvh = buildBVH(plane, BVHAccel::SplitMethod::SAH, begin, end);
+    QBVHAccel planeQBVH(plane);
+    OBVHAccel planeOBVH(plane);
+    generateTestRays(rays, 20000);
+    test_bvh_insersect(bvh, rays, begin, end);
+    printTime("Test plane.obj BVH took: ", begin, end);
     begin = getCurrentMilliseconds();
-    std::shared_ptr<BVHAccel> bvh = std::make_shared<BVHAccel>(ps, method);
+    for(const Ray &r: rays) {
+        Ray ray = r;
+        SurfaceInteraction isect;
+        planeQBVH.Intersect(ray, isect);
+    }
+    end = getCurrentMilliseconds();
+    printTime("Test plane.obj QBVH took: ", begin, end);
+    begin = getCurrentMilliseconds();
+    for(const Ray &r: rays) {
+        Ray ray = r;
+        SurfaceInteraction isect;
+        planeOBVH.Intersect(ray, isect);
+    }
+    end = getCurrentMilliseconds();
+    printTime("Test plane.obj OBVH took: ", begin, end);
+}
+
+std::shared_ptr<BVHAccel> buildBVH(const std::vector<std::shared_ptr<Primitive>> &ps, BVHAccel::SplitMethod method, std::chrono::milliseconds &begin, std::chrono::milliseconds &end, const BVHBuildOptions &options) {
+    begin = getCurrentMilliseconds();
+    std::shared_ptr<BVHAccel> bvh = std::make_shared<BVHAccel>(ps, method, 1, options);
     end = getCurrentMilliseconds();
     return bvh;
-}
\ No newline at end of file
+}
+
+TEST(BVHAccel, ParallelBuild) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 2000);
+    std::chrono::milliseconds begin, end;
+
+    auto serialBVH = buildBVH(ps, BVHAccel::SplitMethod::SAH, begin, end);
+    printTime("Build BVH with one thread took: ", begin, end);
+    ParallelForLoopExecutor::Init(4);
+    auto parallelBVH = buildBVH(ps, BVHAccel::SplitMethod::SAH, begin, end);
+    printTime("Build BVH with four threads took: ", begin, end);
+    ParallelForLoopExecutor::Clean();
+    
+    EXPECT_EQ(serialBVH->WorldBound(), parallelBVH->WorldBound());
+    for(const Ray &r: rays) { // the parallel build must produce the same tree, so the results must be exactly same
+        Ray r0 = r, r1 = r;
+        SurfaceInteraction isect0, isect1;
+        bool hit0 = serialBVH->Intersect(r0, isect0);
+        bool hit1 = parallelBVH->Intersect(r1, isect1);
+        EXPECT_EQ(hit0, hit1);
+        if(hit0 && hit1) {
+            EXPECT_EQ(r0.tMax, r1.tMax);
+            EXPECT_EQ(isect0.primitive, isect1.primitive);
+        }
+    }
+}
+
+TEST(BVHAccel, HLBVH) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 2000);
+    std::chrono::milliseconds begin, end;
+
+    auto sahBVH = buildBVH(ps, BVHAccel::SplitMethod::SAH, begin, end);
+    auto hlBVH = buildBVH(ps, BVHAccel::SplitMethod::HLBVH, begin, end);
+    printTime("Build BVH with HLBVH took: ", begin, end);
+    ParallelForLoopExecutor::Init(4);
+    auto parallelHLBVH = buildBVH(ps, BVHAccel::SplitMethod::HLBVH, begin, end);
+    printTime("Build BVH with HLBVH and four threads took: ", begin, end);
+    ParallelForLoopExecutor::Clean();
+    
+    EXPECT_EQ(sahBVH->WorldBound(), hlBVH->WorldBound());
+    for(const Ray &r: rays) { // all builders must find the same closest hit
+        Ray r0 = r, r1 = r, r2 = r;
+        SurfaceInteraction isect0, isect1, isect2;
+        bool hit0 = sahBVH->Intersect(r0, isect0);
+        bool hit1 = hlBVH->Intersect(r1, isect1);
+        bool hit2 = parallelHLBVH->Intersect(r2, isect2);
+        EXPECT_EQ(hit0, hit1);
+        EXPECT_EQ(hit1, hit2);
+        EXPECT_EQ(r0.tMax, r1.tMax);
+        EXPECT_EQ(r1.tMax, r2.tMax);
+        EXPECT_EQ(isect1.primitive, isect2.primitive);
+        EXPECT_EQ(hlBVH->IntersectP(r), hit1);
+    }
+}
+
+TEST(BVHAccel, OversizedLeaves) {
+    // A far triangle makes the centroid bound large, so the Morton codes of the cluster are all same
+    std::vector<std::shared_ptr<Primitive>> ps;
+    int nCluster = 70000; // more than a linear node can count
+    std::shared_ptr<TriangleMesh> cluster = generateRandomTriangles(ps, nCluster, 17);
+    for(int i = 0; i < cluster->nVertices; ++i)
+        cluster->p[i] = Point3f(0.5, 0.5, 0.5) + Vector3f(cluster->p[i]) * 1e-4;
+    std::shared_ptr<TriangleMesh> far = generateRandomTriangles(ps, 1, 18);
+    for(int i = 0; i < far->nVertices; ++i)
+        far->p[i] += Vector3f(50, 50, 50);
+    std::vector<Ray> rays;
+    std::mt19937 rng(19);
+    std::uniform_real_distribution<Float> dist(-1.0, 1.0);
+    for(int i = 0; i < 50; ++i)
+        rays.push_back(Ray(Point3f(0, 0, 0), Normalize(Vector3f(0.5, 0.5, 0.5) + Vector3f(dist(rng), dist(rng), dist(rng)) * 1e-4)));
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::HLBVH), ps, rays);
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1 << 20), ps, rays); // the leaf size is clamped
+
+    // The primitives sharing a triangle have the same centroid, any of them may be the closest hit
+    std::vector<std::shared_ptr<Primitive>> same;
+    std::shared_ptr<Material> material = std::make_shared<Material>(RGBAf(1, 1, 1, 1), RGBAf(1, 1, 1, 1));
+    std::shared_ptr<Triangle> triangle = std::make_shared<Triangle>(cluster, 0);
+    for(int i = 0; i < nCluster; ++i)
+        same.push_back(std::make_shared<GeometicPrimitive>(triangle, material));
+    Ray ray(Point3f(0, 0, 0), Normalize(Vector3f(triangle->Vertex(0) + triangle->Vertex(1) + triangle->Vertex(2)) / 3));
+    Ray expected = ray;
+    SurfaceInteraction isect;
+    ASSERT_TRUE(same[0]->Intersect(expected, isect));
+    for(BVHAccel::SplitMethod method: {BVHAccel::SplitMethod::SAH, BVHAccel::SplitMethod::HLBVH, BVHAccel::SplitMethod::SBVH}) {
+        BVHAccel bvh(same, method);
+        Ray r = ray;
+        EXPECT_TRUE(bvh.Intersect(r, isect));
+        EXPECT_EQ(r.tMax, expected.tMax);
+        EXPECT_TRUE(bvh.IntersectP(ray));
+    }
+}
+
+TEST(BVHAccel, SBVH) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 5000, 1, 0.5); // large triangles overlap each other a lot
+    std::vector<Ray> rays;
+    generateTestRays(rays, 1000);
+    std::chrono::milliseconds begin, end;
+
+    auto sahBVH = buildBVH(ps, BVHAccel::SplitMethod::SAH, begin, end);
+    printTime("Build BVH with SAH took: ", begin, end);
+    auto sbvh = buildBVH(ps, BVHAccel::SplitMethod::SBVH, begin, end);
+    printTime("Build BVH with SBVH took: ", begin, end);
+    
+    for(const Ray &r: rays) { // duplicated references must not change the closest hit
+        Ray r0 = r, r1 = r;
+        SurfaceInteraction isect0, isect1;
+        bool hit0 = false;
+        for(const auto &p: ps) hit0 |= p->Intersect(r0, isect0);
+        bool hit1 = sbvh->Intersect(r1, isect1);
+        EXPECT_EQ(hit0, hit1);
+        EXPECT_EQ(r0.tMax, r1.tMax);
+        EXPECT_EQ(isect0.primitive, isect1.primitive);
+        EXPECT_EQ(sbvh->IntersectP(r), hit1);
+    }
+
+    std::vector<std::shared_ptr<Primitive>> plane;
+    if(!Scene::loadModel(plane, "../resource/plane/plane.obj")) return;
+    sahBVH = buildBVH(plane, BVHAccel::SplitMethod::SAH, begin, end);
+    sbvh = buildBVH(plane, BVHAccel::SplitMethod::SBVH, begin, end);
+    printTime("Build plane.obj BVH with SBVH took: ", begin, end);
+    generateTestRays(rays, 20000);
+    test_bvh_insersect(sahBVH, rays, begin, end);
+    printTime("Test plane.obj BVH with SAH took: ", begin, end);
+    test_bvh_insersect(sbvh, rays, begin, end);
+    printTime("Test plane.obj BVH with SBVH took: ", begin, end);
+}
+
+TEST(BVHAccel, PreSplit) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 5000, 13, 0.5); // large triangles overlap each other a lot
+    std::vector<Ray> rays;
+    generateTestRays(rays, 1000);
+    BVHBuildOptions options;
+    options.preSplitBudget = 0.5;
+    for(BVHAccel::SplitMethod method: {BVHAccel::SplitMethod::SAH, BVHAccel::SplitMethod::Middle, BVHAccel::SplitMethod::EqualCounts}) 
+        expectSameWithBruteForce(BVHAccel(ps, method, 4, options), ps, rays);
+    BVHAccel presplitBVH(ps, BVHAccel::SplitMethod::SAH, 1, options);
+    EXPECT_LT(presplitBVH.AnalyzeQuality().sahCost, BVHAccel(ps).AnalyzeQuality().sahCost);
+
+    std::vector<std::shared_ptr<Primitive>> plane;
+    if(!Scene::loadModel(plane, "../resource/plane/plane.obj")) return;
+    expectSameWithBruteForce(BVHAccel(plane, BVHAccel::SplitMethod::SAH, 1, options), plane, std::vector<Ray>(rays.begin(), rays.begin() + 100));
+}
+
+TEST(BVHAccel, LazyBuild) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000, 14);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 200);
+    BVHBuildOptions options;
+    options.lazyBuild = true;
+    options.lazySubtreeSize = 1024;
+    auto fullBVH = std::make_shared<BVHAccel>(ps);
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options), ps, rays);
+    BVHBuildOptions unpacked = options;
+    unpacked.packTriangles = false;
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, unpacked), ps, rays);
+
+    // Concurrent rays reaching the same subtrees build each of them once
+    auto concurrentBVH = std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::Middle, 4, options);
+    generateTestRays(rays, 5000);
+    std::vector<char> hits(rays.size());
+    ParallelForLoopExecutor::Init(4);
+    ParallelForLoopExecutor::ParallelFor1D([&](int64_t i){
+        Ray ray = rays[i];
+        SurfaceInteraction isect;
+        hits[i] = concurrentBVH->Intersect(ray, isect);
+    }, rays.size(), 64);
+    ParallelForLoopExecutor::Clean();
+    for(int i = 0; i < rays.size(); ++i) {
+        Ray ray = rays[i];
+        SurfaceInteraction isect;
+        EXPECT_EQ(hits[i], fullBVH->Intersect(ray, isect));
+    }
+    expectSameWithBruteForce(*concurrentBVH, ps, std::vector<Ray>(rays.begin(), rays.begin() + 200));
+
+    options.lazySubtreeSize = 1 << 20; // the root itself is lazy
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options), ps, std::vector<Ray>(rays.begin(), rays.begin() + 100));
+}
+
+TEST(BVHAccel, PLOC) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000, 15);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 200);
+    std::chrono::milliseconds begin, end;
+    auto plocBVH = buildBVH(ps, BVHAccel::SplitMethod::PLOC, begin, end);
+    printTime("Build BVH with PLOC took: ", begin, end);
+    expectSameWithBruteForce(*plocBVH, ps, rays);
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::PLOC, 4), ps, rays);
+    BVHBuildOptions options;
+    options.plocRadius = 1; // only the adjacent clusters
+    expectSameWithBruteForce(BVHAccel(std::vector<std::shared_ptr<Primitive>>(ps.begin(), ps.begin() + 1000), BVHAccel::SplitMethod::PLOC, 1, options), 
+                             std::vector<std::shared_ptr<Primitive>>(ps.begin(), ps.begin() + 1000), rays);
+
+    ParallelForLoopExecutor::Init(4);
+    auto parallelPLOCBVH = buildBVH(ps, BVHAccel::SplitMethod::PLOC, begin, end);
+    printTime("Build BVH with PLOC and four threads took: ", begin, end);
+    auto sahBVH = buildBVH(ps, BVHAccel::SplitMethod::SAH, begin, end);
+    printTime("Build BVH with SAH and four threads took: ", begin, end);
+    auto hlbvh = buildBVH(ps, BVHAccel::SplitMethod::HLBVH, begin, end);
+    printTime("Build BVH with HLBVH and four threads took: ", begin, end);
+    BVHQuality plocQuality = plocBVH->AnalyzeQuality();
+    BVHQuality sahQuality = sahBVH->AnalyzeQuality();
+    BVHQuality hlbvhQuality = hlbvh->AnalyzeQuality();
+    ParallelForLoopExecutor::Clean();
+    EXPECT_EQ(parallelPLOCBVH->AnalyzeQuality().sahCost, plocQuality.sahCost); // the same tree whatever the threads are
+    EXPECT_LT(plocQuality.sahCost, hlbvhQuality.sahCost);
+    LOG(INFO) << "SAH cost of PLOC: " << plocQuality.sahCost << ", SAH: " << sahQuality.sahCost << ", HLBVH: " << hlbvhQuality.sahCost;
+
+    generateTestRays(rays, 100000);
+    test_bvh_insersect(sahBVH, rays, begin, end);
+    printTime("Test BVH built with SAH took: ", begin, end);
+    test_bvh_insersect(plocBVH, rays, begin, end);
+    printTime("Test BVH built with PLOC took: ", begin, end);
+}
+
+TEST(BVHAccel, SweepSAH) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000, 16);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 200);
+    std::chrono::milliseconds begin, end;
+    auto sweepBVH = buildBVH(ps, BVHAccel::SplitMethod::SweepSAH, begin, end);
+    printTime("Build BVH with sweep SAH took: ", begin, end);
+    auto sahBVH = buildBVH(ps, BVHAccel::SplitMethod::SAH, begin, end);
+    printTime("Build BVH with binned SAH took: ", begin, end);
+    expectSameWithBruteForce(*sweepBVH, ps, rays);
+    expectSameWithBruteForce(BVHAccel(ps, BVHAccel::SplitMethod::SweepSAH, 8), ps, rays);
+    Float sweepCost = sweepBVH->AnalyzeQuality().sahCost, sahCost = sahBVH->AnalyzeQuality().sahCost;
+    LOG(INFO) << "SAH cost of sweep SAH: " << sweepCost << ", binned SAH: " << sahCost;
+    EXPECT_LT(sweepCost, sahCost);
+
+    std::vector<std::shared_ptr<Primitive>> plane;
+    if(!Scene::loadModel(plane, "../resource/plane/plane.obj")) return;
+    sahBVH = buildBVH(plane, BVHAccel::SplitMethod::SAH, begin, end);
+    sweepBVH = buildBVH(plane, BVHAccel::SplitMethod::SweepSAH, begin, end);
+    printTime("Build plane.obj BVH with sweep SAH took: ", begin, end);
+    generateTestRays(rays, 200000);
+    test_bvh_insersect(sahBVH, rays, begin, end);
+    printTime("Test plane.obj BVH with binned SAH took: ", begin, end);
+    test_bvh_insersect(sweepBVH, rays, begin, end);
+    printTime("Test plane.obj BVH with sweep SAH took: ", begin, end);
+}
+
+/**
+ * Trace the rays in packets of N, the last packet is partial if the amount isn't a multiple of N.
+ * Each ray must get the same hit and tMax with Intersect, and the same occlusion with IntersectP.
+*/
+template <int N>
+static void expectSamePacketHits(const BVHAccel &bvh, const std::vector<Ray> &rays) {
+    for(size_t begin = 0; begin < rays.size(); begin += N) {
+        RayPacket<N> packet;
+        packet.size = std::min<size_t>(N, rays.size() - begin);
+        for(int i = 0; i < packet.size; ++i) packet.rays[i] = rays[begin + i];
+        uint32_t occluded = bvh.IntersectPPacket(packet); // before IntersectPacket shortens tMax
+        HitPacket<N> hits;
+        bool anyHit = bvh.IntersectPacket(packet, hits);
+        EXPECT_EQ(anyHit, hits.mask != 0);
+        for(int i = 0; i < packet.size; ++i) {
+            Ray r = rays[begin + i];
+            SurfaceInteraction isect;
+            bool hit = bvh.Intersect(r, isect);
+            EXPECT_EQ(hit, (hits.mask >> i) & 1);
+            EXPECT_EQ(r.tMax, packet.rays[i].tMax);
+            if(hit) {
+                EXPECT_EQ(isect.primitive, hits.isects[i].primitive);
+            }
+            EXPECT_EQ(bvh.IntersectP(rays[begin + i]), (occluded >> i) & 1);
+        }
+        EXPECT_EQ(hits.mask >> packet.size, 0);
+    }
+}
+
+/**
+ * The rays of a pinhole camera at (0, 0, -3) looking at the origin, in blocks of 4x4 pixels so every 16 rays are coherent.
+*/
+static void generateCameraRays(std::vector<Ray> &rays, int resolution) {
+    for(int by = 0; by < resolution; by += 4)
+        for(int bx = 0; bx < resolution; bx += 4)
+            for(int y = by; y < by + 4; ++y)
+                for(int x = bx; x < bx + 4; ++x) {
+                    Vector3f d((x + 0.5f) / resolution - 0.5f, (y + 0.5f) / resolution - 0.5f, 1);
+                    rays.push_back(Ray(Point3f(0, 0, -3), Normalize(d)));
+                }
+}
+
+TEST(BVHAccel, PacketTraversal) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000, 21);
+    std::vector<Ray> cameraRays, randomRays;
+    generateCameraRays(cameraRays, 64);
+    generateTestRays(randomRays, 1001); // incoherent rays and a partial packet
+    BVHAccel bvh(ps, BVHAccel::SplitMethod::SAH, 4);
+    expectSamePacketHits<4>(bvh, cameraRays);
+    expectSamePacketHits<8>(bvh, cameraRays);
+    expectSamePacketHits<16>(bvh, cameraRays);
+    expectSamePacketHits<16>(bvh, randomRays);
+
+    BVHBuildOptions options;
+    options.packTriangles = false;
+    expectSamePacketHits<8>(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options), randomRays);
+    options.packTriangles = true;
+    options.layout = BVHLayout::VanEmdeBoas;
+    expectSamePacketHits<16>(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options), cameraRays);
+    options.layout = BVHLayout::DepthFirst;
+    options.lazyBuild = true;
+    options.lazySubtreeSize = 1000;
+    expectSamePacketHits<4>(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options), cameraRays);
+    options.lazyBuild = false;
+    options.compressNodes = true;
+    expectSamePacketHits<8>(BVHAccel(ps, BVHAccel::SplitMethod::SAH, 1, options), cameraRays);
+}
+
+TEST(BVHAccel, RayStream) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000, 22);
+    BVHAccel bvh(ps, BVHAccel::SplitMethod::SAH, 4);
+    std::vector<Ray> cameraRays;
+    generateCameraRays(cameraRays, 128);
+
+    // Ambient occlusion rays from the camera hits in random directions and in random order, incoherent one by one but coherent in aggregate
+    std::mt19937 rng(22);
+    std::uniform_real_distribution<Float> dist(-1, 1);
+    std::vector<Ray> rays;
+    for(const Ray &ray: cameraRays) {
+        SurfaceInteraction isect;
+        if(!bvh.Intersect(ray, isect)) continue;
+        for(int i = 0; i < 4; ++i) {
+            Vector3f d(dist(rng), dist(rng), dist(rng));
+            if(d.LengthSquared() < 1e-4) d = Vector3f(1, 0, 0);
+            rays.push_back(Ray(isect.p + Normalize(d) * 1e-3, Normalize(d)));
+        }
+    }
+    std::shuffle(rays.begin(), rays.end(), rng);
+    std::vector<Ray> streamRays = rays;
+    std::vector<SurfaceInteraction> isects;
+    std::vector<uint8_t> hits, occluded;
+    int nHits = bvh.IntersectStream(streamRays, isects, hits);
+    bvh.IntersectPStream(rays, occluded);
+    
+    std::vector<Ray> singleRays = rays;
+    std::vector<SurfaceInteraction> singleIsects(rays.size());
+    std::vector<uint8_t> singleHits(rays.size());
+    for(int i = 0; i < rays.size(); ++i) 
+        singleHits[i] = bvh.Intersect(singleRays[i], singleIsects[i]);
+    EXPECT_EQ(nHits, std::count(singleHits.begin(), singleHits.end(), 1));
+    for(int i = 0; i < rays.size(); ++i) {
+        EXPECT_EQ(singleHits[i], hits[i]);
+        EXPECT_EQ(singleRays[i].tMax, streamRays[i].tMax);
+        if(hits[i]) {
+            EXPECT_EQ(singleIsects[i].primitive, isects[i].primitive);
+        }
+        EXPECT_EQ(singleHits[i], occluded[i]);
+    }
+
+    rays.clear();
+    EXPECT_EQ(bvh.IntersectStream(rays, isects, hits), 0);
+    EXPECT_TRUE(isects.empty());
+}
+
+TEST(BVHAccel, DeferredHitRecord) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000, 23, 0.2); // large overlapping triangles, a ray finds many hits before the closest one
+    std::vector<Ray> rays;
+    generateCameraRays(rays, 256);
+    BVHAccel bvh(ps, BVHAccel::SplitMethod::SAH, 4);
+    BVHBuildOptions options;
+    options.packTriangles = false; // every hit builds an interaction in Triangle::Intersection
+    BVHAccel unpackedBVH(ps, BVHAccel::SplitMethod::SAH, 4, options);
+
+    std::vector<SurfaceInteraction> isects(rays.size()), unpackedIsects(rays.size());
+    std::vector<Ray> packedRays = rays, unpackedRays = rays;
+    for(int i = 0; i < rays.size(); ++i) { // the deferred interaction is built from the same ray and distance
+        bvh.Intersect(packedRays[i], isects[i]);
+        unpackedBVH.Intersect(unpackedRays[i], unpackedIsects[i]);
+        EXPECT_EQ(bvh.IntersectP(rays[i]), unpackedBVH.IntersectP(rays[i]));
+        EXPECT_EQ(packedRays[i].tMax, unpackedRays[i].tMax);
+        EXPECT_EQ(isects[i].primitive, unpackedIsects[i].primitive);
+        EXPECT_EQ(isects[i].shape, unpackedIsects[i].shape);
+        EXPECT_EQ(isects[i].p, unpackedIsects[i].p);
+        EXPECT_EQ(isects[i].n, unpackedIsects[i].n);
+        if(isects[i].primitive != nullptr) { // the hit point of Triangle is still on the ray
+            EXPECT_EQ(isects[i].p, rays[i].o + packedRays[i].tMax * rays[i].d);
+        }
+    }
+}
+
+/**
+ * Read a counter from the stats report, the counters are reset after reporting. Return 0 if it isn't reported.
+*/
+static int64_t readStatCounter(const std::string &title) {
+    StatsAccumulator accum;
+    StatRegisterer::Callback(accum);
+    FILE *fp = tmpfile();
+    accum.Print(fp);
+    rewind(fp);
+    int64_t value = 0;
+    char buffer[256];
+    while(fgets(buffer, sizeof(buffer), fp) != nullptr) {
+        std::string line = buffer;
+        if(line.find(title) != std::string::npos) value = std::stoll(line.substr(line.find_last_of(' ')));
+    }
+    fclose(fp);
+    return value;
+}
+
+TEST(BVHAccel, DistanceOrderedTraversal) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 50000, 24);
+    // A wall in front of the triangles occludes most of them from the camera
+    std::vector<int> idxs = {0, 1, 2, 0, 2, 3};
+    std::vector<Point3f> p = {Point3f(-3, -3, -1.5), Point3f(3, -3, -1.5), Point3f(3, 3, -1.5), Point3f(-3, 3, -1.5)};
+    std::vector<Normal3f> n(4);
+    std::shared_ptr<TriangleMesh> wall = std::make_shared<TriangleMesh>(2, 4, idxs, p, n);
+    std::shared_ptr<Material> material = std::make_shared<Material>(RGBAf(1, 1, 1, 1), RGBAf(1, 1, 1, 1));
+    for(int i = 0; i < 2; ++i) 
+        ps.push_back(std::make_shared<GeometicPrimitive>(std::make_shared<Triangle>(wall, i), material));
+    std::vector<Ray> rays;
+    generateCameraRays(rays, 256);
+    generateTestRays(rays, 10000); // from the center, not occluded
+
+    BVHAccel bvh(ps, BVHAccel::SplitMethod::SAH, 4);
+    BVHBuildOptions options;
+    options.distanceOrderedTraversal = true;
+    BVHAccel orderedBVH(ps, BVHAccel::SplitMethod::SAH, 4, options);
+    std::vector<Ray> orderedRays = rays, defaultRays = rays;
+    std::vector<SurfaceInteraction> isects(rays.size()), defaultIsects(rays.size());
+    for(int i = 0; i < rays.size(); ++i) 
+        bvh.Intersect(defaultRays[i], defaultIsects[i]);
+    readStatCounter("DistanceOrdered"); // reset the counters
+    for(int i = 0; i < rays.size(); ++i) 
+        orderedBVH.Intersect(orderedRays[i], isects[i]);
+    EXPECT_GT(readStatCounter("CulledEntries"), 0); // the nodes behind the wall are culled from the stack
+    for(int i = 0; i < rays.size(); ++i) {
+        EXPECT_EQ(defaultRays[i].tMax, orderedRays[i].tMax);
+        EXPECT_EQ(defaultIsects[i].primitive, isects[i].primitive);
+    }
+}
+
+TEST(BVHAccel, TraversalKernels) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 5000, 25, 0.2);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 500);
+    generateCameraRays(rays, 32); // the camera rays cover the octants with negative directions
+    BVHBuildOptions lazyOptions, compressedOptions, shortStackOptions, orderedOptions;
+    lazyOptions.lazyBuild = true;
+    lazyOptions.lazySubtreeSize = 512;
+    compressedOptions.compressNodes = true;
+    shortStackOptions.shortStackTraversal = true;
+    orderedOptions.distanceOrderedTraversal = true;
+    std::vector<std::shared_ptr<BVHAccel>> bvhs = {
+        std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH, 4),
+        std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SBVH, 4), // a triangle may be referenced by several leaves
+        std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH, 4, lazyOptions),
+        std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH, 4, compressedOptions),
+        std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH, 4, shortStackOptions),
+        std::make_shared<BVHAccel>(ps, BVHAccel::SplitMethod::SAH, 4, orderedOptions)};
+    for(const std::shared_ptr<BVHAccel> &bvh: bvhs) {
+        expectSameWithBruteForce(*bvh, ps, rays);
+        for(const Ray &r: rays) { // every hit before tMax is found once
+            std::set<const Primitive *> expected, found;
+            for(const auto &p: ps) {
+                Ray r0 = r;
+                SurfaceInteraction isect;
+                if(p->Intersect(r0, isect)) expected.insert(isect.primitive);
+            }
+            std::vector<SurfaceInteraction> isects;
+            Ray r1 = r;
+            ASSERT_EQ(bvh->IntersectAll(r1, isects), expected.size());
+            EXPECT_EQ(r1.tMax, r.tMax);
+            for(const SurfaceInteraction &isect: isects) found.insert(isect.primitive);
+            EXPECT_EQ(found, expected);
+        }
+    }
+
+    Ray ray(Point3f(0, 0, -5), Vector3f(0, 0, 1), 0.5); // stops before the triangles
+    std::vector<SurfaceInteraction> isects;
+    EXPECT_EQ(bvhs[0]->IntersectAll(ray, isects), 0);
+}
+
+TEST(BVHAccel, IntersectAllLargeCompressedTree) {
+    std::vector<std::shared_ptr<Primitive>> ps;
+    generateRandomTriangles(ps, 65535, 26, 0.1); // as many primitives as LAZY_SUBTREE, the nPrimitives of lazy leaves
+    BVHBuildOptions options;
+    options.compressNodes = true;
+    BVHAccel bvh(ps, BVHAccel::SplitMethod::SAH, 4), compressedBVH(ps, BVHAccel::SplitMethod::SAH, 4, options);
+    std::vector<Ray> rays;
+    generateTestRays(rays, 200);
+    int nHits = 0;
+    for(const Ray &r: rays) { // the compressed tree finds the same hits with the linear nodes
+        std::vector<SurfaceInteraction> isects, compressedIsects;
+        Ray r0 = r, r1 = r;
+        ASSERT_EQ(compressedBVH.IntersectAll(r1, compressedIsects), bvh.IntersectAll(r0, isects));
+        std::set<const Primitive *> expected, found;
+        for(const SurfaceInteraction &isect: isects) expected.insert(isect.primitive);
+        for(const SurfaceInteraction &isect: compressedIsects) found.insert(isect.primitive);
+        EXPECT_EQ(found, expected);
+        nHits += isects.size();
+    }
+    EXPECT_GT(nHits, rays.size());
+}
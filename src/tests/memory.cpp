@@ -0,0 +1,26 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "memory.h"
+
+using namespace pbrt;
+
+TEST(MemoryArena, Alloc) {
+    MemoryArena arena(1024);
+    int *a = arena.Alloc<int>(10);
+    for(int i = 0; i < 10; ++i) a[i] = i;
+    double *b = arena.Alloc<double>();
+    *b = 1.5;
+    EXPECT_EQ((uintptr_t)b % alignof(double), 0);
+    EXPECT_GE((uint8_t *)b, (uint8_t *)(a + 10)); // allocations in the same block never overlap
+    
+    uint8_t *big = arena.Alloc<uint8_t>(4096, false); // larger than the block size, it gets its own block
+    big[4095] = 1;
+    for(int i = 0; i < 10; ++i) EXPECT_EQ(a[i], i);
+    EXPECT_EQ(*b, 1.5);
+    EXPECT_GE(arena.TotalAllocated(), 1024 + 4096);
+
+    size_t total = arena.TotalAllocated();
+    arena.Reset();
+    arena.Alloc<int>(100);
+    EXPECT_EQ(arena.TotalAllocated(), total); // the blocks are reused after reset
+}
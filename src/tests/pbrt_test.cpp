@@ -8,6 +8,13 @@
 #include "primitive.h"
 #include "material.h"
 
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 namespace pbrt {
 void generateTestRays(std::vector<Ray> &rays, int size) {
     rays.reserve(size);
@@ -17,8 +24,79 @@ void generateTestRays(std::vector<Ray> &rays, int size) {
     }
 }
 
+std::shared_ptr<TriangleMesh> generateRandomTriangles(std::vector<std::shared_ptr<Primitive>> &ps, int size, unsigned int seed, Float triangleSize) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<Float> dist(-1.0, 1.0);
+    std::vector<int> idxs(size * 3);
+    std::vector<Point3f> p(size * 3);
+    std::vector<Normal3f> n(size * 3);
+    for(int i = 0; i < size; i++) { // small triangles scattered in [-1, 1]^3
+        Point3f center(dist(rng), dist(rng), dist(rng));
+        for(int j = 0; j < 3; j++) {
+            idxs[i * 3 + j] = i * 3 + j;
+            p[i * 3 + j] = center + Vector3f(dist(rng), dist(rng), dist(rng)) * triangleSize;
+        }
+    }
+    std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>(size, size * 3, idxs, p, n);
+    std::shared_ptr<Material> material = std::make_shared<Material>(RGBAf(1, 1, 1, 1), RGBAf(1, 1, 1, 1));
+    ps.reserve(ps.size() + size);
+    for(int i = 0; i < size; i++)
+        ps.push_back(std::make_shared<GeometicPrimitive>(std::make_shared<Triangle>(mesh, i), material));
+    return mesh;
+}
+
 void printTime(const std::string &prefix, const std::chrono::milliseconds &begin, const std::chrono::milliseconds &end) {
     LOG(INFO) << prefix << (end - begin).count() << " ms.";
 }
 
+#if defined(__linux__)
+static int openCacheCounter(uint64_t cache) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+CacheMissCounter::CacheMissCounter() {
+    fds[0] = fds[1] = -1;
+    counts[0] = counts[1] = 0;
+#if defined(__linux__)
+    fds[0] = openCacheCounter(PERF_COUNT_HW_CACHE_L1D);
+    fds[1] = openCacheCounter(PERF_COUNT_HW_CACHE_LL);
+#endif
+}
+
+CacheMissCounter::~CacheMissCounter() {
+#if defined(__linux__)
+    for(int fd: fds) 
+        if(fd >= 0) close(fd);
+#endif
+}
+
+void CacheMissCounter::start() {
+    if(!available()) return;
+#if defined(__linux__)
+    for(int fd: fds) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+void CacheMissCounter::stop() {
+    if(!available()) return;
+#if defined(__linux__)
+    for(int i = 0; i < 2; ++i) {
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if(read(fds[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i])) counts[i] = 0;
+    }
+#endif
+}
+
 } // namespace pbrt
\ No newline at end of file
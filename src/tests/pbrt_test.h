@@ -17,9 +17,31 @@
 
 namespace pbrt {
 
+struct TriangleMesh;
+
 void generateTestRays(std::vector<Ray> &rays, int size = 10000);
+std::shared_ptr<TriangleMesh> generateRandomTriangles(std::vector<std::shared_ptr<Primitive>> &ps, int size, unsigned int seed = 0, Float triangleSize = 0.05); // Return the mesh, so its points can be moved
 void printTime(const std::string &prefix, const std::chrono::milliseconds &begin, const std::chrono::milliseconds &end);
 
+/**
+ * Count the L1 data cache and the last level cache read misses of the current thread with perf events, it only works on Linux.
+ * If the counters can't be opened, e.g. perf_event_paranoid forbids it, available returns false and the counts are 0.
+*/
+class CacheMissCounter {
+public:
+    CacheMissCounter();
+    ~CacheMissCounter();
+    bool available() const { return fds[0] >= 0 && fds[1] >= 0; }
+    void start();
+    void stop(); // The counts are the misses between start and stop
+    int64_t l1Misses() const { return counts[0]; }
+    int64_t lastLevelMisses() const { return counts[1]; }
+
+private:
+    int fds[2];
+    int64_t counts[2];
+};
+
 } // namespace pbrt
 
 